@@ -420,6 +420,7 @@ void cpu_reset(CPUState *env)
     uint32_t id = env->cp15.c0_cpuid;
     uint32_t number_of_mpu_regions = env->number_of_mpu_regions;
     memset(env, 0, offsetof(CPUState, breakpoints));
+    io_access_regions_clear(env);
     if (id) {
         cpu_reset_model_id(env, id);
     }
@@ -1630,6 +1631,85 @@ do_fault:
 }
 #endif
 
+/* Shrinks ['start', 'end'] around 'address' so that it lies within a single one of the 'granule'-sized parts
+   of ['base', 'limit'], or entirely outside of it */
+static inline void mpu_clip_uniform_range(uint32_t address, uint32_t base, uint32_t limit, uint64_t granule, uint32_t *start,
+                                          uint32_t *end)
+{
+    uint32_t part_start, part_end;
+
+    if (address < base) {
+        if (base - 1 < *end) {
+            *end = base - 1;
+        }
+    } else if (address > limit) {
+        if (limit + 1 > *start) {
+            *start = limit + 1;
+        }
+    } else {
+        part_start = base + (address - base) / granule * granule;
+        part_end = part_start + granule - 1;
+        if (part_start > *start) {
+            *start = part_start;
+        }
+        if (part_end < *end) {
+            *end = part_end;
+        }
+    }
+}
+
+/*
+ * Find the largest part of the page of 'address' that contains 'address' and in which
+ * no MPU region or subregion starts or ends, so that all the accesses within it get the
+ * same result from the MPU. Returns false if the range is the whole page.
+ */
+static bool mpu_get_uniform_range(CPUState *env, uint32_t address, uint32_t *start, uint32_t *end)
+{
+    int n;
+    uint32_t size;
+    uint32_t base;
+    uint32_t mask;
+
+    *start = address & TARGET_PAGE_MASK;
+    *end = *start + TARGET_PAGE_SIZE - 1;
+
+    if (cpu->external_mmu_enabled) {
+        return false;
+    }
+#ifdef TARGET_PROTO_ARM_M
+    if (arm_feature(env, ARM_FEATURE_V8)) {
+        if (env->number_of_mpu_regions == 0 || !PMSA_ENABLED(env->pmsav8.ctrl)) {
+            return false;
+        }
+        for (n = 0; n < MAX_MPU_REGIONS; n++) {
+            if (env->pmsav8.rlar[n] & 0x1) {
+                base = env->pmsav8.rbar[n] & ~0x1f;
+                mask = (env->pmsav8.rlar[n] | 0x1f) - base;
+                mpu_clip_uniform_range(address, base, base + mask, (uint64_t)mask + 1, start, end);
+            }
+        }
+        return *start != (address & TARGET_PAGE_MASK) || *end != (address & TARGET_PAGE_MASK) + TARGET_PAGE_SIZE - 1;
+    }
+#endif
+    if ((env->cp15.c1_sys & 1) == 0 || !arm_feature(env, ARM_FEATURE_MPU)) {
+        return false;
+    }
+    for (n = 0; n < env->number_of_mpu_regions; n++) {
+        size = ((env->cp15.c6_size_and_enable[n] & MPU_SIZE_FIELD_MASK) >> 1) + 1;
+        if (!(env->cp15.c6_size_and_enable[n] & MPU_REGION_ENABLED_BIT) || size <= 4) {
+            continue;
+        }
+        base = env->cp15.c6_base_address[n];
+        mask = (1ull << size) - 1;
+        if (base & mask) {
+            continue;
+        }
+        /* the regions of at least 256 bytes are split into 8 subregions, see get_mpu_subregion_number */
+        mpu_clip_uniform_range(address, base, base + mask, size >= 8 ? 1ull << (size - 3) : (uint64_t)mask + 1, start, end);
+    }
+    return *start != (address & TARGET_PAGE_MASK) || *end != (address & TARGET_PAGE_MASK) + TARGET_PAGE_SIZE - 1;
+}
+
 inline int get_phys_addr(CPUState *env, uint32_t address, int access_type, int is_user, uint32_t *phys_ptr, int *prot,
                                 target_ulong *page_size, int no_page_fault)
 {
@@ -1687,6 +1767,14 @@ int cpu_handle_mmu_fault (CPUState *env, target_ulong address, int access_type,
     // for PMSA returns enum mpu_result
 
     if (ret == TRANSLATE_SUCCESS) {
+        uint32_t sub_start, sub_end;
+        if (mpu_get_uniform_range(env, phys_addr, &sub_start, &sub_end)) {
+            /* An MPU region covers only a part of the page, the accesses outside of the parts already
+               checked go through the MPU again */
+            tlb_set_subpage(env, address & TARGET_PAGE_MASK, phys_addr & TARGET_PAGE_MASK, prot, mmu_idx,
+                            (address & TARGET_PAGE_MASK) + (sub_start & ~TARGET_PAGE_MASK), sub_end - sub_start + 1, prot);
+            return TRANSLATE_SUCCESS;
+        }
         /* Map a single [sub]page.  */
         phys_addr &= TARGET_PAGE_MASK;
         address &= TARGET_PAGE_MASK;
@@ -33,6 +33,7 @@
 #include "tb-helper.h"
 
 #include "debug.h"
+#include "tb-cache.h"
 
 #define abort() do { cpu_abort(cpu, "ABORT at %s : %d\n", __FILE__, __LINE__); } while (0)
 
@@ -3622,12 +3623,11 @@ static inline void gen_goto_tb(DisasContext *s, int n, uint32_t dest)
 
     tb = s->base.tb;
     if ((tb->pc & TARGET_PAGE_MASK) == (dest & TARGET_PAGE_MASK)) {
-        tcg_gen_goto_tb(n);
         gen_set_pc_im(dest);
-        gen_exit_tb(tb, n);
+        gen_chained_exit_tb(tb, n, dest);
     } else {
         gen_set_pc_im(dest);
-        gen_exit_tb_no_chaining(tb);
+        gen_lookup_and_goto_ptr(tb);
     }
 }
 
@@ -6541,7 +6541,7 @@ static int do_coproc_insn(CPUState *env, DisasContext *s, uint32_t insn, int cpn
                     tmp64 = tcg_const_i64(ri->resetvalue);
                 } else if (ri->readfn) {
                     tmp64 = tcg_temp_new_i64();
-                    TCGv_ptr ptr = tcg_const_ptr((int64_t)ri);
+                    TCGv_ptr ptr = tcg_const_host_ptr(ri);
                     gen_helper_get_cp_reg64(tmp64, cpu_env, ptr);
                     tcg_temp_free_ptr(ptr);
                 } else if (ri->fieldoffset != 0) {
@@ -6564,7 +6564,7 @@ static int do_coproc_insn(CPUState *env, DisasContext *s, uint32_t insn, int cpn
                     tmp = tcg_const_i32(ri->resetvalue);
                 } else if (ri->readfn) {
                     tmp = tcg_temp_new_i32();
-                    TCGv_ptr ptr = tcg_const_ptr((int64_t)ri);
+                    TCGv_ptr ptr = tcg_const_host_ptr(ri);
                     gen_helper_get_cp_reg(tmp, cpu_env, ptr);
                     tcg_temp_free_ptr(ptr);
                 } else if (ri->fieldoffset != 0) {
@@ -6601,7 +6601,7 @@ static int do_coproc_insn(CPUState *env, DisasContext *s, uint32_t insn, int cpn
                 tcg_temp_free_i32(tmplo);
                 tcg_temp_free_i32(tmphi);
                 if (ri->writefn) {
-                    TCGv_ptr ptr = tcg_const_ptr((int64_t)ri);
+                    TCGv_ptr ptr = tcg_const_host_ptr(ri);
                     gen_helper_set_cp_reg64(cpu_env, ptr, tmp64);
                     tcg_temp_free_ptr(ptr);
                 } else if (ri->fieldoffset != 0) {
@@ -6615,7 +6615,7 @@ static int do_coproc_insn(CPUState *env, DisasContext *s, uint32_t insn, int cpn
             } else {
                 TCGv_i32 tmp = load_reg(s, rt);
                 if (ri->writefn) {
-                    TCGv_ptr ptr = tcg_const_ptr((int64_t)ri);
+                    TCGv_ptr ptr = tcg_const_host_ptr(ri);
                     gen_helper_set_cp_reg(cpu_env, ptr, tmp);
                     tcg_temp_free_ptr(ptr);
                     tcg_temp_free_i32(tmp);
@@ -10460,11 +10460,14 @@ uint32_t gen_intermediate_code_epilogue(CPUState *env, DisasContextBase *base)
         gen_goto_tb(dc, 1, dc->base.pc);
         break;
     default:
-    case DISAS_JUMP:
     case DISAS_UPDATE:
         /* indicate that the hash table must be used to find the next TB */
         gen_exit_tb_no_chaining(dc->base.tb);
         break;
+    case DISAS_JUMP:
+        /* only the pc changed, the next TB can be looked up without leaving the generated code */
+        gen_lookup_and_goto_ptr(dc->base.tb);
+        break;
     case DISAS_TB_JUMP:
         /* nothing more to generate */
         break;
@@ -10541,3 +10544,14 @@ void cpu_exec_epilogue(CPUState *env)
 void cpu_exec_prologue(CPUState *env)
 {
 }
+
+uint64_t tb_cache_target_settings(CPUState *env, uint64_t hash)
+{
+    uint32_t settings[] = {
+        env->features,
+        env->cp15.c15_cpar,
+        env->cp15.c9_pmuserenr,
+        env->teecr,
+    };
+    return tb_cache_hash(hash, settings, sizeof(settings));
+}
@@ -44,11 +44,8 @@
 // TCG function call adjustments.
 #define tcg_constant_i32    tcg_const_i32
 #define tcg_constant_i64    tcg_const_i64
-#if HOST_LONG_BITS == 32
-#define tcg_constant_ptr(x) tcg_const_ptr((int32_t)x)
-#else
-#define tcg_constant_ptr(x) tcg_const_ptr((int64_t)x)
-#endif
+// Only used for the addresses of the ARMCPRegInfo structures of this process.
+#define tcg_constant_ptr(x) tcg_const_host_ptr((const void *)(uintptr_t)(x))
 #define tcg_constant_tl     tcg_const_tl
 
 #define ARM_GETPC()         ((uintptr_t)GETPC())
@@ -476,11 +473,10 @@ static inline uint32_t tb_cflags(TranslationBlock *tb)
     return tb->cflags;
 }
 
-// TODO: Port 'tcg_gen_lookup_and_goto_ptr' for more efficient jumps?
-//       The upstream function has no arguments.
+// The upstream function has no arguments.
 static inline void tcg_gen_lookup_and_goto_ptr(DisasContext *dc)
 {
-    gen_exit_tb_no_chaining(dc->base.tb);
+    gen_lookup_and_goto_ptr(dc->base.tb);
 }
 
 static inline ARMMMUIdx el_to_arm_mmu_idx(CPUState *env, int el)
@@ -653,6 +649,14 @@ static inline uint64_t arm_ttbr1(CPUState *env, int el)
     return env->cp15.ttbr1_el[address_translation_el(env, el)];
 }
 
+/* The ASID of the translation regime of 'el'; it is 0 for the regimes without ASIDs, as their TTBRs have these bits RES0 */
+static inline uint16_t arm_asid(CPUState *env, int el)
+{
+    uint64_t tcr = arm_tcr(env, el);
+    uint64_t ttbr = extract64(tcr, 22, 1) ? arm_ttbr1(env, el) : arm_ttbr0(env, el); // TCR.A1
+    return extract64(ttbr, 48, extract64(tcr, 36, 1) ? 16 : 8);                      // TCR.AS
+}
+
 static inline void find_pending_irq_if_primask_unset(CPUState *env)
 {
 #ifdef TARGET_PROTO_ARM_M
@@ -466,6 +466,7 @@ void cpu_reset_state(CPUState *env)
     uint32_t id = env->cp15.c0_cpuid;
 
     memset(env, 0, offsetof(CPUState, breakpoints));
+    io_access_regions_clear(env);
 
     // Based on 'gen_clrex' and 'gen_store_exclusive' it seems -1 means the address isn't valid.
     env->exclusive_addr = -1;
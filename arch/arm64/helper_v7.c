@@ -655,6 +655,7 @@ int cpu_handle_mmu_fault(CPUState *env, target_ulong address, int access_type, i
         /* Map a single [sub]page.  */
         phys_addr &= TARGET_PAGE_MASK;
         address &= TARGET_PAGE_MASK;
+        tlb_set_asid(env, arm_asid(env, arm_mmu_idx_to_el(core_to_aa64_mmu_idx(mmu_idx))));
         tlb_set_page(env, address, phys_addr, prot, mmu_idx, page_size);
     }
     return ret;
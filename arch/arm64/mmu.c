@@ -46,6 +46,13 @@ static uint64_t get_table_address(CPUState *env, target_ulong address, uint64_t
     return base_addr + (table_offset * 8);
 }
 
+// The bits of 'address' translated by the levels from 'base_level' to the one above 'level'.
+static inline uint64_t table_walk_prefix(target_ulong address, uint32_t base_level, uint32_t level, int page_size_shift)
+{
+    return extract64(address, MMU_LEVEL_TO_VA_SIZE_SHIFT(level - 1, page_size_shift),
+                     (level - base_level) * MMU_Ln_XLAT_VA_SIZE_SHIFT(page_size_shift));
+}
+
 static inline void parse_desc(uint32_t va_size_shift, uint64_t desc, uint32_t ips, target_ulong address, int is_user,
                               target_ulong *phys_ptr, int *prot, target_ulong *page_size)
 {
@@ -187,7 +194,20 @@ int get_phys_addr_v8(CPUState *env, target_ulong address, int access_type, int m
     ISSFaultStatusCode fault_code = -1;
     uint64_t desc_addr;
     uint64_t desc;
-    for (level = MMU_GET_BASE_XLAT_LEVEL(64 - tsz, page_size_shift); level <= MMU_XLAT_LAST_LEVEL; level++) {
+
+    // Go on from the deepest table an earlier walk reached for these addresses.
+    uint32_t base_level = MMU_GET_BASE_XLAT_LEVEL(64 - tsz, page_size_shift);
+    uint64_t root = table_addr;
+    uint32_t walk = (ips << 16) | (page_size_shift << 8) | base_level;
+    uint64_t table;
+    for (level = MMU_XLAT_LAST_LEVEL; level > base_level; level--) {
+        if (ptw_cache_lookup(env, root, walk, level, table_walk_prefix(address, base_level, level, page_size_shift), &table)) {
+            table_addr = table;
+            break;
+        }
+    }
+
+    for (; level <= MMU_XLAT_LAST_LEVEL; level++) {
         desc_addr = get_table_address(env, address, table_addr, page_size_shift, level);
         desc = ldq_phys(desc_addr);
 
@@ -215,6 +235,8 @@ int get_phys_addr_v8(CPUState *env, target_ulong address, int access_type, int m
             }
 
             table_addr = extract64(desc, page_size_shift, ips_bits[ips] - page_size_shift) << page_size_shift;
+            ptw_cache_insert(env, root, walk, level + 1, table_walk_prefix(address, base_level, level + 1, page_size_shift),
+                             table_addr);
             break;
         default:
             // It's debug because translation failures can be caused by a valid software behaviour.
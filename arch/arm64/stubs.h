@@ -145,7 +145,6 @@ FUNC_STUB(qemu_guest_getrandom)
 FUNC_STUB(regime_el)
 FUNC_STUB(tbi_check)
 FUNC_STUB(tcma_check)
-FUNC_STUB(tlb_index)
 FUNC_STUB(useronly_clean_ptr)
 
 #define BP_MEM_READ             stub_abort("BP_MEM_READ")
@@ -284,7 +283,6 @@ FUNC_STUB_GENERIC(get_arm_cp_reginfo, void*)
 FUNC_STUB(target_disas)
 FUNC_STUB_GENERIC(tcg_last_op, void *)
 FUNC_STUB(tcg_set_insn_start_param)
-FUNC_STUB_GENERIC(tlb_entry, void *)
 FUNC_STUB(tlb_hit)
 FUNC_STUB(translator_ldl_swap)
 FUNC_STUB(translator_lduw_swap)
@@ -1558,6 +1558,17 @@ WRITE_FUNCTION(64, tlbi_va,
     tlb_flush_page_masked(env, pageaddr, indexes_mask, true);
 })
 
+WRITE_FUNCTION(64, tlbi_asid,
+{
+    tlbi_print_stub_logs(env, info);
+
+    // The upper 8 bits of the ASID are ignored with 8-bit ASIDs.
+    uint32_t tlbi_target_el = ARM_CP_GET_MIN_EL(info->type);
+    uint16_t asid = extract64(value, 48, extract64(arm_tcr(env, tlbi_target_el), 36, 1) ? 16 : 8);
+    uint16_t indexes_mask = tlbi_get_mmu_indexes_mask(env, info);
+    tlb_flush_asid_masked(env, asid, indexes_mask);
+})
+
 WRITE_FUNCTION(64, tlbi_vmall,
 {
     tlbi_print_stub_logs(env, info);
@@ -1635,12 +1646,12 @@ ARMCPRegInfo aarch64_instructions[] = {
     ARM64_CP_REG_DEFINE(TLBI ALLE3NXS,           1,   6,   9,   7,   0,  3, WO, WRITEFN(tlbi_flush_all))
     ARM64_CP_REG_DEFINE(TLBI ALLE3OS,            1,   6,   8,   1,   0,  3, WO, WRITEFN(tlbi_flush_all))
     ARM64_CP_REG_DEFINE(TLBI ALLE3OSNXS,         1,   6,   9,   1,   0,  3, WO, WRITEFN(tlbi_flush_all))
-    ARM64_CP_REG_DEFINE(TLBI ASIDE1,             1,   0,   8,   7,   2,  1, WO, WRITEFN(tlbi_flush_all))
-    ARM64_CP_REG_DEFINE(TLBI ASIDE1IS,           1,   0,   8,   3,   2,  1, WO, WRITEFN(tlbi_flush_all))
-    ARM64_CP_REG_DEFINE(TLBI ASIDE1ISNXS,        1,   0,   9,   3,   2,  1, WO, WRITEFN(tlbi_flush_all))
-    ARM64_CP_REG_DEFINE(TLBI ASIDE1NXS,          1,   0,   9,   7,   2,  1, WO, WRITEFN(tlbi_flush_all))
-    ARM64_CP_REG_DEFINE(TLBI ASIDE1OS,           1,   0,   8,   1,   2,  1, WO, WRITEFN(tlbi_flush_all))
-    ARM64_CP_REG_DEFINE(TLBI ASIDE1OSNXS,        1,   0,   9,   1,   2,  1, WO, WRITEFN(tlbi_flush_all))
+    ARM64_CP_REG_DEFINE(TLBI ASIDE1,             1,   0,   8,   7,   2,  1, WO, WRITEFN(tlbi_asid))
+    ARM64_CP_REG_DEFINE(TLBI ASIDE1IS,           1,   0,   8,   3,   2,  1, WO, WRITEFN(tlbi_asid))
+    ARM64_CP_REG_DEFINE(TLBI ASIDE1ISNXS,        1,   0,   9,   3,   2,  1, WO, WRITEFN(tlbi_asid))
+    ARM64_CP_REG_DEFINE(TLBI ASIDE1NXS,          1,   0,   9,   7,   2,  1, WO, WRITEFN(tlbi_asid))
+    ARM64_CP_REG_DEFINE(TLBI ASIDE1OS,           1,   0,   8,   1,   2,  1, WO, WRITEFN(tlbi_asid))
+    ARM64_CP_REG_DEFINE(TLBI ASIDE1OSNXS,        1,   0,   9,   1,   2,  1, WO, WRITEFN(tlbi_asid))
     ARM64_CP_REG_DEFINE(TLBI IPAS2E1,            1,   4,   8,   4,   1,  1, WO, WRITEFN(tlbi_flush_all))
     ARM64_CP_REG_DEFINE(TLBI IPAS2E1IS,          1,   4,   8,   0,   1,  1, WO, WRITEFN(tlbi_flush_all))
     ARM64_CP_REG_DEFINE(TLBI IPAS2E1ISNXS,       1,   4,   9,   0,   1,  1, WO, WRITEFN(tlbi_flush_all))
@@ -395,9 +395,8 @@ static inline void gen_goto_tb(DisasContext *s, int n, uint64_t dest)
 
     tb = s->base.tb;
     if ((tb->pc & TARGET_PAGE_MASK) == (dest & TARGET_PAGE_MASK)) {
-        tcg_gen_goto_tb(n);
         gen_a64_set_pc_im(dest);
-        gen_exit_tb(tb, n);
+        gen_chained_exit_tb(tb, n, dest);
     } else {
         gen_a64_set_pc_im(dest);
         gen_exit_tb_no_chaining(tb);
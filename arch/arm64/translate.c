@@ -31,6 +31,7 @@
 
 #include "tcg-op-atomic.h"
 #include "tcg-op-gvec.h"
+#include "tb-cache.h"
 
 #define ENABLE_ARCH_4T    arm_dc_feature(s, ARM_FEATURE_V4T)
 #define ENABLE_ARCH_5     arm_dc_feature(s, ARM_FEATURE_V5)
@@ -2604,9 +2605,8 @@ static inline void gen_goto_tb(DisasContext *s, int n, uint64_t dest)
 
     tb = s->base.tb;
     if ((tb->pc & TARGET_PAGE_MASK) == (dest & TARGET_PAGE_MASK)) {
-        tcg_gen_goto_tb(n);
         gen_set_pc_im(dest);
-        gen_exit_tb(s->base.tb, n);
+        gen_chained_exit_tb(s->base.tb, n, dest);
     } else {
         gen_set_pc_im(dest);
         gen_goto_ptr(s);
@@ -9943,3 +9943,11 @@ void translate_init(void)
     // The 'a64_translate_init' function is also called at the end of it.
     arm_translate_init();
 }
+
+uint64_t tb_cache_target_settings(CPUState *env, uint64_t hash)
+{
+    ARMCPU *cpu = env_archcpu(env);
+
+    hash = tb_cache_hash(hash, &env->features, sizeof(env->features));
+    return tb_cache_hash(hash, &cpu->isar, sizeof(cpu->isar));
+}
@@ -48,6 +48,7 @@ void cpu_reset(CPUState *env)
     memcpy(cpuid_model, env->cpuid_model, CPUID_MODEL_LENGTH * sizeof(uint32_t));
 
     memset(env, 0, offsetof(CPUState, breakpoints));
+    io_access_regions_clear(env);
 
     env->old_exception = -1;
 
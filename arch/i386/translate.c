@@ -29,6 +29,7 @@
 #include "tb-helper.h"
 
 #include "debug.h"
+#include "tb-cache.h"
 
 #define PREFIX_REPZ  0x01
 #define PREFIX_REPNZ 0x02
@@ -2299,9 +2300,8 @@ static inline void gen_goto_tb(DisasContext *s, int tb_num, target_ulong eip)
     if ((pc & TARGET_PAGE_MASK) == (tb->pc & TARGET_PAGE_MASK) ||
         (pc & TARGET_PAGE_MASK) == ((s->base.pc - 1) & TARGET_PAGE_MASK)) {
         /* jump to same page: we can use a direct jump */
-        tcg_gen_goto_tb(tb_num);
         gen_jmp_im(eip);
-        gen_exit_tb(tb, tb_num);
+        gen_chained_exit_tb(tb, tb_num, pc);
     } else {
         /* jump to another page: currently not optimized */
         gen_jmp_im(eip);
@@ -7886,3 +7886,15 @@ int process_interrupt(int interrupt_request, CPUState *env)
     }
     return 0;
 }
+
+uint64_t tb_cache_target_settings(CPUState *env, uint64_t hash)
+{
+    uint32_t settings[] = {
+        env->cpuid_vendor1,
+        env->cpuid_features,
+        env->cpuid_ext_features,
+        env->cpuid_ext2_features,
+        env->cpuid_ext3_features,
+    };
+    return tb_cache_hash(hash, settings, sizeof(settings));
+}
@@ -31,6 +31,7 @@
 #include "tb-helper.h"
 
 #include "debug.h"
+#include "tb-cache.h"
 
 /* Include definitions for instructions classes and implementations flags */
 
@@ -3267,9 +3268,8 @@ static inline void gen_goto_tb(DisasContext *s, int n, target_ulong dest)
     }
 #endif
     if ((tb->pc & TARGET_PAGE_MASK) == (dest & TARGET_PAGE_MASK)) {
-        tcg_gen_goto_tb(n);
         tcg_gen_movi_tl(cpu_nip, dest & ~3);
-        gen_exit_tb(tb, n);
+        gen_chained_exit_tb(tb, n, dest & ~3);
     } else {
         tcg_gen_movi_tl(cpu_nip, dest & ~3);
         gen_exit_tb_no_chaining(tb);
@@ -9850,3 +9850,14 @@ int process_interrupt(int interrupt_request, CPUState *env)
 void cpu_exec_epilogue(CPUState *env)
 {
 }
+
+uint64_t tb_cache_target_settings(CPUState *env, uint64_t hash)
+{
+    uint64_t settings[] = {
+        env->insns_flags,
+        env->flags,
+        env->bfd_mach,
+        env->mmu_idx,
+    };
+    return tb_cache_hash(hash, settings, sizeof(settings));
+}
@@ -231,7 +231,12 @@ EXC_VOID_3(tlib_set_nmi, int32_t, nmi, int32_t, state, uint64_t, mcause)
 
 void tlib_allow_unaligned_accesses(int32_t allowed)
 {
+    // the unaligned accesses within a page are checked in the generated code only when they trap
+    if (!cpu->allow_unaligned_accesses != !allowed) {
+        tb_flush(cpu);
+    }
     cpu->allow_unaligned_accesses = allowed;
+    cpu->tb_allow_unaligned_accesses = allowed;
 }
 
 EXC_VOID_1(tlib_allow_unaligned_accesses, int32_t, allowed)
@@ -7,6 +7,10 @@
 #include "host-utils.h"
 
 #define SUPPORTS_GUEST_PROFILING
+/* the translator extends superblocks past the branches, see trace_follow */
+#define SUPPORTS_SUPERBLOCKS
+/* the misaligned accesses trap unless allow_unaligned_accesses is set, see ALIGNED_ONLY */
+#define TARGET_ALIGNED_ONLY
 
 #define TARGET_PAGE_BITS            12/* 4 KiB Pages */
 #if TARGET_LONG_BITS == 64
@@ -61,10 +65,16 @@ typedef struct opcode_hook_mask_t
 
 #define VLEN_MAX (1 << 16)
 
+#define SUPERBLOCK_MAX_SEGMENTS 16
+
 typedef struct DisasContext {
     struct DisasContextBase base;
     uint64_t opcode;
     target_ulong npc;
+    /* superblocks only: the guest code ranges translated so far, in the order of the trace */
+    target_ulong trace_start[SUPERBLOCK_MAX_SEGMENTS];
+    target_ulong trace_end[SUPERBLOCK_MAX_SEGMENTS];
+    int trace_segments;
 } DisasContext;
 
 typedef struct instruction_extensions_t {
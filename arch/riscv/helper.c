@@ -48,6 +48,7 @@ void cpu_reset(CPUState *env)
     target_ulong elen = env->elen;
 
     memset(env, 0, offsetof(CPUState, breakpoints));
+    io_access_regions_clear(env);
 
     env->interrupt_mode = interrupt_mode;
     env->csr_validation_level = csr_validation_level;
@@ -142,6 +143,12 @@ int riscv_cpu_hw_interrupts_pending(CPUState *env)
         enabled_interrupts);
 }
 
+/* the bits of 'addr' the walk translates before reaching a table of 'level' */
+static inline uint64_t page_walk_prefix(target_ulong addr, int levels, int ptidxbits, int level)
+{
+    return ((uint64_t)addr >> (PGSHIFT + (levels - level) * ptidxbits)) & ((1ULL << (level * ptidxbits)) - 1);
+}
+
 /* get_physical_address - get the physical address for this virtual address
  *
  * Do a page table walk to obtain the physical address corresponding to a
@@ -229,9 +236,20 @@ static int get_physical_address(CPUState *env, target_phys_addr_t *physical, int
         return TRANSLATE_FAIL;
     }
 
-    int ptshift = (levels - 1) * ptidxbits;
+    /* go on from the deepest table an earlier walk reached for these addresses */
+    target_ulong root = base;
+    uint32_t walk = (levels << 16) | (ptidxbits << 8) | ptesize;
+    uint64_t table;
     int i;
-    for (i = 0; i < levels; i++, ptshift -= ptidxbits) {
+    for (i = levels - 1; i > 0; i--) {
+        if (ptw_cache_lookup(env, root, walk, i, page_walk_prefix(addr, levels, ptidxbits, i), &table)) {
+            base = table;
+            break;
+        }
+    }
+
+    int ptshift = (levels - 1 - i) * ptidxbits;
+    for (; i < levels; i++, ptshift -= ptidxbits) {
         target_ulong idx = (addr >> (PGSHIFT + ptshift)) & ((1 << ptidxbits) - 1);
 
         /* check that physical address of PTE is legal */
@@ -245,6 +263,9 @@ static int get_physical_address(CPUState *env, target_phys_addr_t *physical, int
 
         if (PTE_TABLE(pte)) { /* next level of page table */
             base = ppn << PGSHIFT;
+            if (i + 1 < levels) {
+                ptw_cache_insert(env, root, walk, i + 1, page_walk_prefix(addr, levels, ptidxbits, i + 1), base);
+            }
         } else if ((pte & PTE_U) && (mode == PRV_S) &&
                    (!sum || ((env->privilege_architecture >= RISCV_PRIV1_11) && access_type == ACCESS_INST_FETCH))) {
             break;
@@ -335,7 +356,8 @@ int cpu_handle_mmu_fault(CPUState *env, target_ulong address, int access_type, i
     int pmp_access_type = 1 << access_type;
     int overlapping_region_id;
     int ret = TRANSLATE_FAIL;
-    target_ulong page_size = TARGET_PAGE_SIZE;
+    bool partial_page = false;
+    target_ulong sub_start, sub_end;
 
     ret = get_physical_address(env, &pa, &prot, address, access_type, mmu_idx, no_page_fault);
     pmp_prot = pmp_get_access(env, pa, access_width);
@@ -351,9 +373,10 @@ int cpu_handle_mmu_fault(CPUState *env, target_ulong address, int access_type, i
             if (env->pmp_state.addr[overlapping_region_id].sa > (pa & TARGET_PAGE_MASK)
                 || env->pmp_state.addr[overlapping_region_id].ea < (pa & TARGET_PAGE_MASK) + TARGET_PAGE_SIZE - 1)
             {
-                // this effectively makes the tlb page entry one-shot:
-                // thanks to this every access to this page will be verified against PMP
-                page_size = access_width;
+                // this makes the tlb page entry one-shot: the accesses to this page
+                // are verified against PMP unless they fall in a part of the page
+                // already checked, in which all the accesses get the same PMP result
+                partial_page = true;
             }
             else
             {
@@ -363,7 +386,17 @@ int cpu_handle_mmu_fault(CPUState *env, target_ulong address, int access_type, i
             }
         }
 
-        tlb_set_page(env, address & TARGET_PAGE_MASK, pa & TARGET_PAGE_MASK, prot, mmu_idx, page_size);
+        if (env->privilege_architecture >= RISCV_PRIV1_10) {
+            tlb_set_asid(env, get_field(env->satp, SATP_ASID));
+        }
+        if (partial_page) {
+            pmp_get_uniform_range(env, pa, &sub_start, &sub_end);
+            tlb_set_subpage(env, address & TARGET_PAGE_MASK, pa & TARGET_PAGE_MASK, prot, mmu_idx,
+                            (address & TARGET_PAGE_MASK) + (sub_start & ~TARGET_PAGE_MASK), sub_end - sub_start + 1,
+                            prot & pmp_get_access(env, sub_start, sub_end - sub_start + 1));
+        } else {
+            tlb_set_page(env, address & TARGET_PAGE_MASK, pa & TARGET_PAGE_MASK, prot, mmu_idx, TARGET_PAGE_SIZE);
+        }
     } else if (!cpu->external_mmu_enabled && !no_page_fault && ret == TRANSLATE_FAIL) {
         raise_mmu_exception(env, address, access_type);
     }
@@ -74,6 +74,7 @@ DEF_HELPER_4(csrrc, tl, env, tl, tl, tl)
 DEF_HELPER_2(sret, tl, env, tl)
 DEF_HELPER_2(mret, tl, env, tl)
 DEF_HELPER_1(wfi, void, env)
+DEF_HELPER_2(sfence_vma_asid, void, env, tl)
 DEF_HELPER_1(fence_i, void, env)
 
 // Vector helpers require 128-bit ints which aren't supported on 32-bit hosts.
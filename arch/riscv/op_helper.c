@@ -76,6 +76,7 @@ static int validate_vm(CPUState *env, target_ulong vm)
 
 static inline uint64_t cpu_riscv_read_instret(CPUState *env)
 {
+    cpu_sync_instructions_count(env);
     uint64_t retval = env->instructions_count_total_value;
     return retval;
 }
@@ -901,6 +902,12 @@ void helper_fence_i(CPUState *env)
     helper_invalidate_dirty_addresses_shared(env);
 }
 
+void helper_sfence_vma_asid(CPUState *env, target_ulong asid)
+{
+    /* the bits above ASIDLEN are ignored */
+    tlb_flush_asid(env, asid & get_field(SATP_ASID, SATP_ASID), true);
+}
+
 void do_unaligned_access(target_ulong addr, int access_type, int mmu_idx, void *retaddr)
 {
     env->badaddr = addr;
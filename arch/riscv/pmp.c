@@ -251,6 +251,41 @@ int pmp_find_overlapping(CPUState *env, target_ulong addr, target_ulong size, in
     return -1;
 }
 
+/*
+ * Find the largest part of the page of 'addr' that contains 'addr' and in which
+ * no PMP rule starts or ends, so that all the accesses within it get the same
+ * result from pmp_get_access
+ */
+void pmp_get_uniform_range(CPUState *env, target_ulong addr, target_ulong *start, target_ulong *end)
+{
+    int i;
+    target_ulong pmp_sa;
+    target_ulong pmp_ea;
+
+    *start = addr & TARGET_PAGE_MASK;
+    *end = *start + TARGET_PAGE_SIZE - 1;
+
+    for (i = 0; i < MAX_RISCV_PMPS; i++) {
+        pmp_sa = env->pmp_state.addr[i].sa;
+        pmp_ea = env->pmp_state.addr[i].ea;
+
+        if (pmp_sa <= addr) {
+            if (pmp_sa > *start) {
+                *start = pmp_sa;
+            }
+        } else if (pmp_sa - 1 < *end) {
+            *end = pmp_sa - 1;
+        }
+        if (pmp_ea >= addr) {
+            if (pmp_ea < *end) {
+                *end = pmp_ea;
+            }
+        } else if (pmp_ea + 1 > *start) {
+            *start = pmp_ea + 1;
+        }
+    }
+}
+
 /*
  * Find and return PMP configuration matching memory address
  */
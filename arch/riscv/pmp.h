@@ -64,5 +64,6 @@ void pmpaddr_csr_write(CPUState *env, uint32_t addr_index, target_ulong val);
 target_ulong pmpaddr_csr_read(CPUState *env, uint32_t addr_index);
 int pmp_get_access(CPUState *env, target_ulong addr, target_ulong size);
 int pmp_find_overlapping(CPUState *env, target_ulong addr, target_ulong size, int starting_index);
+void pmp_get_uniform_range(CPUState *env, target_ulong addr, target_ulong *start, target_ulong *end);
 
 #endif
@@ -29,6 +29,7 @@ static TCGv_i64 cpu_fpr[32]; /* assume F and D extensions */
 static TCGv cpu_vstart;
 
 #include "tb-helper.h"
+#include "tb-cache.h"
 
 void translate_init(void)
 {
@@ -216,13 +217,49 @@ static inline void gen_goto_tb(DisasContext *dc, int n, target_ulong dest)
 {
     if (use_goto_tb(dc, dest)) {
         /* chaining is only allowed when the jump is to the same page */
-        tcg_gen_goto_tb(n);
         tcg_gen_movi_tl(cpu_pc, dest);
-        gen_exit_tb(dc->base.tb, n);
+        gen_chained_exit_tb(dc->base.tb, n, dest);
     } else {
         tcg_gen_movi_tl(cpu_pc, dest);
-        gen_exit_tb_no_chaining(dc->base.tb);
+        gen_lookup_and_goto_ptr(dc->base.tb);
+    }
+}
+
+static bool trace_covers(DisasContext *dc, target_ulong pc)
+{
+    for (int i = 0; i < dc->trace_segments; i++) {
+        if (pc >= dc->trace_start[i] && pc < dc->trace_end[i]) {
+            return true;
+        }
     }
+    return false;
+}
+
+/* Superblocks only: continue the translation at 'dest', the next instruction or a jump target, instead of ending
+   the block. The trace stays on the page of its first instruction and above it, so that the block covers all of
+   its code, and ends where it would enter code it translated already, e.g. at a loop back-edge. */
+static bool trace_follow(DisasContext *dc, target_ulong dest)
+{
+    TranslationBlock *tb = dc->base.tb;
+
+    if (!(tb->cflags & CF_SUPERBLOCK) || dest < tb->pc || (dest & TARGET_PAGE_MASK) != (tb->pc & TARGET_PAGE_MASK)) {
+        return false;
+    }
+    /* the current segment ends with the jumping instruction */
+    dc->trace_end[dc->trace_segments - 1] = dc->npc;
+    if (trace_covers(dc, dest)) {
+        return false;
+    }
+    if (dest != dc->npc) {
+        if (dc->trace_segments == SUPERBLOCK_MAX_SEGMENTS) {
+            return false;
+        }
+        dc->trace_start[dc->trace_segments] = dest;
+        dc->trace_end[dc->trace_segments] = dest;
+        dc->trace_segments++;
+        dc->npc = dest;
+    }
+    return true;
 }
 
 static inline void try_run_gpr_access_hook(int reg_num, int is_write)
@@ -1229,6 +1266,9 @@ static void gen_jal(CPUState *env, DisasContext *dc, int rd, target_ulong imm)
         announce_if_jump_or_ret(rd, RA, imm, next_pc);
     }
 
+    if ((riscv_has_ext(env, RISCV_FEATURE_RVC) || (next_pc & 0x3) == 0) && trace_follow(dc, next_pc)) {
+        return;
+    }
     gen_goto_tb(dc, 0, dc->base.pc + imm); /* must use this for safety */
     dc->base.is_jmp = DISAS_BRANCH;
 
@@ -1257,7 +1297,7 @@ static void gen_jalr(CPUState *env, DisasContext *dc, uint32_t opc, int rd, int
             announce_if_jump_or_ret(rd, rs1, imm, PROFILER_TCG_PC);
         }
 
-        gen_exit_tb_no_chaining(dc->base.tb);
+        gen_lookup_and_goto_ptr(dc->base.tb);
 
         gen_set_label(misaligned);
         generate_exception_mbadaddr(dc, RISCV_EXCP_INST_ADDR_MIS);
@@ -1271,9 +1311,41 @@ static void gen_jalr(CPUState *env, DisasContext *dc, uint32_t opc, int rd, int
     tcg_temp_free(t0);
 }
 
+/* Superblocks only: the trace goes on in the direction of the branch whose block ran more often, the other one
+   becomes a side exit. Returns false if the block has to end with the branch, e.g. when neither block ran yet. */
+static bool gen_trace_branch(DisasContext *dc, TCGCond cond, TCGv source1, TCGv source2, target_long bimm)
+{
+    target_ulong taken = dc->base.pc + bimm;
+    target_ulong not_taken = dc->npc;
+    uint32_t taken_count, not_taken_count;
+    int l;
+
+    if (!(dc->base.tb->cflags & CF_SUPERBLOCK)) {
+        return false;
+    }
+    taken_count = tb_execution_count(dc->base.tb, taken);
+    not_taken_count = tb_execution_count(dc->base.tb, not_taken);
+
+    if (taken_count > not_taken_count && trace_follow(dc, taken)) {
+        l = gen_new_label();
+        tcg_gen_brcond_tl(cond, source1, source2, l);
+        tcg_gen_movi_tl(cpu_pc, not_taken);
+    } else if (not_taken_count != 0 && not_taken_count >= taken_count && trace_follow(dc, not_taken)) {
+        l = gen_new_label();
+        tcg_gen_brcond_tl(tcg_invert_cond(cond), source1, source2, l);
+        tcg_gen_movi_tl(cpu_pc, taken);
+    } else {
+        return false;
+    }
+    gen_superblock_side_exit(dc->base.tb);
+    gen_set_label(l);
+    return true;
+}
+
 static void gen_branch(CPUState *env, DisasContext *dc, uint32_t opc, int rs1, int rs2, target_long bimm)
 {
     int l = gen_new_label();
+    TCGCond cond;
     TCGv source1, source2;
     source1 = tcg_temp_new();
     source2 = tcg_temp_new();
@@ -1282,32 +1354,42 @@ static void gen_branch(CPUState *env, DisasContext *dc, uint32_t opc, int rs1, i
 
     switch (opc) {
     case OPC_RISC_BEQ:
-        tcg_gen_brcond_tl(TCG_COND_EQ, source1, source2, l);
+        cond = TCG_COND_EQ;
         break;
     case OPC_RISC_BNE:
-        tcg_gen_brcond_tl(TCG_COND_NE, source1, source2, l);
+        cond = TCG_COND_NE;
         break;
     case OPC_RISC_BLT:
-        tcg_gen_brcond_tl(TCG_COND_LT, source1, source2, l);
+        cond = TCG_COND_LT;
         break;
     case OPC_RISC_BGE:
-        tcg_gen_brcond_tl(TCG_COND_GE, source1, source2, l);
+        cond = TCG_COND_GE;
         break;
     case OPC_RISC_BLTU:
-        tcg_gen_brcond_tl(TCG_COND_LTU, source1, source2, l);
+        cond = TCG_COND_LTU;
         break;
     case OPC_RISC_BGEU:
-        tcg_gen_brcond_tl(TCG_COND_GEU, source1, source2, l);
+        cond = TCG_COND_GEU;
         break;
     default:
         kill_unknown(dc, RISCV_EXCP_ILLEGAL_INST);
-        break;
+        tcg_temp_free(source1);
+        tcg_temp_free(source2);
+        dc->base.is_jmp = DISAS_BRANCH;
+        return;
     }
 
+    bool misaligned = !riscv_has_ext(env, RISCV_FEATURE_RVC) && ((dc->base.pc + bimm) & 0x3);
+    if (!misaligned && gen_trace_branch(dc, cond, source1, source2, bimm)) {
+        tcg_temp_free(source1);
+        tcg_temp_free(source2);
+        return;
+    }
+
+    tcg_gen_brcond_tl(cond, source1, source2, l);
     gen_goto_tb(dc, 1, dc->npc);
     gen_set_label(l); /* branch taken */
-    if (!riscv_has_ext(env, RISCV_FEATURE_RVC) && ((dc->base.pc + bimm) & 0x3)) {
-        /* misaligned */
+    if (misaligned) {
         generate_exception_mbadaddr(dc, RISCV_EXCP_INST_ADDR_MIS);
         gen_exit_tb_no_chaining(dc->base.tb);
     } else {
@@ -2427,8 +2509,15 @@ static void gen_system(DisasContext *dc, uint32_t opc, int rd, int rs1, int rs2,
             }
             break;
         case 0x9: /* SFENCE.VMA */
-            /* TODO: handle ASID specific fences */
-            gen_helper_tlb_flush(cpu_env);
+            /* TODO: handle address specific fences, the TLB does not track the megapages yet */
+            if (rs2 == 0) {
+                gen_helper_tlb_flush(cpu_env);
+            } else {
+                TCGv asid = tcg_temp_new();
+                gen_get_gpr(asid, rs2);
+                gen_helper_sfence_vma_asid(cpu_env, asid);
+                tcg_temp_free(asid);
+            }
             break;
         case 0x10: /* HRET */
             kill_unknown(dc, RISCV_EXCP_ILLEGAL_INST);
@@ -5334,7 +5423,11 @@ static int disas_insn(CPUState *env, DisasContext *dc)
 
 void setup_disas_context(DisasContextBase *dc, CPUState *env)
 {
+    DisasContext *ctx = (DisasContext *)dc;
     dc->mem_idx = cpu_mmu_index(env);
+    ctx->trace_start[0] = dc->pc;
+    ctx->trace_end[0] = dc->pc;
+    ctx->trace_segments = 1;
 }
 
 int gen_breakpoint(DisasContextBase *base, CPUBreakpoint *bp)
@@ -5349,9 +5442,26 @@ int gen_breakpoint(DisasContextBase *base, CPUBreakpoint *bp)
 
 int gen_intermediate_code(CPUState *env, DisasContextBase *base)
 {
+    DisasContext *dc = (DisasContext *)base;
+    target_ulong pc = base->pc;
+    int length;
+
     tcg_gen_insn_start(base->pc);
 
-    base->tb->size += disas_insn(env, (DisasContext *)base);
+    length = disas_insn(env, dc);
+    if (base->tb->cflags & CF_SUPERBLOCK) {
+        /* the trace jumps around, the block spans from its start to the furthest instruction */
+        if (pc + length - base->tb->pc > base->tb->size) {
+            base->tb->size = pc + length - base->tb->pc;
+        }
+        dc->trace_end[dc->trace_segments - 1] = base->pc;
+        if (base->is_jmp == DISAS_NEXT && trace_covers(dc, base->pc)) {
+            /* the code that follows is already part of the trace */
+            base->is_jmp = DISAS_STOP;
+        }
+    } else {
+        base->tb->size += length;
+    }
 
     if ((base->pc - (base->tb->pc & TARGET_PAGE_MASK)) >= TARGET_PAGE_SIZE) {
         return 0;
@@ -5429,3 +5539,22 @@ void cpu_exec_epilogue(CPUState *env)
 void cpu_exec_prologue(CPUState *env)
 {
 }
+
+uint64_t tb_cache_target_settings(CPUState *env, uint64_t hash)
+{
+    target_ulong settings[] = {
+        env->misa,
+        env->vlenb,
+        env->elen,
+        env->privilege_architecture,
+        env->are_post_opcode_execution_hooks_enabled,
+        env->are_post_gpr_access_hooks_enabled,
+        env->post_gpr_access_hook_mask,
+        env->custom_instructions_count,
+        env->post_opcode_execution_hooks_count,
+    };
+    hash = tb_cache_hash(hash, settings, sizeof(settings));
+    hash = tb_cache_hash(hash, env->custom_instructions, env->custom_instructions_count * sizeof(env->custom_instructions[0]));
+    return tb_cache_hash(hash, env->post_opcode_execution_hook_masks,
+                         env->post_opcode_execution_hooks_count * sizeof(env->post_opcode_execution_hook_masks[0]));
+}
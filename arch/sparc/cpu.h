@@ -14,6 +14,8 @@
 #define TARGET_PAGE_BITS            12/* 4k */
 #define TARGET_PHYS_ADDR_SPACE_BITS 36
 #define TARGET_VIRT_ADDR_SPACE_BITS 32
+/* the misaligned accesses trap, see ALIGNED_ONLY */
+#define TARGET_ALIGNED_ONLY
 
 #include "cpu-defs.h"
 
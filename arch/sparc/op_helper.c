@@ -53,7 +53,6 @@ void HELPER(raise_exception)(int tt)
 
 target_ulong HELPER(ldstub)(uint32_t addr)
 {
-    int page_index;
     uintptr_t physaddr;
     int mmu_idx;
     void *retaddr;
@@ -61,19 +60,18 @@ target_ulong HELPER(ldstub)(uint32_t addr)
     uint8_t value = 0xFF;
 
     retaddr = GETPC();
-    page_index = (addr >> TARGET_PAGE_BITS) & (CPU_TLB_SIZE - 1);
     mmu_idx = env->psrs;
-    if (unlikely(env->tlb_table[mmu_idx][page_index].addr_write != (addr & (TARGET_PAGE_MASK)))) {
+    if (unlikely(tlb_entry(env, mmu_idx, addr)->addr_write != (addr & (TARGET_PAGE_MASK)))) {
         /* the page is not in the TLB : fill it */
         tlb_fill(env, addr, 1, mmu_idx, retaddr, 0, 1);
     }
 
-    if (unlikely(env->tlb_table[mmu_idx][page_index].addr_read != (addr & (TARGET_PAGE_MASK)))) {
+    if (unlikely(tlb_entry(env, mmu_idx, addr)->addr_read != (addr & (TARGET_PAGE_MASK)))) {
         /* the page is not in the TLB : fill it */
         tlb_fill(env, addr, 0, mmu_idx, retaddr, 0, 1);
     }
 
-    physaddr = addr + env->tlb_table[mmu_idx][page_index].addend;
+    physaddr = addr + tlb_entry(env, mmu_idx, addr)->addend;
 
     __atomic_exchange((uint8_t *)physaddr, &value, &ret, __ATOMIC_SEQ_CST);
 
@@ -82,26 +80,24 @@ target_ulong HELPER(ldstub)(uint32_t addr)
 
 target_ulong HELPER(swap)(target_ulong value, uint32_t addr)
 {
-    int page_index;
     uintptr_t physaddr;
     int mmu_idx;
     void *retaddr;
     uint32_t ret;
 
     retaddr = GETPC();
-    page_index = (addr >> TARGET_PAGE_BITS) & (CPU_TLB_SIZE - 1);
     mmu_idx = env->psrs;
-    if (unlikely(env->tlb_table[mmu_idx][page_index].addr_write != (addr & (TARGET_PAGE_MASK)))) {
+    if (unlikely(tlb_entry(env, mmu_idx, addr)->addr_write != (addr & (TARGET_PAGE_MASK)))) {
         /* the page is not in the TLB : fill it */
         tlb_fill(env, addr, 1, mmu_idx, retaddr, 0, 4);
     }
 
-    if (unlikely(env->tlb_table[mmu_idx][page_index].addr_read != (addr & (TARGET_PAGE_MASK)))) {
+    if (unlikely(tlb_entry(env, mmu_idx, addr)->addr_read != (addr & (TARGET_PAGE_MASK)))) {
         /* the page is not in the TLB : fill it */
         tlb_fill(env, addr, 0, mmu_idx, retaddr, 0, 4);
     }
 
-    physaddr = addr + env->tlb_table[mmu_idx][page_index].addend;
+    physaddr = addr + tlb_entry(env, mmu_idx, addr)->addend;
 
 #ifdef TARGET_WORDS_BIGENDIAN
     value = BIG_ENDIAN_CONVERT(value);
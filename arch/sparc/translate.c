@@ -30,6 +30,7 @@
 #include "tb-helper.h"
 
 #include "debug.h"
+#include "tb-cache.h"
 
 #define DYNAMIC_PC 1  /* dynamic pc value */
 #define JUMP_PC    2  /* dynamic pc value which takes only two values
@@ -195,10 +196,10 @@ static inline void gen_goto_tb(DisasContext *s, int tb_num, target_ulong pc, tar
     tb = s->base.tb;
     if ((pc & TARGET_PAGE_MASK) == (tb->pc & TARGET_PAGE_MASK) && (npc & TARGET_PAGE_MASK) == (tb->pc & TARGET_PAGE_MASK)) {
         /* jump to same page: we can use a direct jump */
-        tcg_gen_goto_tb(tb_num);
         tcg_gen_movi_tl(cpu_pc, pc);
         tcg_gen_movi_tl(cpu_npc, npc);
-        gen_exit_tb(tb, tb_num);
+        /* the next TB is keyed by npc as well */
+        gen_chained_exit_tb(tb, tb_num, -1);
     } else {
         /* jump to another page: currently not optimized */
         tcg_gen_movi_tl(cpu_pc, pc);
@@ -2932,3 +2933,8 @@ void cpu_exec_epilogue(CPUState *env)
 void cpu_exec_prologue(CPUState *env)
 {
 }
+
+uint64_t tb_cache_target_settings(CPUState *env, uint64_t hash)
+{
+    return tb_cache_hash(hash, &env->def->features, sizeof(env->def->features));
+}
@@ -33,11 +33,20 @@
 
 int gen_new_label(void);
 
+/* the most ops tcg_gen_mem_trace emits */
+#define MEM_TRACE_MAX_OPS 16
+
 extern TCGv_ptr cpu_env;
 extern CPUState *cpu;
 
 static int exit_no_hook_label;
 static int block_header_interrupted_label;
+static int block_header_slow_path_label;
+static int block_header_continue_label;
+static int mem_trace_flush_label;
+static int mem_trace_continue_label;
+/* the memory accesses of the block being translated are traced, see tcg_gen_mem_trace */
+static bool block_traces_memory;
 
 CPUBreakpoint *process_breakpoints(CPUState *env, target_ulong pc)
 {
@@ -50,46 +59,115 @@ CPUBreakpoint *process_breakpoints(CPUState *env, target_ulong pc)
     return NULL;
 }
 
-static inline void gen_update_instructions_count(TranslationBlock *tb)
+/* The address of the block, relocated along with the code, see tcg_gen_movi_tb_ptr */
+static inline TCGv_ptr gen_tb_pointer(TranslationBlock *tb)
 {
-    // Assumption: tb == cpu->current_tb when this block is executed
-    // This is ensured by the prepare_block_for_execution helper
-    TCGv_i64 tmp = tcg_temp_new_i64();
-    TCGv_i64 icount = tcg_temp_new_i64();
-    TCGv_ptr tb_pointer = tcg_const_ptr((tcg_target_long)tb);
+    TCGv_ptr tb_pointer = tcg_temp_new_ptr();
+    tcg_gen_movi_tb_ptr(tb_pointer, tb);
+    return tb_pointer;
+}
 
-    // (uint32_t) tb->icount
-    tcg_gen_ld32u_i64(icount, tb_pointer, offsetof(TranslationBlock, icount));
+/* Records a guest memory access in `mem_trace_buffer`. The record is written
+   before the access, so that its slow path can mark it as an IO one, see
+   mem_trace_record. There is no bounds check, the block header makes room for
+   all the accesses of the block, hence the fast path of the access stays inline. */
+void tcg_gen_mem_trace(TCGv addr, TCGMemOp memop, bool is_store)
+{
+    if (likely(!block_traces_memory)) {
+        return;
+    }
+    if ((gen_opc_ptr - tcg->gen_opc_buf) > OPC_MEM_TRACE_BUF_SIZE - MEM_TRACE_MAX_OPS) {
+        tlib_abortf("Too many memory accesses to trace in the instruction at 0x%" PRIx64, tcg->ctx->insn_start_pc);
+    }
 
-    // (uint32_t) cpu->instructions_count_value += tb->icount
-    tcg_gen_ld32u_i64(tmp, cpu_env, offsetof(CPUState, instructions_count_value));
-    tcg_gen_add_i64(tmp, tmp, icount);
-    tcg_gen_st32_i64(tmp, cpu_env, offsetof(CPUState, instructions_count_value));
+    uint64_t size = 1 << (memop & MO_SIZE);
+    uint64_t operation = is_store ? MEMORY_WRITE : MEMORY_READ;
+    TCGv_ptr next = tcg_temp_new_ptr();
+    TCGv_i64 value = tcg_temp_new_i64();
+
+    tcg_gen_ld_ptr(next, cpu_env, offsetof(CPUState, mem_trace_next));
+    tcg_gen_movi_i64(value, tcg->ctx->insn_start_pc);
+    tcg_gen_st_i64(value, next, offsetof(MemoryAccessTraceEntry, pc));
+    tcg_gen_extu_tl_i64(value, addr);
+    tcg_gen_st_i64(value, next, offsetof(MemoryAccessTraceEntry, address));
+    // `size` and `operation` with a single store
+#ifdef HOST_WORDS_BIGENDIAN
+    tcg_gen_movi_i64(value, size << 32 | operation);
+#else
+    tcg_gen_movi_i64(value, operation << 32 | size);
+#endif
+    tcg_gen_st_i64(value, next, offsetof(MemoryAccessTraceEntry, size));
+    tcg_gen_addi_ptr(next, next, sizeof(MemoryAccessTraceEntry));
+    tcg_gen_st_ptr(next, cpu_env, offsetof(CPUState, mem_trace_next));
+
+    tcg_temp_free_i64(value);
+    tcg_temp_free_ptr(next);
+}
 
-    // (uint64_t) cpu->instructions_count_total_value += tb->icount
-    tcg_gen_ld_i64(tmp, cpu_env, offsetof(CPUState, instructions_count_total_value));
-    tcg_gen_add_i64(tmp, tmp, icount);
-    tcg_gen_st_i64(tmp, cpu_env, offsetof(CPUState, instructions_count_total_value));
+/* Hands the trace buffer to the host unless all the accesses of a block fit in it */
+static inline void gen_mem_trace_check(void)
+{
+    TCGv_ptr next = tcg_temp_new_ptr();
+    TCGv_ptr limit = tcg_temp_new_ptr();
 
-    // (uint32_t) tb->instructions_count_dirty = 1
-    tcg_gen_movi_i64(tmp, 1);
-    tcg_gen_st32_i64(tmp, tb_pointer, offsetof(TranslationBlock, instructions_count_dirty));
+    mem_trace_flush_label = gen_new_label();
+    mem_trace_continue_label = gen_new_label();
 
-    tcg_temp_free_ptr(tb_pointer);
-    tcg_temp_free_i64(icount);
-    tcg_temp_free_i64(tmp);
+    tcg_gen_ld_ptr(next, cpu_env, offsetof(CPUState, mem_trace_next));
+    tcg_gen_ld_ptr(limit, cpu_env, offsetof(CPUState, mem_trace_limit));
+    tcg_gen_brcond_ptr(TCG_COND_GEU, next, limit, mem_trace_flush_label);
+    gen_set_label(mem_trace_continue_label);
+
+    tcg_temp_free_ptr(limit);
+    tcg_temp_free_ptr(next);
 }
 
 static inline void gen_block_header(TranslationBlock *tb)
 {
-    TCGv_i32 flag;
     exit_no_hook_label = gen_new_label();
-    TCGv_ptr tb_pointer = tcg_const_ptr((tcg_target_long)tb);
-    flag = tcg_temp_local_new_i32();
-    gen_helper_prepare_block_for_execution(flag, tb_pointer);
+    block_header_slow_path_label = gen_new_label();
+    block_header_continue_label = gen_new_label();
+
+    TCGv_ptr tb_pointer = gen_tb_pointer(tb);
+    TCGv_i64 budget = tcg_temp_new_i64();
+    TCGv_i64 icount = tcg_temp_new_i64();
+    TCGv_i64 exit_request = tcg_temp_new_i64();
+
+    // cpu->current_tb = tb
+    tcg_gen_st_ptr(tb_pointer, cpu_env, offsetof(CPUState, current_tb));
+
+    // The block fits in the budget only if `instructions_budget - tb->icount` does not borrow; `exit_request`
+    // is folded into the upper half of the result so that a single compare catches both. The budget is
+    // stored back unconditionally, the slow path gives the block back before recomputing it. This is the
+    // only counter the header updates, the instruction counters are derived from it, see
+    // `cpu_sync_instructions_count`.
+    tcg_gen_ld32u_i64(icount, tb_pointer, offsetof(TranslationBlock, icount));
+    tcg_gen_ld32u_i64(budget, cpu_env, offsetof(CPUState, instructions_budget));
+    tcg_gen_sub_i64(budget, budget, icount);
+    tcg_gen_st32_i64(budget, cpu_env, offsetof(CPUState, instructions_budget));
+    tcg_gen_ld32u_i64(exit_request, cpu_env, offsetof(CPUState, exit_request));
+    tcg_gen_shli_i64(exit_request, exit_request, 32);
+    tcg_gen_or_i64(budget, budget, exit_request);
     tcg_temp_free_ptr(tb_pointer);
-    tcg_gen_brcondi_i32(TCG_COND_NE, flag, 0, exit_no_hook_label);
-    tcg_temp_free_i32(flag);
+    tcg_gen_brcondi_i64(TCG_COND_GEU, budget, 1ULL << 32, block_header_slow_path_label);
+    gen_set_label(block_header_continue_label);
+
+    tcg_temp_free_i64(exit_request);
+    tcg_temp_free_i64(icount);
+    tcg_temp_free_i64(budget);
+
+    if (superblock_threshold != 0 && !(tb->cflags & (CF_SUPERBLOCK | CF_COUNT_MASK))) {
+        // (uint32_t) --tb->exec_count; the slow path marks the block as hot once it reaches zero. It is checked
+        // after the budget, so that the slow path is always entered with the block counted in the budget.
+        TCGv_i64 exec_count = tcg_temp_new_i64();
+        tb_pointer = gen_tb_pointer(tb);
+        tcg_gen_ld32u_i64(exec_count, tb_pointer, offsetof(TranslationBlock, exec_count));
+        tcg_gen_subi_i64(exec_count, exec_count, 1);
+        tcg_gen_st32_i64(exec_count, tb_pointer, offsetof(TranslationBlock, exec_count));
+        tcg_temp_free_ptr(tb_pointer);
+        tcg_gen_brcondi_i64(TCG_COND_EQ, exec_count, 0, block_header_slow_path_label);
+        tcg_temp_free_i64(exec_count);
+    }
 
     if (cpu->block_begin_hook_present) {
         TCGv_i32 result = tcg_temp_new_i32();
@@ -99,7 +177,10 @@ static inline void gen_block_header(TranslationBlock *tb)
         tcg_temp_free_i32(result);
     }
 
-    gen_update_instructions_count(tb);
+    block_traces_memory = cpu->tlib_is_on_memory_access_enabled;
+    if (block_traces_memory) {
+        gen_mem_trace_check();
+    }
 }
 
 static void gen_block_finished_hook(TranslationBlock *tb, uint32_t instructions_count)
@@ -130,6 +211,76 @@ void gen_exit_tb(TranslationBlock *tb, int n)
     gen_exit_tb_inner(tb, n, tb->icount);
 }
 
+/* The jump emitted here can be patched by tb_add_jump to go straight to the
+   next TB, skipping everything that follows it, so the hook is called before
+   the jump. Thus the guest pc has to be set before calling this function.
+   'dest' is the guest pc set, or -1 when the next TB is not keyed by the pc
+   alone; tlib_pretranslate_range uses it to translate the next TB ahead. */
+void gen_chained_exit_tb(TranslationBlock *tb, int n, target_ulong dest)
+{
+    tb_cold(tb)->jmp_target_pc[n] = dest;
+    gen_block_finished_hook(tb, tb->icount);
+    tcg_gen_goto_tb(n);
+    tcg_gen_exit_tb((uintptr_t)tb + n);
+}
+
+/* Jump to the TB matching the CPU state, used where the next pc is not known
+   at translation time. Generated code finds the TB in `tb_jmp_cache` and only
+   returns to the main loop if it is not there. */
+void gen_lookup_and_goto_ptr(TranslationBlock *tb)
+{
+    TCGv_ptr tc_ptr = tcg_temp_new_ptr();
+    gen_block_finished_hook(tb, tb->icount);
+    gen_helper_lookup_tb_ptr(tc_ptr, cpu_env);
+    tcg_gen_goto_ptr(tc_ptr);
+    tcg_temp_free_ptr(tc_ptr);
+}
+
+/* Leave a superblock through the taken path of a branch that was predicted
+   not taken. The block header has counted all the instructions of the block,
+   those following the branch are given back before jumping out. The guest pc
+   has to be set before calling this function. */
+void gen_superblock_side_exit(TranslationBlock *tb)
+{
+    TCGv_i64 tmp = tcg_temp_new_i64();
+    TCGv_i64 skipped = tcg_temp_new_i64();
+    TCGv_ptr tb_pointer = gen_tb_pointer(tb);
+
+    // skipped = tb->icount - <instructions translated so far>, the final size of the block is not known yet
+    tcg_gen_ld32u_i64(skipped, tb_pointer, offsetof(TranslationBlock, icount));
+    tcg_gen_subi_i64(skipped, skipped, tb->icount);
+
+    // (uint32_t) cpu->instructions_budget += skipped
+    tcg_gen_ld32u_i64(tmp, cpu_env, offsetof(CPUState, instructions_budget));
+    tcg_gen_add_i64(tmp, tmp, skipped);
+    tcg_gen_st32_i64(tmp, cpu_env, offsetof(CPUState, instructions_budget));
+
+    tcg_temp_free_ptr(tb_pointer);
+    tcg_temp_free_i64(skipped);
+    tcg_temp_free_i64(tmp);
+
+    gen_lookup_and_goto_ptr(tb);
+}
+
+/* The executions of the block at 'pc' counted since it was translated, the superblock translators follow the more
+   frequent successors. Only the blocks in the jump cache are considered, the others count as never executed. */
+uint32_t tb_execution_count(TranslationBlock *head, target_ulong pc)
+{
+    TranslationBlock *tb = cpu->tb_jmp_cache[tb_jmp_cache_hash_func(pc)];
+
+    if (tb == NULL || tb->invalid || tb->pc != pc || tb->cs_base != head->cs_base || tb->flags != head->flags) {
+        return 0;
+    }
+    if (tb->hot || (tb->cflags & CF_SUPERBLOCK)) {
+        // the counter stopped at the threshold
+        return superblock_threshold;
+    }
+    if (tb->cflags & CF_COUNT_MASK) {
+        return 0;
+    }
+    return superblock_threshold - tb->exec_count;
+}
+
 void gen_exit_tb_no_chaining(TranslationBlock *tb)
 {
     gen_block_finished_hook(tb, tb->icount);
@@ -139,7 +290,7 @@ void gen_exit_tb_no_chaining(TranslationBlock *tb)
 static inline void gen_block_footer(TranslationBlock *tb)
 {
     if (tlib_is_on_block_translation_enabled) {
-        tlib_on_block_translation(tb->pc, tb->size, tb->disas_flags);
+        tlib_on_block_translation(tb->pc, tb->size, tb_cold(tb)->disas_flags);
     }
 
     int finish_label = gen_new_label();
@@ -149,10 +300,30 @@ static inline void gen_block_footer(TranslationBlock *tb)
 
     if (cpu->block_begin_hook_present) {
         gen_set_label(block_header_interrupted_label);
+        // (uint32_t) cpu->instructions_budget += tb->icount, none of the instructions counted by the header ran
+        TCGv_i32 budget = tcg_temp_new_i32();
+        tcg_gen_ld_i32(budget, cpu_env, offsetof(CPUState, instructions_budget));
+        tcg_gen_addi_i32(budget, budget, tb->icount);
+        tcg_gen_st_i32(budget, cpu_env, offsetof(CPUState, instructions_budget));
+        tcg_temp_free_i32(budget);
         gen_interrupt_tb(tb, EXIT_TB_FORCE);
         tcg_gen_br(finish_label);
     }
 
+    if (block_traces_memory) {
+        gen_set_label(mem_trace_flush_label);
+        gen_helper_mem_trace_flush(cpu_env);
+        tcg_gen_br(mem_trace_continue_label);
+    }
+
+    gen_set_label(block_header_slow_path_label);
+    TCGv_ptr tb_pointer = gen_tb_pointer(tb);
+    TCGv_i32 flag = tcg_temp_new_i32();
+    gen_helper_prepare_block_for_execution(flag, tb_pointer);
+    tcg_gen_brcondi_i32(TCG_COND_EQ, flag, 0, block_header_continue_label);
+    tcg_temp_free_i32(flag);
+    tcg_temp_free_ptr(tb_pointer);
+
     gen_set_label(exit_no_hook_label);
     tcg_gen_exit_tb((uintptr_t)tb | EXIT_TB_FORCE);
 
@@ -160,10 +331,10 @@ static inline void gen_block_footer(TranslationBlock *tb)
     *gen_opc_ptr = INDEX_op_end;
 }
 
-static inline uint32_t get_max_tb_instruction_count(CPUState *env)
+static inline uint32_t get_max_tb_instruction_count(TranslationBlock *tb)
 {
-    uint32_t current_instructions_count_limit = env->instructions_count_limit - env->instructions_count_value;
-    return maximum_block_size > current_instructions_count_limit ? current_instructions_count_limit : maximum_block_size;
+    uint32_t cut_instructions_count = tb->cflags & CF_COUNT_MASK;
+    return cut_instructions_count != 0 && cut_instructions_count < maximum_block_size ? cut_instructions_count : maximum_block_size;
 }
 
 static void cpu_gen_code_inner(CPUState *env, TranslationBlock *tb)
@@ -171,12 +342,15 @@ static void cpu_gen_code_inner(CPUState *env, TranslationBlock *tb)
     DisasContext dcc;
     CPUBreakpoint *bp;
     DisasContextBase *dc = (DisasContextBase *)&dcc;
+    TranslationBlockCold *cold = tb_cold(tb);
 
-    uint32_t max_tb_icount = get_max_tb_instruction_count(env);
+    uint32_t max_tb_icount = get_max_tb_instruction_count(tb);
 
     tb->icount = 0;
-    tb->was_cut = false;
+    cold->was_cut = false;
     tb->size = 0;
+    cold->jmp_target_pc[0] = -1;
+    cold->jmp_target_pc[1] = -1;
     dc->tb = tb;
     dc->is_jmp = DISAS_NEXT;
     dc->pc = tb->pc;
@@ -194,7 +368,7 @@ static void cpu_gen_code_inner(CPUState *env, TranslationBlock *tb)
                 break;
             }
         }
-        tb->prev_size = tb->size;
+        cold->prev_size = tb->size;
 
         int do_break = 0;
         tb->icount++;
@@ -214,11 +388,11 @@ static void cpu_gen_code_inner(CPUState *env, TranslationBlock *tb)
             break;
         }
         if (tb->icount >= max_tb_icount) {
-            tb->was_cut = true;
+            cold->was_cut = true;
             break;
         }
     }
-    tb->disas_flags = gen_intermediate_code_epilogue(env, dc);
+    cold->disas_flags = gen_intermediate_code_epilogue(env, dc);
     gen_block_footer(tb);
 }
 
@@ -289,7 +463,7 @@ static int encode_search(TranslationBlock *tb, uint8_t *block)
     uint8_t *p = block;
     int i, j, n;
 
-    tb->tc_search = block;
+    tb_cold(tb)->tc_search = block;
 
     for (i = 0, n = tb->icount; i < n; ++i) {
         target_ulong prev;
@@ -315,20 +489,31 @@ static int encode_search(TranslationBlock *tb, uint8_t *block)
 void cpu_gen_code(CPUState *env, TranslationBlock *tb, int *gen_code_size_ptr, int *search_size_ptr)
 {
     TCGContext *s = tcg->ctx;
+    TranslationBlockCold *cold = tb_cold(tb);
     uint8_t *gen_code_buf;
     int gen_code_size, search_size;
 
+    if (env->tlib_is_on_memory_access_enabled) {
+        mem_trace_prepare(env);
+    }
     tcg_func_start(s);
+#ifdef TARGET_ALIGNED_ONLY
+    tcg_context_allow_unaligned(env->tb_allow_unaligned_accesses);
+#else
+    tcg_context_allow_unaligned(1);
+#endif
     cpu_gen_code_inner(env, tb);
 
     /* generate machine code */
     gen_code_buf = tb->tc_ptr;
-    tb->tb_next_offset[0] = 0xffff;
-    tb->tb_next_offset[1] = 0xffff;
+    cold->tb_next_offset[0] = 0xffff;
+    cold->tb_next_offset[1] = 0xffff;
 
-    s->tb_next_offset = tb->tb_next_offset;
-    s->tb_jmp_offset = tb->tb_jmp_offset;
+    s->tb_next_offset = cold->tb_next_offset;
+    s->tb_jmp_offset = cold->tb_jmp_offset;
     s->tb_next = NULL;
+    /* the optimizer pays off on superblocks only, they are few and run often */
+    s->optimize = (tb->cflags & CF_SUPERBLOCK) && superblock_optimizer_enabled;
 
     gen_code_size = tcg_gen_code(s, gen_code_buf);
     *gen_code_size_ptr = gen_code_size;
@@ -343,7 +528,7 @@ int cpu_restore_state_from_tb(CPUState *env, TranslationBlock *tb, uintptr_t sea
 {
     target_ulong data[TARGET_INSN_START_WORDS] = { tb->pc };
     uintptr_t host_pc = (uintptr_t)tb->tc_ptr;
-    uint8_t *p = tb->tc_search;
+    uint8_t *p = tb_cold(tb)->tc_search;
     int i, j, num_insns = tb->icount;
 
     if (searched_pc < host_pc) {
@@ -369,13 +554,18 @@ int cpu_restore_state_from_tb(CPUState *env, TranslationBlock *tb, uintptr_t sea
     return i;
 }
 
+/* The block header counted all the instructions of the block, those past the restored state are taken off the
+   counters. The state is restored before an exit to the main loop, so the instructions of a block are taken off
+   only once until then. */
 int cpu_restore_state_and_restore_instructions_count(CPUState *env, TranslationBlock *tb, uintptr_t searched_pc)
 {
     int executed_instructions = cpu_restore_state_from_tb(env, tb, searched_pc);
-    if (executed_instructions != -1 && tb->instructions_count_dirty) {
+    if (executed_instructions != -1 && cpu->instructions_count_restored_tb != tb) {
+        cpu_sync_instructions_count(cpu);
         cpu->instructions_count_value -= (tb->icount - executed_instructions);
         cpu->instructions_count_total_value -= (tb->icount - executed_instructions);
-        tb->instructions_count_dirty = 0;
+        cpu_sync_instructions_budget(cpu);
+        cpu->instructions_count_restored_tb = tb;
     }
     return executed_instructions;
 }
@@ -452,6 +642,7 @@ void generate_stack_announcement(TCGv pc, int type, bool clear_lsb)
 void tlib_announce_stack_change(target_ulong address, int change_type)
 {
     #ifdef SUPPORTS_GUEST_PROFILING
+    cpu_sync_instructions_count(cpu);
     tlib_profiler_announce_stack_change(address, tlib_get_register_value(RA), cpu->instructions_count_total_value, change_type);
     #else
     tlib_abortf("This architecture does not support the profiler");
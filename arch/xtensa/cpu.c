@@ -38,6 +38,7 @@ static void xtensa_cpu_reset(CPUState *env)
     int common_offset = offsetof(CPUState, cpu_common_first_field);
     int bp_offset = offsetof(CPUState, breakpoints);
     memset((char *)env + common_offset, 0, bp_offset - common_offset);
+    io_access_regions_clear(env);
     env->exception_index = -1;
 
     /* Reset Xtensa-specific parts */
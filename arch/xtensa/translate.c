@@ -34,6 +34,7 @@
 #include "tb-helper.h"
 #include "tcg-op-atomic.h"
 #include "tcg-op.h"
+#include "tb-cache.h"
 
 // Upstream Xtensa code expected DisasContextBase to contain:
 // * 'pc_first' -- it was replaced with 'base.tb->pc',
@@ -387,10 +388,10 @@ static void gen_jump_slot(DisasContext *dc, TCGv dest, int slot)
             slot = gen_postprocess(dc, slot);
         }
         if (slot >= 0) {
-            tcg_gen_goto_tb(slot);
-            tcg_gen_exit_tb((tcg_target_long)dc->base.tb + slot);
+            /* the destination is only known at run time here */
+            gen_chained_exit_tb(dc->base.tb, slot, -1);
         } else {
-            tcg_gen_exit_tb(0);
+            gen_exit_tb_no_chaining(dc->base.tb);
         }
     }
     dc->base.is_jmp = DISAS_NORETURN;
@@ -7762,3 +7763,10 @@ void cpu_exec_prologue(CPUState *env)
 void cpu_exec_epilogue(CPUState *env)
 {
 }
+
+uint64_t tb_cache_target_settings(CPUState *env, uint64_t hash)
+{
+    // the instruction breakpoints are translated into the blocks
+    hash = tb_cache_hash(hash, &env->sregs[IBREAKENABLE], sizeof(env->sregs[IBREAKENABLE]));
+    return tb_cache_hash(hash, &env->sregs[IBREAKA], env->config->nibreak * sizeof(env->sregs[IBREAKA]));
+}
@@ -1,6 +1,7 @@
 #include "atomic.h"
 #include "cpu.h"
 #include "pthread.h"
+#include "host-utils.h"
 
 static inline void ensure_locked_by_me(struct CPUState *env)
 {
@@ -39,6 +40,8 @@ static void initialize_atomic_memory_state(atomic_memory_state_t *sm)
         sm->locking_cpu_id = NO_CPU_ID;
         sm->entries_count = 0;
         sm->number_of_registered_cpus = 0;
+        // by default a reservation covers just its address
+        sm->reservation_granule_bits = 0;
 
         sm->is_mutex_initialized = 1;
     }
@@ -53,21 +56,21 @@ static void initialize_atomic_memory_state(atomic_memory_state_t *sm)
             sm->reservations[i].manual_free = 0;
             sm->reservations_by_cpu[i] = NO_RESERVATION;
         }
+        memset(sm->reservation_filter, 0, sizeof(sm->reservation_filter));
 
         sm->are_reservations_valid = 1;
     }
 }
 
-static inline address_reservation_t *find_reservation_on_address(struct CPUState *env, target_phys_addr_t address,
-                                                                 int starting_position)
+static inline uint32_t *reservation_filter_entry(atomic_memory_state_t *sm, uint64_t address)
 {
-    int i;
-    for (i = starting_position; i < env->atomic_memory_state->reservations_count; i++) {
-        if (env->atomic_memory_state->reservations[i].address == address) {
-            return &env->atomic_memory_state->reservations[i];
-        }
-    }
-    return NULL;
+    uint64_t granule = address >> sm->reservation_granule_bits;
+    return &sm->reservation_filter[(granule ^ (granule >> RESERVATION_FILTER_BITS)) & (RESERVATION_FILTER_SIZE - 1)];
+}
+
+static inline bool is_in_same_granule(atomic_memory_state_t *sm, uint64_t address, uint64_t other_address)
+{
+    return ((address ^ other_address) >> sm->reservation_granule_bits) == 0;
 }
 
 // there can be only one reservation per cpu
@@ -96,6 +99,8 @@ static inline address_reservation_t *make_reservation(struct CPUState *env, targ
 
     env->atomic_memory_state->reservations_by_cpu[env->id] = env->atomic_memory_state->reservations_count;
     env->atomic_memory_state->reservations_count++;
+    // the full barrier orders the filter update before the reserved load, see register_address_access
+    __atomic_or_fetch(reservation_filter_entry(env->atomic_memory_state, address), 1u << env->id, __ATOMIC_SEQ_CST);
 
     return reservation;
 }
@@ -116,6 +121,8 @@ static inline void free_reservation(struct CPUState *env, address_reservation_t
     }
 
     env->atomic_memory_state->reservations_by_cpu[reservation->locking_cpu_id] = NO_RESERVATION;
+    __atomic_and_fetch(reservation_filter_entry(env->atomic_memory_state, reservation->address),
+                       ~(1u << reservation->locking_cpu_id), __ATOMIC_RELEASE);
     if (reservation->id != env->atomic_memory_state->reservations_count - 1) {
         // if this is not the last reservation, i must copy the last one in this empty place
         reservation->locking_cpu_id =
@@ -251,15 +258,29 @@ void register_address_access(struct CPUState *env, target_phys_addr_t address)
         return;
     }
 
-    ensure_locked_by_me(env);
+    // The plain accesses do not take the global memory lock unless another cpu may hold a reservation
+    // in the granule of the address. The barrier orders the access before the check; a reservation
+    // made after the check is ordered after the access by the barrier in make_reservation.
+    uint32_t *filter_entry = reservation_filter_entry(env->atomic_memory_state, address);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (likely((__atomic_load_n(filter_entry, __ATOMIC_RELAXED) & ~(1u << env->id)) == 0)) {
+        return;
+    }
+
+    acquire_global_memory_lock(env);
+    // a cpu has at most one reservation, the filter names the candidates
+    uint32_t cpus = *filter_entry & ~(1u << env->id);
+    while (cpus != 0) {
+        int cpu_id = ctz32(cpus);
+        cpus &= cpus - 1;
 
-    address_reservation_t *reservation = find_reservation_on_address(env, address, 0);
-    while (reservation != NULL) {
-        if (reservation->locking_cpu_id != env->id) {
+        address_reservation_t *reservation =
+            &env->atomic_memory_state->reservations[env->atomic_memory_state->reservations_by_cpu[cpu_id]];
+        if (is_in_same_granule(env->atomic_memory_state, reservation->address, address)) {
             free_reservation(env, reservation, 0);
         }
-        reservation = find_reservation_on_address(env, address, reservation->id + 1);
     }
+    release_global_memory_lock(env);
 }
 
 void cancel_reservation(struct CPUState *env)
@@ -272,6 +293,20 @@ void cancel_reservation(struct CPUState *env)
     cancel_reservation_always(env);
 }
 
+// Should be called before the cores run: the accesses made while the filter is rebuilt may miss the reservations.
+void set_reservation_granule(struct CPUState *env, uint32_t size)
+{
+    atomic_memory_state_t *sm = env->atomic_memory_state;
+
+    acquire_global_memory_lock(env);
+    memset(sm->reservation_filter, 0, sizeof(sm->reservation_filter));
+    sm->reservation_granule_bits = ctz32(size);
+    for (int i = 0; i < sm->reservations_count; i++) {
+        *reservation_filter_entry(sm, sm->reservations[i].address) |= 1u << sm->reservations[i].locking_cpu_id;
+    }
+    release_global_memory_lock(env);
+}
+
 // Functions with the _always suffix, will run no matter the amount of registered CPU cores
 
 void reserve_address_always(struct CPUState *env, target_phys_addr_t address)
@@ -97,6 +97,17 @@ void tlib_on_block_translation(uint64_t start, uint32_t size, uint32_t flags)
 
 DEFAULT_VOID_HANDLER3(void tlib_on_memory_access, uint64_t pc, uint32_t operation, uint64_t address)
 
+void tlib_on_memory_access_batch(void *entries, uint32_t count) __attribute__((weak));
+
+/* hosts that only implement tlib_on_memory_access get the accesses one by one */
+void tlib_on_memory_access_batch(void *entries, uint32_t count)
+{
+    MemoryAccessTraceEntry *entry = entries;
+    for (uint32_t i = 0; i < count; i++, entry++) {
+        tlib_on_memory_access(entry->pc, entry->operation, entry->address);
+    }
+}
+
 DEFAULT_INT_HANDLER1(uint32_t tlib_is_in_debug_mode, void)
 
 DEFAULT_VOID_HANDLER1(void tlib_on_interrupt_begin, uint64_t exception_index)
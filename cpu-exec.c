@@ -31,22 +31,22 @@ target_ulong virt_to_phys(target_ulong virtual, uint32_t access_type, uint32_t n
     uint16_t mmu_idx = cpu_mmu_index(env);
 
     target_ulong masked_virtual;
-    target_ulong page_index;
     target_ulong physical;
+    CPUTLBEntry *te;
 
     nofault = !!nofault;
 
     masked_virtual = virtual & TARGET_PAGE_MASK;
-    page_index = (virtual >> TARGET_PAGE_BITS) & (CPU_TLB_SIZE - 1);
+    te = tlb_entry(env, mmu_idx, virtual);
 
-    if ((env->tlb_table[mmu_idx][page_index].addr_write & TARGET_PAGE_MASK) == masked_virtual) {
-        physical = env->tlb_table[mmu_idx][page_index].addr_write;
+    if ((te->addr_write & TARGET_PAGE_MASK) == masked_virtual) {
+        physical = te->addr_write;
         found_idx = mmu_idx;
-    } else if ((env->tlb_table[mmu_idx][page_index].addr_read & TARGET_PAGE_MASK) == masked_virtual) {
-        physical = env->tlb_table[mmu_idx][page_index].addr_read;
+    } else if ((te->addr_read & TARGET_PAGE_MASK) == masked_virtual) {
+        physical = te->addr_read;
         found_idx = mmu_idx;
-    } else if ((env->tlb_table[mmu_idx][page_index].addr_code & TARGET_PAGE_MASK) == masked_virtual) {
-        physical = env->tlb_table[mmu_idx][page_index].addr_code;
+    } else if ((te->addr_code & TARGET_PAGE_MASK) == masked_virtual) {
+        physical = te->addr_code;
         found_idx = mmu_idx;
     } else {
         // Not mapped in current env mmu mode, check other modes
@@ -55,16 +55,17 @@ target_ulong virt_to_phys(target_ulong virtual, uint32_t access_type, uint32_t n
                 // Already checked
                 continue;
             }
-            if ((env->tlb_table[idx][page_index].addr_write & TARGET_PAGE_MASK) == masked_virtual) {
-                physical = env->tlb_table[idx][page_index].addr_write;
+            te = tlb_entry(env, idx, virtual);
+            if ((te->addr_write & TARGET_PAGE_MASK) == masked_virtual) {
+                physical = te->addr_write;
                 found_idx = idx;
                 break;
-            } else if ((env->tlb_table[idx][page_index].addr_read & TARGET_PAGE_MASK) == masked_virtual) {
-                physical = env->tlb_table[idx][page_index].addr_read;
+            } else if ((te->addr_read & TARGET_PAGE_MASK) == masked_virtual) {
+                physical = te->addr_read;
                 found_idx = idx;
                 break;
-            } else if ((env->tlb_table[idx][page_index].addr_code & TARGET_PAGE_MASK) == masked_virtual) {
-                physical = env->tlb_table[idx][page_index].addr_code;
+            } else if ((te->addr_code & TARGET_PAGE_MASK) == masked_virtual) {
+                physical = te->addr_code;
                 found_idx = idx;
                 break;
             }
@@ -75,16 +76,17 @@ target_ulong virt_to_phys(target_ulong virtual, uint32_t access_type, uint32_t n
         // Not mapped in any mode - referesh page table from h/w tables
         tlb_fill(env, virtual & TARGET_PAGE_MASK, access_type, mmu_idx, NULL /* retaddr */, nofault, 1);
         found_idx = mmu_idx;
+        te = tlb_entry(env, mmu_idx, virtual);
         target_ulong mapped_address;
         switch (access_type) {
         case 0:    // DATA_LOAD
-            mapped_address = env->tlb_table[mmu_idx][page_index].addr_read;
+            mapped_address = te->addr_read;
             break;
         case 1:    //DATA_STORE
-            mapped_address = env->tlb_table[mmu_idx][page_index].addr_write;
+            mapped_address = te->addr_write;
             break;
         case 2:    //INST_FETCH
-            mapped_address = env->tlb_table[mmu_idx][page_index].addr_code;
+            mapped_address = te->addr_code;
             break;
         default:
             mapped_address = ~masked_virtual; // Mapping should fail
@@ -99,10 +101,10 @@ target_ulong virt_to_phys(target_ulong virtual, uint32_t access_type, uint32_t n
 
     if (physical & TLB_MMIO) {
         // The virtual address is mapping IO mem, not ram - use the IO page table
-        physical = (target_ulong)env->iotlb[found_idx][page_index];
+        physical = (target_ulong)env->tlb_desc[found_idx].iotlb[tlb_index(env, found_idx, virtual)];
         physical = (physical + virtual) & TARGET_PAGE_MASK;
     } else {
-        p = (void *)(uintptr_t)masked_virtual + env->tlb_table[found_idx][page_index].addend;
+        p = (void *)(uintptr_t)masked_virtual + te->addend;
         physical = tlib_host_ptr_to_guest_offset(p);
         if (physical == -1) {
             return -1;
@@ -148,60 +150,28 @@ void TLIB_NORETURN cpu_loop_exit_restore(CPUState *cpu, uintptr_t pc, uint32_t c
     cpu_loop_exit_without_hook(cpu);
 }
 
-static TranslationBlock *tb_find_slow(CPUState *env, target_ulong pc, target_ulong cs_base, uint64_t flags, uint32_t force_translation)
+/* 'cflags' is 0 for the full block or the instruction limit of a block cut to fit the quantum */
+static TranslationBlock *tb_find_slow(CPUState *env, target_ulong pc, target_ulong cs_base, uint64_t flags, uint16_t cflags)
 {
     tlib_on_translation_block_find_slow(pc);
-    TranslationBlock *tb, **ptb1;
-    unsigned int h;
-    tb_page_addr_t phys_pc, phys_page1;
-    target_ulong virt_page2;
-
-    tb_invalidated_flag = 0;
+    TranslationBlock *tb = NULL;
+    tb_page_addr_t phys_pc;
 
     /* find translated block using physical mappings */
     phys_pc = get_page_addr_code(env, pc, true);
-    phys_page1 = phys_pc & TARGET_PAGE_MASK;
-    h = tb_phys_hash_func(phys_pc);
-    ptb1 = &tb_phys_hash[h];
 
-    if (unlikely(env->tb_cache_disabled || force_translation)) {
-        goto not_found;
+    if (likely(!env->tb_cache_disabled)) {
+        tb = tb_phys_hash_lookup(env, pc, phys_pc, cs_base, flags, cflags);
     }
-
-    for (;;) {
-        tb = *ptb1;
-        if (!tb) {
-            goto not_found;
-        }
-        if (tb->pc == pc && tb->page_addr[0] == phys_page1 && tb->cs_base == cs_base && tb->flags == flags) {
-            /* check next page if needed */
-            if (tb->page_addr[1] != -1) {
-                tb_page_addr_t phys_page2;
-
-                virt_page2 = (pc & TARGET_PAGE_MASK) + TARGET_PAGE_SIZE;
-                phys_page2 = get_page_addr_code(env, virt_page2, true);
-                if (tb->page_addr[1] == phys_page2) {
-                    goto found;
-                }
-            } else {
-                goto found;
-            }
-        }
-        ptb1 = &tb->phys_hash_next;
+    if (!tb) {
+        /* if no translated code available, then translate it now */
+        tb = tb_gen_code(env, pc, cs_base, flags, cflags);
     }
-not_found:
-    /* if no translated code available, then translate it now */
-    tb = tb_gen_code(env, pc, cs_base, flags, 0);
-
-found:
-    /* Move the last found TB to the head of the list */
-    if (likely(*ptb1)) {
-        *ptb1 = tb->phys_hash_next;
-        tb->phys_hash_next = tb_phys_hash[h];
-        tb_phys_hash[h] = tb;
+
+    /* we add the TB in the virtual pc hash table, the cut variants are only looked up in tb_find_fast */
+    if (!cflags) {
+        tb_jmp_cache_set(env, pc, tb);
     }
-    /* we add the TB in the virtual pc hash table */
-    env->tb_jmp_cache[tb_jmp_cache_hash_func(pc)] = tb;
 
     return tb;
 }
@@ -214,6 +184,14 @@ static inline TranslationBlock *tb_find_fast(CPUState *env)
 
     uint32_t max_icount = (env->instructions_count_limit - env->instructions_count_value);
 
+#ifdef TARGET_ALIGNED_ONLY
+    if (unlikely(!env->tb_allow_unaligned_accesses != !env->allow_unaligned_accesses)) {
+        // the flag was changed by a state import, the cached code checks the in-page misaligned accesses the old way
+        tb_flush(env);
+        tb_invalidated_flag = 1;
+        env->tb_allow_unaligned_accesses = env->allow_unaligned_accesses;
+    }
+#endif
     /* we record a subset of the CPU state. It will
        always be the same before a given translated block
        is executed. */
@@ -221,10 +199,17 @@ static inline TranslationBlock *tb_find_fast(CPUState *env)
     tb = env->tb_jmp_cache[tb_jmp_cache_hash_func(pc)];
     if (unlikely(!tb || tb->pc != pc || tb->cs_base != cs_base || tb->flags != flags || env->tb_cache_disabled)) {
         tb = tb_find_slow(env, pc, cs_base, flags, 0);
-    } else if (tb->was_cut && tb->icount < max_icount) {
-        // force translation
+    }
+    if (unlikely(tb->hot)) {
+        // the block crossed the superblock threshold, the superblock takes its place in the physical hash
         tb_phys_invalidate(tb, -1);
-        tb = tb_find_slow(env, pc, cs_base, flags, 1);
+        tb = tb_gen_code(env, pc, cs_base, flags, CF_SUPERBLOCK);
+        tb_jmp_cache_set(env, pc, tb);
+    }
+    if (unlikely(tb->icount > max_icount)) {
+        // the end of the quantum falls inside the block; a variant cut to the remaining instructions is run instead and
+        // both stay cached, so quantum boundaries do not invalidate code
+        tb = tb_find_slow(env, pc, cs_base, flags, max_icount);
     }
     return tb;
 }
@@ -365,12 +350,16 @@ int cpu_exec(CPUState *env)
                     tb_invalidated_flag = 0;
                 }
                 /* see if we can patch the calling TB. When the TB
-                   spans two pages, we cannot safely do a direct
-                   jump.
-                   We do not chain blocks if the chaining is explicitly disabled or if
-                   there is a hook registered for the block footer. */
-
-                if (!env->chaining_disabled && !env->block_finished_hook_present && next_tb != 0 && tb->page_addr[1] == -1) {
+                   spans two pages, the jump is reset as soon as the
+                   mapping of the second page can change.
+                   We do not chain blocks if the chaining is explicitly disabled,
+                   nor jump to a block cut to fit the quantum.
+                   The block hooks are called by the chained code itself. */
+
+                if (!env->chaining_disabled && next_tb != 0 && !(tb->cflags & CF_COUNT_MASK)) {
+                    if (tb->page_addr[1] != -1) {
+                        tb_mark_cross_page_chained(tb);
+                    }
                     tb_add_jump((TranslationBlock *)(next_tb & ~3), next_tb & 3, tb);
                 }
 
@@ -381,9 +370,11 @@ int cpu_exec(CPUState *env)
                 env->current_tb = tb;
                 asm volatile ("" ::: "memory");
                 if (likely(!env->exit_request)) {
+                    cpu_sync_instructions_budget(env);
                     tc_ptr = tb->tc_ptr;
                     /* execute the generated code */
                     next_tb = tcg_tb_exec(env, tc_ptr);
+                    cpu_sync_instructions_count(env);
                     /* Flush the list after every unchained block */
                     flush_dirty_addresses_list();
                     if ((next_tb & 3) == EXIT_TB_FORCE) {
@@ -403,6 +394,8 @@ int cpu_exec(CPUState *env)
             /* Reload env after longjmp - the compiler may have smashed all
              * local variables as longjmp is marked 'noreturn'. */
             env = cpu;
+            cpu_sync_instructions_count(env);
+            env->instructions_count_restored_tb = NULL;
         }
     } /* for(;;) */
 
@@ -29,24 +29,66 @@
 #include "cpu.h"
 #include "tcg.h"
 #include "osdep.h"
+#include "tb-cache.h"
 
 #define SMC_BITMAP_USE_THRESHOLD 10
 
 CPUState *env;
 extern void* global_retaddr;
 
-static TranslationBlock *tbs;
+TranslationBlock *tbs;
+TranslationBlockCold *tbs_cold;
+/* as returned by tlib_malloc, `tbs` is aligned to TB_ALIGN */
+static void *tbs_buffer;
 static int code_gen_max_blocks;
-TranslationBlock *tb_phys_hash[CODE_GEN_PHYS_HASH_SIZE];
 static int nb_tbs;
 /* any access to the tbs or the page table must use this lock */
 
 static uint8_t *code_gen_buffer;
 static uintptr_t code_gen_buffer_size;
-/* threshold to flush the translated code buffer */
-static uintptr_t code_gen_buffer_max_size;
 static uint8_t *code_gen_ptr;
 
+/* The code buffer and the tbs array are split into regions filled one after
+   another. When the current region is full, the oldest one is recycled, so
+   only its TBs are dropped instead of the whole translation cache. */
+typedef struct CodeGenRegion {
+    uint8_t *start;
+    /* end of the generated code, valid when the region is not the current one */
+    uint8_t *end;
+    /* TBs of the region, sorted by tc_ptr */
+    TranslationBlock *tbs;
+    int nb_tbs;
+} CodeGenRegion;
+
+static CodeGenRegion code_gen_regions[CODE_GEN_MAX_REGIONS];
+static int code_gen_regions_count;
+static int code_gen_region_current;
+static uintptr_t code_gen_region_size;
+/* threshold to switch to the next region */
+static uintptr_t code_gen_region_max_size;
+static int code_gen_region_max_blocks;
+
+/* the number of executions after which a block is retranslated as a superblock, 0 disables the superblocks */
+uint32_t superblock_threshold;
+/* run tcg_optimize on the superblocks, off by default */
+uint32_t superblock_optimizer_enabled;
+
+/* Physical TB hash table. It uses open addressing with linear probing and
+   keeps the hash of every entry next to the TB pointer, so a lookup rarely
+   has to touch the TBs it does not return. Entries are removed by shifting
+   the following ones back, there are no tombstones. */
+typedef struct TBPhysHashSlot {
+    uint32_t hash;
+    TranslationBlock *tb;
+} TBPhysHashSlot;
+
+/* TBs spanning two pages that other TBs jump to directly, see tb_reset_cross_page_jumps */
+static QLIST_HEAD(, TranslationBlockCold) tb_cross_page_chained;
+
+static TBPhysHashSlot *tb_phys_hash;
+static uint32_t tb_phys_hash_mask;
+TBPhysHashStatistics tb_phys_hash_statistics;
+
 CPUState *cpu;
 
 typedef struct PageDesc {
@@ -113,6 +155,119 @@ static void *l1_phys_map[P_L1_SIZE];
 static int tlb_flush_count;
 static int tb_flush_count;
 static int tb_phys_invalidate_count;
+static int code_gen_region_recycle_count;
+
+static void tb_phys_hash_insert_slot(TBPhysHashSlot *table, uint32_t mask, uint32_t hash, TranslationBlock *tb)
+{
+    uint32_t i = hash & mask;
+
+    while (table[i].tb) {
+        i = (i + 1) & mask;
+    }
+    table[i].hash = hash;
+    table[i].tb = tb;
+}
+
+static void tb_phys_hash_resize(uint32_t capacity)
+{
+    TBPhysHashSlot *old_table = tb_phys_hash;
+    uint32_t old_capacity = tb_phys_hash_statistics.capacity;
+
+    tb_phys_hash = tlib_mallocz(capacity * sizeof(TBPhysHashSlot));
+    tb_phys_hash_mask = capacity - 1;
+    tb_phys_hash_statistics.capacity = capacity;
+    if (!old_table) {
+        return;
+    }
+    for (uint32_t i = 0; i < old_capacity; i++) {
+        if (old_table[i].tb) {
+            tb_phys_hash_insert_slot(tb_phys_hash, tb_phys_hash_mask, old_table[i].hash, old_table[i].tb);
+        }
+    }
+    tlib_free(old_table);
+}
+
+static void tb_phys_hash_insert(TranslationBlock *tb, tb_page_addr_t phys_pc)
+{
+    /* keep the load factor at most 1/2 so that the probe sequences stay short */
+    if ((tb_phys_hash_statistics.entries + 1) * 2 > tb_phys_hash_statistics.capacity) {
+        tb_phys_hash_resize(tb_phys_hash_statistics.capacity * 2);
+    }
+    tb_phys_hash_insert_slot(tb_phys_hash, tb_phys_hash_mask, tb_phys_hash_func(phys_pc, tb->flags, tb->cs_base, tb->cflags), tb);
+    tb_phys_hash_statistics.entries++;
+}
+
+static void tb_phys_hash_remove(TranslationBlock *tb, tb_page_addr_t phys_pc)
+{
+    uint32_t i, j, home;
+
+    i = tb_phys_hash_func(phys_pc, tb->flags, tb->cs_base, tb->cflags) & tb_phys_hash_mask;
+    while (tb_phys_hash[i].tb != tb) {
+        if (!tb_phys_hash[i].tb) {
+            return;
+        }
+        i = (i + 1) & tb_phys_hash_mask;
+    }
+
+    /* move back the entries that would not be reachable through the emptied slot */
+    j = i;
+    for (;;) {
+        j = (j + 1) & tb_phys_hash_mask;
+        if (!tb_phys_hash[j].tb) {
+            break;
+        }
+        home = tb_phys_hash[j].hash & tb_phys_hash_mask;
+        if (((j - home) & tb_phys_hash_mask) >= ((j - i) & tb_phys_hash_mask)) {
+            tb_phys_hash[i] = tb_phys_hash[j];
+            i = j;
+        }
+    }
+    tb_phys_hash[i].tb = NULL;
+    tb_phys_hash_statistics.entries--;
+}
+
+/* find a valid TB for the given physical pc and CPU state, either the full one or the one cut to the instruction
+   limit in 'cflags'; the table itself is not modified */
+TranslationBlock *tb_phys_hash_lookup(CPUState *env, target_ulong pc, tb_page_addr_t phys_pc, target_ulong cs_base, uint64_t flags,
+                                      uint16_t cflags)
+{
+    TranslationBlock *tb;
+    tb_page_addr_t phys_page1, phys_page2 = -1;
+    uint32_t hash, i, probes = 0;
+
+    phys_page1 = phys_pc & TARGET_PAGE_MASK;
+    hash = tb_phys_hash_func(phys_pc, flags, cs_base, cflags);
+    i = hash & tb_phys_hash_mask;
+
+    for (;;) {
+        probes++;
+        tb = tb_phys_hash[i].tb;
+        if (!tb) {
+            break;
+        }
+        if (tb_phys_hash[i].hash == hash && tb->pc == pc && tb->page_addr[0] == phys_page1 && tb->cs_base == cs_base &&
+            tb->flags == flags && (tb->cflags & CF_COUNT_MASK) == (cflags & CF_COUNT_MASK)) {
+            /* check next page if needed */
+            if (tb->page_addr[1] == -1) {
+                break;
+            }
+            if (phys_page2 == -1) {
+                phys_page2 = get_page_addr_code(env, (pc & TARGET_PAGE_MASK) + TARGET_PAGE_SIZE, true);
+            }
+            if (tb->page_addr[1] == phys_page2) {
+                break;
+            }
+        }
+        i = (i + 1) & tb_phys_hash_mask;
+    }
+
+    tb_phys_hash_statistics.lookups++;
+    tb_phys_hash_statistics.probes += probes;
+    if (probes > tb_phys_hash_statistics.max_probe_length) {
+        tb_phys_hash_statistics.max_probe_length = probes;
+    }
+    return tb;
+}
 
 #ifdef _WIN32
 static void map_exec(void *addr, long size)
@@ -367,9 +522,31 @@ static void code_gen_alloc()
     map_exec(code_gen_buffer, code_gen_buffer_size);
 #endif
     map_exec(tcg->code_gen_prologue, 1024);
-    code_gen_buffer_max_size = code_gen_buffer_size - TCG_MAX_CODE_SIZE - TCG_MAX_SEARCH_SIZE;
-    code_gen_max_blocks = code_gen_buffer_size / CODE_GEN_AVG_BLOCK_SIZE;
-    tbs = tlib_malloc(code_gen_max_blocks * sizeof(TranslationBlock));
+
+    /* every region has to fit a few blocks of the maximum size */
+    code_gen_regions_count = code_gen_buffer_size / (CODE_GEN_MIN_REGION_BLOCKS * (uintptr_t)(TCG_MAX_CODE_SIZE + TCG_MAX_SEARCH_SIZE));
+    if (code_gen_regions_count < 1) {
+        code_gen_regions_count = 1;
+    } else if (code_gen_regions_count > CODE_GEN_MAX_REGIONS) {
+        code_gen_regions_count = CODE_GEN_MAX_REGIONS;
+    }
+    code_gen_region_size = (code_gen_buffer_size / code_gen_regions_count) & ~(CODE_GEN_ALIGN - 1);
+    code_gen_region_max_size = code_gen_region_size - TCG_MAX_CODE_SIZE - TCG_MAX_SEARCH_SIZE;
+    code_gen_region_max_blocks = code_gen_region_size / CODE_GEN_AVG_BLOCK_SIZE;
+    code_gen_max_blocks = code_gen_region_max_blocks * code_gen_regions_count;
+    tbs_buffer = tlib_malloc(code_gen_max_blocks * sizeof(TranslationBlock) + TB_ALIGN - 1);
+    tbs = (TranslationBlock *)(((uintptr_t)tbs_buffer + TB_ALIGN - 1) & ~(uintptr_t)(TB_ALIGN - 1));
+    tbs_cold = tlib_malloc(code_gen_max_blocks * sizeof(TranslationBlockCold));
+
+    for (int i = 0; i < code_gen_regions_count; i++) {
+        code_gen_regions[i].start = code_gen_buffer + i * code_gen_region_size;
+        code_gen_regions[i].end = code_gen_regions[i].start;
+        code_gen_regions[i].tbs = tbs + i * code_gen_region_max_blocks;
+        code_gen_regions[i].nb_tbs = 0;
+    }
+    code_gen_region_current = 0;
+
+    tb_phys_hash_resize(1 << CODE_GEN_PHYS_HASH_MIN_BITS);
 }
 
 void code_gen_free(void)
@@ -383,7 +560,14 @@ void code_gen_free(void)
 #else
     tlib_free(code_gen_buffer);
 #endif
-    tlib_free(tbs);
+    tlib_free(tbs_buffer);
+    tlib_free(tbs_cold);
+    tbs = NULL;
+    tbs_cold = NULL;
+    tlib_free(tb_phys_hash);
+    tb_phys_hash = NULL;
+    tb_phys_hash_statistics.capacity = 0;
+    tb_phys_hash_statistics.entries = 0;
 }
 
 TCGv_ptr cpu_env;
@@ -394,7 +578,7 @@ void cpu_exec_init_all()
 {
     tcg_context_init();
     code_gen_alloc();
-    code_gen_ptr = code_gen_buffer;
+    code_gen_ptr = code_gen_regions[0].start;
     page_init();
     /* There's no guest base to take into account, so go ahead and
        initialize the prologue now.  */
@@ -406,31 +590,40 @@ void cpu_exec_init(CPUState *env)
 {
     cpu = env;
     QTAILQ_INIT(&cpu->breakpoints);
+    tlb_init(cpu);
 }
 
-/* Allocate a new translation block. Flush the translation buffer if
-   too many translation blocks or too much generated code. */
+/* Allocate a new translation block. Returns NULL if the current region
+   has too many translation blocks or too much generated code. */
 static TranslationBlock *tb_alloc(target_ulong pc)
 {
     TranslationBlock *tb;
+    CodeGenRegion *region = &code_gen_regions[code_gen_region_current];
 
-    if (nb_tbs >= code_gen_max_blocks || (code_gen_ptr - code_gen_buffer) >= code_gen_buffer_max_size) {
+    if (region->nb_tbs >= code_gen_region_max_blocks || (code_gen_ptr - region->start) >= code_gen_region_max_size) {
         return NULL;
     }
-    tb = &tbs[nb_tbs++];
+    tb = &region->tbs[region->nb_tbs++];
+    nb_tbs++;
     tb->pc = pc;
     tb->cflags = 0;
-    tb->dirty_flag = false;
+    tb->invalid = false;
+    tb_cold(tb)->cross_page_chained = false;
+    tb->exec_count = superblock_threshold;
+    tb->hot = false;
     return tb;
 }
 
 void tb_free(TranslationBlock *tb)
 {
+    CodeGenRegion *region = &code_gen_regions[code_gen_region_current];
+
     /* In practice this is mostly used for single use temporary TB
        Ignore the hard cases and just back up if this TB happens to
        be the last one generated.  */
-    if (nb_tbs > 0 && tb == &tbs[nb_tbs - 1]) {
+    if (region->nb_tbs > 0 && tb == &region->tbs[region->nb_tbs - 1]) {
         code_gen_ptr = tb->tc_ptr;
+        region->nb_tbs--;
         nb_tbs--;
     }
 }
@@ -475,6 +668,19 @@ static void page_flush_tb(void)
     }
 }
 
+/* empties the parts of tb_jmp_cache that may hold blocks, see tb_jmp_cache_set */
+static void tb_jmp_cache_clear(CPUState *env)
+{
+    uint64_t dirty = env->tb_jmp_cache_dirty_pages;
+
+    while (dirty) {
+        int page = __builtin_ctzll(dirty);
+        memset(&env->tb_jmp_cache[page << TB_JMP_PAGE_BITS], 0, TB_JMP_PAGE_SIZE * sizeof(TranslationBlock *));
+        dirty &= dirty - 1;
+    }
+    env->tb_jmp_cache_dirty_pages = 0;
+}
+
 /* flush all the translation blocks */
 /* XXX: tb_flush is currently not thread safe */
 void tb_flush(CPUState *env1)
@@ -484,30 +690,23 @@ void tb_flush(CPUState *env1)
     }
 
     nb_tbs = 0;
-    memset(cpu->tb_jmp_cache, 0, TB_JMP_CACHE_SIZE * sizeof (void *));
-    memset(tb_phys_hash, 0, CODE_GEN_PHYS_HASH_SIZE * sizeof (void *));
+    for (int i = 0; i < code_gen_regions_count; i++) {
+        code_gen_regions[i].nb_tbs = 0;
+        code_gen_regions[i].end = code_gen_regions[i].start;
+    }
+    tb_jmp_cache_clear(cpu);
+    memset(tb_phys_hash, 0, tb_phys_hash_statistics.capacity * sizeof(TBPhysHashSlot));
+    tb_phys_hash_statistics.entries = 0;
+    QLIST_INIT(&tb_cross_page_chained);
     page_flush_tb();
 
-    code_gen_ptr = code_gen_buffer;
+    code_gen_region_current = 0;
+    code_gen_ptr = code_gen_regions[0].start;
     /* XXX: flush processor icache at this point if cache flush is
        expensive */
     tb_flush_count++;
 }
 
-/* invalidate one TB */
-static inline void tb_remove(TranslationBlock **ptb, TranslationBlock *tb, int next_offset)
-{
-    TranslationBlock *tb1;
-    for (;;) {
-        tb1 = *ptb;
-        if (tb1 == tb) {
-            *ptb = *(TranslationBlock **)((char *)tb1 + next_offset);
-            break;
-        }
-        ptb = (TranslationBlock **)((char *)tb1 + next_offset);
-    }
-}
-
 static inline void tb_page_remove(TranslationBlock **ptb, TranslationBlock *tb)
 {
     TranslationBlock *tb1;
@@ -518,10 +717,10 @@ static inline void tb_page_remove(TranslationBlock **ptb, TranslationBlock *tb)
         n1 = (uintptr_t)tb1 & 3;
         tb1 = (TranslationBlock *)((uintptr_t)tb1 & ~3);
         if (tb1 == tb) {
-            *ptb = tb1->page_next[n1];
+            *ptb = tb_cold(tb1)->page_next[n1];
             break;
         }
-        ptb = &tb1->page_next[n1];
+        ptb = &tb_cold(tb1)->page_next[n1];
     }
 }
 
@@ -530,7 +729,7 @@ static inline void tb_jmp_remove(TranslationBlock *tb, int n)
     TranslationBlock *tb1, **ptb;
     unsigned int n1;
 
-    ptb = &tb->jmp_next[n];
+    ptb = &tb_cold(tb)->jmp_next[n];
     tb1 = *ptb;
     if (tb1) {
         /* find tb(n) in circular list */
@@ -542,15 +741,15 @@ static inline void tb_jmp_remove(TranslationBlock *tb, int n)
                 break;
             }
             if (n1 == EXIT_TB_FORCE) {
-                ptb = &tb1->jmp_first;
+                ptb = &tb_cold(tb1)->jmp_first;
             } else {
-                ptb = &tb1->jmp_next[n1];
+                ptb = &tb_cold(tb1)->jmp_next[n1];
             }
         }
         /* now we can suppress tb(n) from the list */
-        *ptb = tb->jmp_next[n];
+        *ptb = tb_cold(tb)->jmp_next[n];
 
-        tb->jmp_next[n] = NULL;
+        tb_cold(tb)->jmp_next[n] = NULL;
     }
 }
 
@@ -558,20 +757,91 @@ static inline void tb_jmp_remove(TranslationBlock *tb, int n)
    another TB */
 static inline void tb_reset_jump(TranslationBlock *tb, int n)
 {
-    tb_set_jmp_target(tb, n, (uintptr_t)(tb->tc_ptr + tb->tb_next_offset[n]));
+    tb_set_jmp_target(tb, n, (uintptr_t)(tb->tc_ptr + tb_cold(tb)->tb_next_offset[n]));
+}
+
+/* reset all the direct jumps to the given TB */
+static void tb_reset_incoming_jumps(TranslationBlock *tb)
+{
+    unsigned int n1;
+    TranslationBlock *tb1, *tb2;
+    TranslationBlockCold *cold = tb_cold(tb);
+
+    tb1 = cold->jmp_first;
+    for (;;) {
+        n1 = (uintptr_t)tb1 & 3;
+        if (n1 == EXIT_TB_FORCE) {
+            break;
+        }
+        tb1 = (TranslationBlock *)((uintptr_t)tb1 & ~3);
+        tb2 = tb_cold(tb1)->jmp_next[n1];
+        tb_reset_jump(tb1, n1);
+        tb_cold(tb1)->jmp_next[n1] = NULL;
+        tb1 = tb2;
+    }
+    cold->jmp_first = (TranslationBlock *)((uintptr_t)tb | EXIT_TB_FORCE); /* fail safe */
+
+    if (cold->cross_page_chained) {
+        QLIST_REMOVE(cold, cross_page_entry);
+        cold->cross_page_chained = false;
+    }
+}
+
+/* Only tb_find_slow checks the mapping of the second page of a TB, a direct
+   jump skips it. Such jumps are allowed anyway, like the entries of the
+   tb_jmp_cache they have to be reset whenever the TLB entries of the second
+   page are flushed. */
+void tb_mark_cross_page_chained(TranslationBlock *tb)
+{
+    TranslationBlockCold *cold = tb_cold(tb);
+
+    if (!cold->cross_page_chained) {
+        cold->cross_page_chained = true;
+        QLIST_INSERT_HEAD(&tb_cross_page_chained, cold, cross_page_entry);
+    }
+}
+
+/* Called once the execution counter of the TB reaches zero. The direct jumps
+   to it are reset, so that it is entered from the main loop next time and
+   tb_find_fast can replace it with a superblock. */
+void tb_mark_hot(TranslationBlock *tb)
+{
+    if (!tb->hot) {
+        tb->hot = true;
+        tb_reset_incoming_jumps(tb);
+    }
+}
+
+/* reset the direct jumps to the TBs whose second page is 'page2', or to all
+   the TBs spanning two pages if 'page2' is -1 */
+static void tb_reset_cross_page_jumps(target_ulong page2)
+{
+    TranslationBlockCold *cold, *next_cold;
+    TranslationBlock *tb;
+
+    QLIST_FOREACH_SAFE(cold, &tb_cross_page_chained, cross_page_entry, next_cold) {
+        tb = tb_from_cold(cold);
+        if (page2 == (target_ulong)-1 || (tb->pc & TARGET_PAGE_MASK) + TARGET_PAGE_SIZE == page2) {
+            tb_reset_incoming_jumps(tb);
+        }
+    }
 }
 
 void tb_phys_invalidate(TranslationBlock *tb, tb_page_addr_t page_addr)
 {
     PageDesc *p;
-    unsigned int h, n1;
+    unsigned int h;
     tb_page_addr_t phys_pc;
-    TranslationBlock *tb1, *tb2;
+
+    if (tb->invalid) {
+        /* already removed from all the lists */
+        return;
+    }
+    tb->invalid = true;
 
     /* remove the TB from the hash list */
     phys_pc = tb->page_addr[0] + (tb->pc & ~TARGET_PAGE_MASK);
-    h = tb_phys_hash_func(phys_pc);
-    tb_remove(&tb_phys_hash[h], tb, offsetof(TranslationBlock, phys_hash_next));
+    tb_phys_hash_remove(tb, phys_pc);
 
     /* remove the TB from the page list */
     if (tb->page_addr[0] != page_addr) {
@@ -598,20 +868,41 @@ void tb_phys_invalidate(TranslationBlock *tb, tb_page_addr_t page_addr)
     tb_jmp_remove(tb, 1);
 
     /* suppress any remaining jumps to this TB */
-    tb1 = tb->jmp_first;
-    for (;;) {
-        n1 = (uintptr_t)tb1 & 3;
-        if (n1 == EXIT_TB_FORCE) {
-            break;
+    tb_reset_incoming_jumps(tb);
+    tb_phys_invalidate_count++;
+}
+
+/* close the current region and drop all the TBs of the oldest one so that
+   new code can be generated there */
+static void code_gen_region_recycle(CPUState *env)
+{
+    TranslationBlock *tb;
+    CodeGenRegion *region;
+
+    if (code_gen_regions_count == 1) {
+        tb_flush(env);
+        return;
+    }
+
+    code_gen_regions[code_gen_region_current].end = code_gen_ptr;
+    code_gen_region_current = (code_gen_region_current + 1) % code_gen_regions_count;
+    region = &code_gen_regions[code_gen_region_current];
+
+    for (int i = 0; i < region->nb_tbs; i++) {
+        tb = &region->tbs[i];
+        if (tb->invalid) {
+            /* an invalidated TB could still have been chained to a live one afterwards */
+            tb_jmp_remove(tb, 0);
+            tb_jmp_remove(tb, 1);
+        } else {
+            tb_phys_invalidate(tb, -1);
         }
-        tb1 = (TranslationBlock *)((uintptr_t)tb1 & ~3);
-        tb2 = tb1->jmp_next[n1];
-        tb_reset_jump(tb1, n1);
-        tb1->jmp_next[n1] = NULL;
-        tb1 = tb2;
     }
-    tb->jmp_first = (TranslationBlock *)((uintptr_t)tb | EXIT_TB_FORCE); /* fail safe */
-    tb_phys_invalidate_count++;
+    nb_tbs -= region->nb_tbs;
+    region->nb_tbs = 0;
+    region->end = region->start;
+    code_gen_ptr = region->start;
+    code_gen_region_recycle_count++;
 }
 
 static inline void set_bits(uint8_t *tab, int start, int len)
@@ -666,7 +957,7 @@ static void build_page_bitmap(PageDesc *p)
             tb_end = ((tb->pc + tb->size) & ~TARGET_PAGE_MASK);
         }
         set_bits(p->code_bitmap, tb_start, tb_end - tb_start);
-        tb = tb->page_next[n];
+        tb = tb_cold(tb)->page_next[n];
     }
 }
 
@@ -681,8 +972,8 @@ TranslationBlock *tb_gen_code(CPUState *env, target_ulong pc, target_ulong cs_ba
     phys_pc = get_page_addr_code(env, pc, true);
     tb = tb_alloc(pc);
     if (!tb) {
-        /* flush must be done */
-        tb_flush(env);
+        /* recycle the oldest region */
+        code_gen_region_recycle(env);
         /* cannot fail at this point */
         tb = tb_alloc(pc);
         /* Don't forget to invalidate previous TB info.  */
@@ -693,7 +984,10 @@ TranslationBlock *tb_gen_code(CPUState *env, target_ulong pc, target_ulong cs_ba
     tb->cs_base = cs_base;
     tb->flags = flags;
     tb->cflags = cflags;
-    cpu_gen_code(env, tb, &code_gen_size, &search_size);
+    if (!tb_cache_load(env, tb, &code_gen_size, &search_size)) {
+        cpu_gen_code(env, tb, &code_gen_size, &search_size);
+        tb_cache_store(env, tb, code_gen_size, search_size);
+    }
     code_gen_ptr = (void *)(((uintptr_t)code_gen_ptr + code_gen_size
         + search_size + CODE_GEN_ALIGN - 1) & ~(CODE_GEN_ALIGN - 1));
 
@@ -710,6 +1004,109 @@ TranslationBlock *tb_gen_code(CPUState *env, target_ulong pc, target_ulong cs_ba
     return tb;
 }
 
+#define PRETRANSLATE_STACK_SIZE 256
+
+static TranslationBlock *tb_pretranslate(CPUState *env, target_ulong pc, target_ulong cs_base, int flags, bool *is_new)
+{
+    target_phys_addr_t phys_page;
+    tb_page_addr_t phys_pc;
+    PhysPageDesc *pd;
+    TranslationBlock *tb;
+
+    *is_new = false;
+    /* the debug walk does not fault, the code fetch below then does not fault either */
+    phys_page = cpu_get_phys_page_debug(env, pc & TARGET_PAGE_MASK);
+    if (phys_page == -1) {
+        return NULL;
+    }
+    /* only RAM and ROM can be translated, see get_page_addr_code */
+    pd = phys_page_find(phys_page >> TARGET_PAGE_BITS);
+    if (pd == NULL || ((pd->phys_offset & ~TARGET_PAGE_MASK) > IO_MEM_ROM && !(pd->phys_offset & IO_MEM_ROMD))) {
+        return NULL;
+    }
+    phys_pc = get_page_addr_code(env, pc, true);
+    tb = tb_phys_hash_lookup(env, pc, phys_pc, cs_base, flags, 0);
+    if (!tb) {
+        tb = tb_gen_code(env, pc, cs_base, flags, 0);
+        *is_new = true;
+    }
+    return tb;
+}
+
+static void tb_pretranslate_walk(CPUState *env, target_ulong start, target_ulong end, uint32_t options,
+                                 volatile uint64_t *block_count, uint64_t *byte_count)
+{
+    target_ulong stack[PRETRANSLATE_STACK_SIZE];
+    target_ulong pc = start;
+    target_ulong current_pc, cs_base;
+    int stack_size = 0;
+    int flags, n;
+    TranslationBlock *tb;
+    bool is_new;
+
+    cpu_get_tb_cpu_state(env, &current_pc, &cs_base, &flags);
+    while (pc < end || stack_size > 0) {
+        if (pc < end) {
+            tb = tb_pretranslate(env, pc, cs_base, flags, &is_new);
+            if (!tb) {
+                /* skip the unmapped page */
+                pc = (pc & TARGET_PAGE_MASK) + TARGET_PAGE_SIZE;
+                if (pc == 0) {
+                    break;
+                }
+                continue;
+            }
+            if (tb->size == 0) {
+                /* a breakpoint or an undecodable instruction, where the next block starts is not known */
+                pc = end;
+            } else {
+                pc += tb->size;
+            }
+        } else {
+            tb = tb_pretranslate(env, stack[--stack_size], cs_base, flags, &is_new);
+            if (!tb) {
+                continue;
+            }
+        }
+        if (!is_new) {
+            continue;
+        }
+        (*block_count)++;
+        *byte_count += tb->size;
+        if (options & PRETRANSLATE_FOLLOW_JUMPS) {
+            for (n = 0; n < 2; n++) {
+                if (tb_cold(tb)->jmp_target_pc[n] != (target_ulong)-1 && stack_size < PRETRANSLATE_STACK_SIZE) {
+                    stack[stack_size++] = tb_cold(tb)->jmp_target_pc[n];
+                }
+            }
+        }
+    }
+}
+
+/* Translate the blocks from 'start' up to 'end' for the current CPU state ahead of the execution.
+   With PRETRANSLATE_FOLLOW_JUMPS the blocks the direct jumps of the new blocks lead to are translated as well,
+   wherever they are. Returns the number of new blocks, '*bytes' is set to the size of the guest code they cover. */
+uint64_t tb_pretranslate_range(CPUState *env, target_ulong start, target_ulong end, uint32_t options, uint64_t *bytes)
+{
+    volatile uint64_t block_count = 0;
+    jmp_buf saved_jmp_env;
+
+    *bytes = 0;
+    /* recycling a code region could free the block being executed */
+    if (env->tb_cache_disabled || env->current_tb) {
+        return 0;
+    }
+    /* a guest exception raised by the code fetch lands here instead of in cpu_exec */
+    memcpy(saved_jmp_env, env->jmp_env, sizeof(jmp_buf));
+    if (setjmp(env->jmp_env) == 0) {
+        tb_pretranslate_walk(env, start, end, options, &block_count, bytes);
+    } else {
+        cpu->exception_index = -1;
+    }
+    memcpy(cpu->jmp_env, saved_jmp_env, sizeof(jmp_buf));
+    return block_count;
+}
+
 void helper_mark_tbs_as_dirty(CPUState *env, target_ulong pc, int access_width, int broadcast)
 {
     int n;
@@ -747,11 +1144,13 @@ void helper_mark_tbs_as_dirty(CPUState *env, target_ulong pc, int access_width,
     while (tb != NULL) {
         n = (uintptr_t)tb & 3;
         tb = (TranslationBlock *)((uintptr_t)tb & ~3);
-        tb_next = tb->page_next[n];
+        tb_next = tb_cold(tb)->page_next[n];
         tb_start = tb->page_addr[0] + (tb->pc & ~TARGET_PAGE_MASK);
         tb_end = tb_start + tb->size;
         if ((tb_start <= phys_pc && phys_pc < tb_end) || (phys_pc <= tb_start && tb_start < phys_pc + access_width)) {
-            tb->dirty_flag = true;
+            // The current block, if hit, still runs to its end, but its incoming jumps are reset
+            // and the next lookup retranslates it
+            tb_phys_invalidate(tb, -1);
         }
         tb = tb_next;
     }
@@ -797,7 +1196,7 @@ void tb_invalidate_phys_page_range_inner(tb_page_addr_t start, tb_page_addr_t en
     while (tb != NULL) {
         n = (uintptr_t)tb & 3;
         tb = (TranslationBlock *)((uintptr_t)tb & ~3);
-        tb_next = tb->page_next[n];
+        tb_next = tb_cold(tb)->page_next[n];
         /* NOTE: this is subtle as a TB may span two physical pages */
         if (n == EXIT_TB_NO_JUMP) {
             /* NOTE: tb_end may be after the end of the page, but
@@ -927,7 +1326,7 @@ static inline void tb_alloc_page(TranslationBlock *tb, unsigned int n, tb_page_a
 
     tb->page_addr[n] = page_addr;
     p = page_find_alloc(page_addr >> TARGET_PAGE_BITS, 1);
-    tb->page_next[n] = p->first_tb;
+    tb_cold(tb)->page_next[n] = p->first_tb;
     page_already_protected = p->first_tb != NULL;
     p->first_tb = (TranslationBlock *)((uintptr_t)tb | n);
     invalidate_page_bitmap(p);
@@ -944,17 +1343,13 @@ static inline void tb_alloc_page(TranslationBlock *tb, unsigned int n, tb_page_a
    (-1) to indicate that only one page contains the TB. */
 void tb_link_page(TranslationBlock *tb, tb_page_addr_t phys_pc, tb_page_addr_t phys_page2)
 {
-    unsigned int h;
-    TranslationBlock **ptb;
+    TranslationBlockCold *cold;
 
     /* Grab the mmap lock to stop another thread invalidating this TB
        before we are done.  */
     mmap_lock();
     /* add in the physical hash table */
-    h = tb_phys_hash_func(phys_pc);
-    ptb = &tb_phys_hash[h];
-    tb->phys_hash_next = *ptb;
-    *ptb = tb;
+    tb_phys_hash_insert(tb, phys_pc);
 
     /* add in the page list */
     tb_alloc_page(tb, 0, phys_pc & TARGET_PAGE_MASK);
@@ -964,15 +1359,16 @@ void tb_link_page(TranslationBlock *tb, tb_page_addr_t phys_pc, tb_page_addr_t p
         tb->page_addr[1] = -1;
     }
 
-    tb->jmp_first = (TranslationBlock *)((uintptr_t)tb | 2);
-    tb->jmp_next[0] = NULL;
-    tb->jmp_next[1] = NULL;
+    cold = tb_cold(tb);
+    cold->jmp_first = (TranslationBlock *)((uintptr_t)tb | 2);
+    cold->jmp_next[0] = NULL;
+    cold->jmp_next[1] = NULL;
 
     /* init original jump addresses */
-    if (tb->tb_next_offset[0] != 0xffff) {
+    if (cold->tb_next_offset[0] != 0xffff) {
         tb_reset_jump(tb, 0);
     }
-    if (tb->tb_next_offset[1] != 0xffff) {
+    if (cold->tb_next_offset[1] != 0xffff) {
         tb_reset_jump(tb, 1);
     }
 
@@ -984,21 +1380,30 @@ void tb_link_page(TranslationBlock *tb, tb_page_addr_t phys_pc, tb_page_addr_t p
 TranslationBlock *tb_find_pc(uintptr_t tc_ptr)
 {
     int m_min, m_max, m;
-    uintptr_t v;
+    uintptr_t v, index;
     TranslationBlock *tb;
+    CodeGenRegion *region;
+    uint8_t *end;
 
-    if (nb_tbs <= 0) {
+    if (tc_ptr < (uintptr_t)code_gen_buffer) {
+        return NULL;
+    }
+    /* TBs are allocated in increasing tc_ptr order only within a region */
+    index = (tc_ptr - (uintptr_t)code_gen_buffer) / code_gen_region_size;
+    if (index >= (uintptr_t)code_gen_regions_count) {
         return NULL;
     }
-    if (tc_ptr < (uintptr_t)code_gen_buffer || tc_ptr >= (uintptr_t)code_gen_ptr) {
+    region = &code_gen_regions[index];
+    end = index == code_gen_region_current ? code_gen_ptr : region->end;
+    if (region->nb_tbs <= 0 || tc_ptr >= (uintptr_t)end) {
         return NULL;
     }
     /* binary search (cf Knuth) */
     m_min = 0;
-    m_max = nb_tbs - 1;
+    m_max = region->nb_tbs - 1;
     while (m_min <= m_max) {
         m = (m_min + m_max) >> 1;
-        tb = &tbs[m];
+        tb = &region->tbs[m];
         v = (uintptr_t)tb->tc_ptr;
         if (v == tc_ptr) {
             return tb;
@@ -1008,7 +1413,7 @@ TranslationBlock *tb_find_pc(uintptr_t tc_ptr)
             m_min = m + 1;
         }
     }
-    return &tbs[m_max];
+    return &region->tbs[m_max];
 }
 
 static void breakpoint_invalidate(CPUState *env, target_ulong pc)
@@ -1018,20 +1423,22 @@ static void breakpoint_invalidate(CPUState *env, target_ulong pc)
     ram_addr_t ram_addr;
     PhysPageDesc *p;
 
-    for (int i = 0; i < nb_tbs; ++i) {
-        tb = &tbs[i];
-        if (pc < tb->pc || tb->pc + tb->size < pc) {
-            continue;
-        }
+    for (int r = 0; r < code_gen_regions_count; ++r) {
+        for (int i = 0; i < code_gen_regions[r].nb_tbs; ++i) {
+            tb = &code_gen_regions[r].tbs[i];
+            if (pc < tb->pc || tb->pc + tb->size < pc) {
+                continue;
+            }
 
-        p = phys_page_find(tb->page_addr[0] >> TARGET_PAGE_BITS);
-        if (!p) {
-            pd = IO_MEM_UNASSIGNED;
-        } else {
-            pd = p->phys_offset;
+            p = phys_page_find(tb->page_addr[0] >> TARGET_PAGE_BITS);
+            if (!p) {
+                pd = IO_MEM_UNASSIGNED;
+            } else {
+                pd = p->phys_offset;
+            }
+            ram_addr = (pd & TARGET_PAGE_MASK) | (pc & ~TARGET_PAGE_MASK);
+            tb_invalidate_phys_page_range_inner(ram_addr, ram_addr + 1, 0, 0);
         }
-        ram_addr = (pd & TARGET_PAGE_MASK) | (pc & ~TARGET_PAGE_MASK);
-        tb_invalidate_phys_page_range_inner(ram_addr, ram_addr + 1, 0, 0);
     }
 }
 
@@ -1189,11 +1596,86 @@ void cpu_abort(CPUState *env, const char *fmt, ...)
     tlib_abort(s);
 }
 
+static int compare_target_ulong(const void *a, const void *b)
+{
+    target_ulong x = *(const target_ulong *)a;
+    target_ulong y = *(const target_ulong *)b;
+    return x < y ? -1 : x > y;
+}
+
+/* Splits the address space at the bounds of the windows of 'access_type'. Each
+   segment goes to the first window that covers it, as in a scan of the windows
+   in their order. */
+static void external_mmu_index_build(CPUState *env, ExtMmuIndex *index, int access_type)
+{
+    target_ulong bounds[MAX_EXTERNAL_MMU_RANGES * 2 + 1];
+    uint32_t n_bounds = 0, i, b;
+    int16_t window;
+    ExtMmuRange *w;
+
+    bounds[n_bounds++] = 0;
+    for (i = 0; i < MAX_EXTERNAL_MMU_RANGES; i++) {
+        w = &env->external_mmu_window[i];
+        if (w->active && (w->type & (1 << access_type)) && w->range_start < w->range_end) {
+            bounds[n_bounds++] = w->range_start;
+            bounds[n_bounds++] = w->range_end;
+        }
+    }
+    qsort(bounds, n_bounds, sizeof(target_ulong), compare_target_ulong);
+
+    index->count = 0;
+    for (b = 0; b < n_bounds; b++) {
+        if (b > 0 && bounds[b] == bounds[b - 1]) {
+            continue;
+        }
+        window = -1;
+        for (i = 0; i < MAX_EXTERNAL_MMU_RANGES; i++) {
+            w = &env->external_mmu_window[i];
+            if (w->active && (w->type & (1 << access_type)) && bounds[b] >= w->range_start && bounds[b] < w->range_end) {
+                window = i;
+                break;
+            }
+        }
+        if (index->count > 0 && index->windows[index->count - 1] == window) {
+            continue;
+        }
+        index->starts[index->count] = bounds[b];
+        index->windows[index->count] = window;
+        index->count++;
+    }
+}
+
+/* Returns the window that takes the accesses of 'access_type' to 'address', -1 if none */
+static int external_mmu_find_window(CPUState *env, target_ulong address, int access_type)
+{
+    ExtMmuIndex *index = &env->external_mmu_index[access_type];
+    uint32_t m_min, m_max, m;
+
+    if (unlikely(!env->external_mmu_index_valid)) {
+        for (m = 0; m < ARRAY_SIZE(env->external_mmu_index); m++) {
+            external_mmu_index_build(env, &env->external_mmu_index[m], m);
+        }
+        env->external_mmu_index_valid = true;
+    }
+
+    /* the last segment that starts at or before the address */
+    m_min = 0;
+    m_max = index->count;
+    while (m_max - m_min > 1) {
+        m = (m_min + m_max) >> 1;
+        if (index->starts[m] <= address) {
+            m_min = m;
+        } else {
+            m_max = m;
+        }
+    }
+    return index->windows[m_min];
+}
+
 int get_external_mmu_phys_addr(CPUState *env, uint32_t address, int access_type,
                                                               target_phys_addr_t *phys_ptr, int *prot, int no_page_fault)
 {
-    bool found = false;
-    int window_index = 0;
+    int window_index;
     ExtMmuRange *mmu_window = env->external_mmu_window;
     uint32_t access_type_mask = 0;
     switch (access_type) {
@@ -1214,18 +1696,8 @@ int get_external_mmu_phys_addr(CPUState *env, uint32_t address, int access_type,
     *phys_ptr = address;
     *prot = PAGE_READ | PAGE_WRITE | PAGE_EXEC;
 
-    for (; window_index < MAX_EXTERNAL_MMU_RANGES; window_index++) {
-        if (!mmu_window[window_index].active) {
-            break;
-        } else if ((mmu_window[window_index].type & access_type_mask) &&
-                   (address >= mmu_window[window_index].range_start) &&
-                   (address < mmu_window[window_index].range_end)) {
-            found = true;
-            break;
-        }
-    }
-
-    if (found) {
+    window_index = external_mmu_find_window(env, address, access_type);
+    if (window_index != -1) {
         *phys_ptr += mmu_window[window_index].addend;
         *prot = mmu_window[window_index].priv;
         if (*prot & access_type_mask) {
@@ -1238,7 +1710,7 @@ int get_external_mmu_phys_addr(CPUState *env, uint32_t address, int access_type,
         // The exit_request needs to be set to prevent the cpu_exec from trying to execute the block
         cpu->exit_request = 1;
         cpu->mmu_fault = true;
-        tlib_mmu_fault_external_handler(address, access_type, found ? window_index : -1);
+        tlib_mmu_fault_external_handler(address, access_type, window_index);
         if(access_type != ACCESS_INST_FETCH && cpu->current_tb != NULL)
         {
             interrupt_current_translation_block(cpu, MMU_EXTERNAL_FAULT);
@@ -1255,15 +1727,170 @@ static inline void tlb_flush_jmp_cache(CPUState *env, target_ulong addr)
        overlap the flushed page.  */
     i = tb_jmp_cache_hash_page(addr - TARGET_PAGE_SIZE);
     memset(&env->tb_jmp_cache[i], 0, TB_JMP_PAGE_SIZE * sizeof(TranslationBlock *));
+    env->tb_jmp_cache_dirty_pages &= ~(1ull << (i >> TB_JMP_PAGE_BITS));
 
     i = tb_jmp_cache_hash_page(addr);
     memset(&env->tb_jmp_cache[i], 0, TB_JMP_PAGE_SIZE * sizeof(TranslationBlock *));
+    env->tb_jmp_cache_dirty_pages &= ~(1ull << (i >> TB_JMP_PAGE_BITS));
+    tb_reset_cross_page_jumps(addr);
 }
 
 static CPUTLBEntry s_cputlb_empty_entry = {
     .addr_read = -1, .addr_write = -1, .addr_code  = -1, .addend     = -1,
 };
 
+static unsigned int tlb_dyn_min_bits = CPU_TLB_DYN_MIN_BITS;
+static unsigned int tlb_dyn_max_bits = CPU_TLB_DYN_MAX_BITS;
+
+/* Allocates an empty TLB of 'n_entries' entries and opens a new observation window */
+static void tlb_desc_alloc(CPUTLBDesc *desc, uintptr_t n_entries)
+{
+    desc->table = tlib_malloc(n_entries * sizeof(CPUTLBEntry));
+    desc->iotlb = tlib_malloc(n_entries * sizeof(target_phys_addr_t));
+    desc->subpages = tlib_malloc(n_entries * sizeof(CPUTLBSubpages));
+    memset(desc->table, 0xFF, n_entries * sizeof(CPUTLBEntry));
+    desc->mask = (n_entries - 1) << CPU_TLB_ENTRY_BITS;
+    desc->n_used_entries = 0;
+    desc->window_max_entries = 0;
+    desc->window_flushes = 0;
+    desc->n_large_pages = 0;
+}
+
+void tlb_init(CPUState *env)
+{
+    int mmu_idx;
+
+    for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
+        tlb_desc_alloc(&env->tlb_desc[mmu_idx], 1 << CPU_TLB_DYN_DEFAULT_BITS);
+    }
+    /* the flushes skip the modes without entries, so they never empty the victim TLB of a fresh CPU */
+    memset(env->tlb_v_table, 0xFF, sizeof(env->tlb_v_table));
+}
+
+void tlb_free(CPUState *env)
+{
+    int mmu_idx;
+
+    for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
+        tlib_free(env->tlb_desc[mmu_idx].table);
+        tlib_free(env->tlb_desc[mmu_idx].iotlb);
+        tlib_free(env->tlb_desc[mmu_idx].subpages);
+        env->tlb_desc[mmu_idx].table = NULL;
+        env->tlb_desc[mmu_idx].iotlb = NULL;
+        env->tlb_desc[mmu_idx].subpages = NULL;
+    }
+}
+
+/* Empties the TLB of 'mmu_idx', first picking its size for what comes next.
+   The TLB doubles as soon as more than 70% of it got used between two full
+   flushes, and shrinks to fit once no more than 30% of it got used during a
+   window of CPU_TLB_DYN_WINDOW_FLUSHES flushes. Guests with small working sets
+   that flush often thus end up with tables that are cheap to flush. */
+static void tlb_resize_and_flush(CPUState *env, int mmu_idx)
+{
+    CPUTLBDesc *desc = &env->tlb_desc[mmu_idx];
+    uintptr_t old_size = tlb_n_entries(env, mmu_idx);
+    uintptr_t new_size = old_size;
+    uintptr_t max_entries;
+
+    if (desc->n_used_entries > desc->window_max_entries) {
+        desc->window_max_entries = desc->n_used_entries;
+    }
+    desc->window_flushes++;
+    max_entries = desc->window_max_entries;
+
+    if (max_entries * 100 > old_size * 70) {
+        new_size = old_size * 2;
+    } else if (desc->window_flushes >= CPU_TLB_DYN_WINDOW_FLUSHES && max_entries * 100 < old_size * 30) {
+        /* keep the use of the smaller TLB below the growth threshold */
+        new_size = 1;
+        while (max_entries * 100 > new_size * 70) {
+            new_size <<= 1;
+        }
+    }
+    if (new_size < ((uintptr_t)1 << tlb_dyn_min_bits)) {
+        new_size = (uintptr_t)1 << tlb_dyn_min_bits;
+    }
+    if (new_size > ((uintptr_t)1 << tlb_dyn_max_bits)) {
+        new_size = (uintptr_t)1 << tlb_dyn_max_bits;
+    }
+
+    if (new_size != old_size) {
+        tlib_free(desc->table);
+        tlib_free(desc->iotlb);
+        tlib_free(desc->subpages);
+        tlb_desc_alloc(desc, new_size);
+        return;
+    }
+    if (desc->window_flushes >= CPU_TLB_DYN_WINDOW_FLUSHES) {
+        desc->window_flushes = 0;
+        desc->window_max_entries = 0;
+    }
+    desc->n_used_entries = 0;
+    desc->n_large_pages = 0;
+    memset(desc->table, 0xFF, old_size * sizeof(CPUTLBEntry));
+}
+
+/* The sizes are powers of two, hence the bounds are given as exponents */
+void tlb_set_size_bounds(CPUState *env, unsigned int min_bits, unsigned int max_bits)
+{
+    if (min_bits < CPU_TLB_DYN_MIN_BITS || max_bits > CPU_TLB_DYN_MAX_BITS || min_bits > max_bits) {
+        tlib_abortf("Invalid TLB size bounds: 2^%u..2^%u entries, the bounds have to be ordered and within 2^%d..2^%d",
+                    min_bits, max_bits, CPU_TLB_DYN_MIN_BITS, CPU_TLB_DYN_MAX_BITS);
+    }
+    tlb_dyn_min_bits = min_bits;
+    tlb_dyn_max_bits = max_bits;
+    /* bring the current sizes within the new bounds, including the sizes of the modes without entries */
+    env->tlb_dirty_modes = (1 << NB_MMU_MODES) - 1;
+    tlb_flush(env, 1, false);
+}
+
+static inline PageTableWalkCacheEntry *ptw_cache_entry(CPUState *env, uint64_t root, uint32_t walk, int level, uint64_t prefix)
+{
+    uint64_t hash = (prefix ^ (root >> 6) ^ ((uint64_t)walk << 40) ^ ((uint64_t)level << 56)) * 0x9E3779B97F4A7C15ull;
+    return &env->ptw_cache[hash >> (64 - CPU_PTW_CACHE_BITS)];
+}
+
+/* Guest page-table walks can go on from a table an earlier walk reached instead
+   of reading all the levels above it again. The table of 'level' a walk from
+   'root' reaches depends only on the address bits translated by the levels above,
+   passed as 'prefix'. 'walk' tells apart the page-table formats (number of levels,
+   granule) that may share a root. The entries are dropped with the TLB: the
+   targets flush it on the writes to the page-table base registers and on the
+   fences that order page-table updates. */
+bool ptw_cache_lookup(CPUState *env, uint64_t root, uint32_t walk, int level, uint64_t prefix, uint64_t *table)
+{
+    PageTableWalkCacheEntry *e = ptw_cache_entry(env, root, walk, level, prefix);
+
+    if (e->valid && e->root == root && e->prefix == prefix && e->walk == walk && e->level == level) {
+        *table = e->table;
+        return true;
+    }
+    return false;
+}
+
+/* only the tables pointed to by non-leaf entries may be cached, see ptw_cache_lookup */
+void ptw_cache_insert(CPUState *env, uint64_t root, uint32_t walk, int level, uint64_t prefix, uint64_t table)
+{
+    PageTableWalkCacheEntry *e = ptw_cache_entry(env, root, walk, level, prefix);
+
+    e->root = root;
+    e->prefix = prefix;
+    e->table = table;
+    e->walk = walk;
+    e->level = level;
+    e->valid = true;
+    env->ptw_cache_used = true;
+}
+
+static inline void ptw_cache_flush(CPUState *env)
+{
+    if (env->ptw_cache_used) {
+        memset(env->ptw_cache, 0, sizeof(env->ptw_cache));
+        env->ptw_cache_used = false;
+    }
+}
+
 /* NOTE: if flush_global is true, also flush global entries (not
    implemented yet) */
 void tlb_flush(CPUState *env, int flush_global, bool from_generated_code)
@@ -1274,22 +1901,91 @@ void tlb_flush(CPUState *env, int flush_global, bool from_generated_code)
         env->current_tb = NULL;
     }
 
-    memset(env->tlb_table, 0xFF, CPU_TLB_SIZE * NB_MMU_MODES * sizeof (CPUTLBEntry));
+    ptw_cache_flush(env);
 
-    memset(env->tb_jmp_cache, 0, TB_JMP_CACHE_SIZE * sizeof (void *));
+    /* the modes without entries have nothing to drop */
+    for (int mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
+        if (extract32(env->tlb_dirty_modes, mmu_idx, 1)) {
+            tlb_resize_and_flush(env, mmu_idx);
+            memset(&env->tlb_v_table[mmu_idx], 0xFF, CPU_VTLB_SIZE * sizeof(CPUTLBEntry));
+        }
+    }
+    env->tlb_dirty_modes = 0;
+    env->tlb_asid_mixed = false;
+
+    tb_jmp_cache_clear(env);
+    tb_reset_cross_page_jumps(-1);
 
-    env->tlb_flush_addr = -1;
-    env->tlb_flush_mask = 0;
     tlb_flush_count++;
 }
 
-static inline void tlb_flush_entry(CPUTLBEntry *tlb_entry, target_ulong addr)
+/* Returns true if the entry was flushed */
+static inline bool tlb_flush_entry(CPUTLBEntry *tlb_entry, target_ulong addr)
 {
     if (addr == (tlb_entry->addr_read & (TARGET_PAGE_MASK | TLB_INVALID_MASK)) ||
         addr == (tlb_entry->addr_write & (TARGET_PAGE_MASK | TLB_INVALID_MASK)) ||
         addr == (tlb_entry->addr_code & (TARGET_PAGE_MASK | TLB_INVALID_MASK))) {
         *tlb_entry = s_cputlb_empty_entry;
+        return true;
+    }
+    return false;
+}
+
+/* Returns true if the entry mapped a page of the area of 'addr' and 'mask' and was flushed */
+static inline bool tlb_flush_entry_in_area(CPUTLBEntry *tlb_entry, target_ulong addr, target_ulong mask)
+{
+    mask |= TLB_INVALID_MASK;
+    if (addr == (tlb_entry->addr_read & mask) || addr == (tlb_entry->addr_write & mask) || addr == (tlb_entry->addr_code & mask)) {
+        *tlb_entry = s_cputlb_empty_entry;
+        return true;
     }
+    return false;
+}
+
+/* Drops the entries of 'mmu_idx' in the area 'lp', going through the pages of the
+   area or through the whole table, whichever is shorter */
+static void tlb_flush_area(CPUState *env, int mmu_idx, CPUTLBLargePage *lp)
+{
+    CPUTLBDesc *desc = &env->tlb_desc[mmu_idx];
+    uintptr_t n_entries = tlb_n_entries(env, mmu_idx);
+    target_ulong n_pages = (~lp->mask >> TARGET_PAGE_BITS) + 1;
+    target_ulong page;
+    uintptr_t i;
+
+    if (n_pages < n_entries) {
+        for (page = 0; page < n_pages; page++) {
+            if (tlb_flush_entry(tlb_entry(env, mmu_idx, lp->addr + (page << TARGET_PAGE_BITS)), lp->addr + (page << TARGET_PAGE_BITS))) {
+                desc->n_used_entries--;
+            }
+        }
+    } else {
+        for (i = 0; i < n_entries; i++) {
+            if (tlb_flush_entry_in_area(&desc->table[i], lp->addr, lp->mask)) {
+                desc->n_used_entries--;
+            }
+        }
+    }
+    for (i = 0; i < CPU_VTLB_SIZE; i++) {
+        tlb_flush_entry_in_area(&env->tlb_v_table[mmu_idx][i], lp->addr, lp->mask);
+    }
+}
+
+/* Drops the entries of 'mmu_idx' in the areas mapped with large pages that
+   contain 'addr'. Returns true if there were any. */
+static bool tlb_flush_large_pages(CPUState *env, int mmu_idx, target_ulong addr)
+{
+    CPUTLBDesc *desc = &env->tlb_desc[mmu_idx];
+    bool flushed = false;
+    int i;
+
+    for (i = 0; i < desc->n_large_pages; i++) {
+        if ((addr & desc->large_pages[i].mask) == desc->large_pages[i].addr) {
+            tlb_flush_area(env, mmu_idx, &desc->large_pages[i]);
+            desc->large_pages[i--] = desc->large_pages[--desc->n_large_pages];
+            flushed = true;
+        }
+    }
+    return flushed;
 }
 
 void tlb_flush_masked(CPUState *env, uint32_t mmu_indexes_mask)
@@ -1298,41 +1994,96 @@ void tlb_flush_masked(CPUState *env, uint32_t mmu_indexes_mask)
        links while we are modifying them */
     env->current_tb = NULL;
 
+    ptw_cache_flush(env);
+
+    mmu_indexes_mask &= env->tlb_dirty_modes;
     for (int mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx += 1) {
         if (extract32(mmu_indexes_mask, mmu_idx, 1)) {
-            memset(&env->tlb_table[mmu_idx], 0xFF, CPU_TLB_SIZE * sizeof(CPUTLBEntry));
+            tlb_resize_and_flush(env, mmu_idx);
+            memset(&env->tlb_v_table[mmu_idx], 0xFF, CPU_VTLB_SIZE * sizeof(CPUTLBEntry));
         }
     }
+    env->tlb_dirty_modes &= ~mmu_indexes_mask;
+    if (!env->tlb_dirty_modes) {
+        env->tlb_asid_mixed = false;
+    }
 
     // Flush whole jump cache
-    memset(env->tb_jmp_cache, 0, TB_JMP_CACHE_SIZE * sizeof (void *));
+    tb_jmp_cache_clear(env);
+    tb_reset_cross_page_jumps(-1);
+}
+
+/* The TLB does not tag its entries, instead the target calls this with the
+   current ASID before each fill. As long as all the entries got filled under
+   the same ASID, flushes by another ASID have nothing to drop. */
+void tlb_set_asid(CPUState *env, uint32_t asid)
+{
+    if (env->tlb_asid != asid) {
+        if (env->tlb_dirty_modes) {
+            env->tlb_asid_mixed = true;
+        }
+        env->tlb_asid = asid;
+    }
+}
+
+static inline bool tlb_may_hold_asid(CPUState *env, uint32_t asid)
+{
+    return env->tlb_asid_mixed || env->tlb_asid == asid;
+}
+
+/* drop the entries of the address space 'asid' */
+void tlb_flush_asid(CPUState *env, uint32_t asid, bool from_generated_code)
+{
+    /* the walk cache is not tagged with the ASIDs */
+    ptw_cache_flush(env);
+    if (tlb_may_hold_asid(env, asid)) {
+        tlb_flush(env, 1, from_generated_code);
+    }
+}
+
+void tlb_flush_asid_masked(CPUState *env, uint32_t asid, uint32_t mmu_indexes_mask)
+{
+    ptw_cache_flush(env);
+    if (tlb_may_hold_asid(env, asid)) {
+        tlb_flush_masked(env, mmu_indexes_mask);
+    }
 }
 
 void tlb_flush_page_masked(CPUState *env, target_ulong addr, uint32_t mmu_indexes_mask, bool from_generated_code)
 {
-    int i;
+    int k;
     int mmu_idx;
+    bool large_pages = false;
 
-    /* Check if we need to flush due to large pages.  */
-    if ((addr & env->tlb_flush_mask) == env->tlb_flush_addr) {
-        tlb_flush(env, 1, false);
-        return;
-    }
     if (!from_generated_code) {
         /* must reset current TB so that interrupts cannot modify the
            links while we are modifying them */
         env->current_tb = NULL;
     }
 
+    ptw_cache_flush(env);
+
     addr &= TARGET_PAGE_MASK;
-    i = (addr >> TARGET_PAGE_BITS) & (CPU_TLB_SIZE - 1);
+    mmu_indexes_mask &= env->tlb_dirty_modes;
     for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx += 1) {
         if (extract32(mmu_indexes_mask, mmu_idx, 1)) {
-            tlb_flush_entry(&env->tlb_table[mmu_idx][i], addr);
+            /* a large page is mapped with an entry per TARGET_PAGE_SIZE page, all of them have to go */
+            large_pages |= tlb_flush_large_pages(env, mmu_idx, addr);
+            if (tlb_flush_entry(tlb_entry(env, mmu_idx, addr), addr)) {
+                env->tlb_desc[mmu_idx].n_used_entries--;
+            }
+            for (k = 0; k < CPU_VTLB_SIZE; k++) {
+                tlb_flush_entry(&env->tlb_v_table[mmu_idx][k], addr);
+            }
         }
     }
 
-    tlb_flush_jmp_cache(env, addr);
+    if (large_pages) {
+        tb_jmp_cache_clear(env);
+        tb_reset_cross_page_jumps(-1);
+    } else {
+        tlb_flush_jmp_cache(env, addr);
+    }
 }
 
 void tlb_flush_page(CPUState *env, target_ulong addr, bool from_generated_code)
@@ -1370,13 +2121,18 @@ static inline void tlb_set_dirty1(CPUTLBEntry *tlb_entry, target_ulong vaddr)
    so that it is no longer dirty */
 static inline void tlb_set_dirty(CPUState *env, target_ulong vaddr)
 {
-    int i;
+    int k;
     int mmu_idx;
 
     vaddr &= TARGET_PAGE_MASK;
-    i = (vaddr >> TARGET_PAGE_BITS) & (CPU_TLB_SIZE - 1);
     for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
-        tlb_set_dirty1(&env->tlb_table[mmu_idx][i], vaddr);
+        if (!extract32(env->tlb_dirty_modes, mmu_idx, 1)) {
+            continue;
+        }
+        tlb_set_dirty1(tlb_entry(env, mmu_idx, vaddr), vaddr);
+        for (k = 0; k < CPU_VTLB_SIZE; k++) {
+            tlb_set_dirty1(&env->tlb_v_table[mmu_idx][k], vaddr);
+        }
     }
 }
 
@@ -1394,58 +2150,248 @@ static void tlb_protect_code(ram_addr_t ram_addr)
 
     int mmu_idx;
     for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
-        for (i = 0; i < CPU_TLB_SIZE; i++) {
+        if (!extract32(cpu->tlb_dirty_modes, mmu_idx, 1)) {
+            continue;
+        }
+        for (i = 0; i < tlb_n_entries(cpu, mmu_idx); i++) {
             /* we modify the TLB entries so that the dirty bit will be set again
             when accessing the range */
-            tlb_reset_dirty_range(&cpu->tlb_table[mmu_idx][i], start1, TARGET_PAGE_SIZE);
+            tlb_reset_dirty_range(&cpu->tlb_desc[mmu_idx].table[i], start1, TARGET_PAGE_SIZE);
+        }
+        for (i = 0; i < CPU_VTLB_SIZE; i++) {
+            tlb_reset_dirty_range(&cpu->tlb_v_table[mmu_idx][i], start1, TARGET_PAGE_SIZE);
         }
     }
 }
 
-/* Our TLB does not support large pages, so remember the area covered by
-   large pages and trigger a full TLB flush if these are invalidated.  */
-static void tlb_add_large_page(CPUState *env, target_ulong vaddr, target_ulong size)
+/* Our TLB does not support large pages, so remember the areas of each MMU mode
+   covered by large pages, for tlb_flush_page to drop all the entries of an area
+   when any of its pages is invalidated.  */
+static void tlb_add_large_page(CPUState *env, int mmu_idx, target_ulong vaddr, target_ulong size)
 {
+    CPUTLBDesc *desc = &env->tlb_desc[mmu_idx];
+    CPUTLBLargePage *lp;
     target_ulong mask = ~(size - 1);
+    int i;
 
-    if (env->tlb_flush_addr == (target_ulong) - 1) {
-        env->tlb_flush_addr = vaddr & mask;
-        env->tlb_flush_mask = mask;
+    vaddr &= mask;
+    for (i = 0; i < desc->n_large_pages; i++) {
+        lp = &desc->large_pages[i];
+        if ((vaddr & lp->mask) == lp->addr) {
+            return;
+        }
+        if ((lp->addr & mask) == vaddr) {
+            lp->addr = vaddr;
+            lp->mask = mask;
+            return;
+        }
+    }
+    if (desc->n_large_pages < CPU_TLB_LARGE_PAGES) {
+        lp = &desc->large_pages[desc->n_large_pages++];
+        lp->addr = vaddr;
+        lp->mask = mask;
         return;
     }
-    /* Extend the existing region to include the new page.
+    /* Extend the last area to include the new page.
        This is a compromise between unnecessary flushes and the cost
        of maintaining a full variable size TLB.  */
-    mask &= env->tlb_flush_mask;
-    while (((env->tlb_flush_addr ^ vaddr) & mask) != 0) {
+    lp = &desc->large_pages[CPU_TLB_LARGE_PAGES - 1];
+    mask &= lp->mask;
+    while (((lp->addr ^ vaddr) & mask) != 0) {
         mask <<= 1;
     }
-    env->tlb_flush_addr &= mask;
-    env->tlb_flush_mask = mask;
+    lp->addr &= mask;
+    lp->mask = mask;
+}
+
+/* Returns the index of the first of the io_access_regions that ends at or after 'page' */
+static uint32_t io_access_regions_lower_bound(CPUState *env, target_ulong page)
+{
+    uint32_t m_min = 0;
+    uint32_t m_max = env->io_access_regions_count;
+    uint32_t m;
+
+    while (m_min < m_max) {
+        m = (m_min + m_max) >> 1;
+        if (env->io_access_regions[m].end < page) {
+            m_min = m + 1;
+        } else {
+            m_max = m;
+        }
+    }
+    return m_min;
 }
 
 static inline int is_io_accessed(CPUState *env, target_ulong vaddr)
 {
-    target_ulong v;
-    target_ulong page_address = vaddr & ~(TARGET_PAGE_SIZE - 1);
+    target_ulong page_address = vaddr & TARGET_PAGE_MASK;
+    uint32_t i;
 
-    /* binary search (cf Knuth) */
-    int32_t m_min = 0;
-    int32_t m_max = env->io_access_regions_count - 1;
-    int32_t m;
+    if (likely(env->io_access_regions_count == 0)) {
+        return 0;
+    }
+    i = io_access_regions_lower_bound(env, page_address);
+    return i < env->io_access_regions_count && env->io_access_regions[i].start <= page_address;
+}
 
-    while (m_min <= m_max) {
-        m = (m_min + m_max) >> 1;
-        v = env->io_access_regions[m];
-        if (v == page_address) {
-            return 1;
-        } else if (vaddr < v) {
-            m_max = m - 1;
+/* Replaces the 'n_removed' regions at 'i' with 'n_inserted' regions the caller fills in */
+static void io_access_regions_splice(CPUState *env, uint32_t i, uint32_t n_removed, uint32_t n_inserted)
+{
+    uint32_t count = env->io_access_regions_count - n_removed + n_inserted;
+
+    if (count > env->io_access_regions_capacity) {
+        env->io_access_regions_capacity = env->io_access_regions_capacity ? env->io_access_regions_capacity * 2 : 16;
+        if (count > env->io_access_regions_capacity) {
+            env->io_access_regions_capacity = count;
+        }
+        env->io_access_regions = tlib_realloc(env->io_access_regions, env->io_access_regions_capacity * sizeof(IoAccessRegion));
+    }
+    if (n_removed != n_inserted) {
+        memmove(&env->io_access_regions[i + n_inserted], &env->io_access_regions[i + n_removed],
+                (env->io_access_regions_count - i - n_removed) * sizeof(IoAccessRegion));
+    }
+    env->io_access_regions_count = count;
+}
+
+/* Makes the accesses to the pages from the one of 'start' to the one of 'end'
+   go through the IO callbacks, merging them with the regions they overlap or
+   touch. The caller flushes the TLB entries of the pages. */
+void io_access_regions_add(CPUState *env, target_ulong start, target_ulong end)
+{
+    uint32_t i, j;
+
+    start &= TARGET_PAGE_MASK;
+    end &= TARGET_PAGE_MASK;
+
+    i = io_access_regions_lower_bound(env, start == 0 ? 0 : start - TARGET_PAGE_SIZE);
+    for (j = i; j < env->io_access_regions_count; j++) {
+        if (env->io_access_regions[j].start > end && env->io_access_regions[j].start - end != TARGET_PAGE_SIZE) {
+            break;
+        }
+    }
+    if (i != j) {
+        if (env->io_access_regions[i].start < start) {
+            start = env->io_access_regions[i].start;
+        }
+        if (env->io_access_regions[j - 1].end > end) {
+            end = env->io_access_regions[j - 1].end;
+        }
+    }
+    io_access_regions_splice(env, i, j - i, 1);
+    env->io_access_regions[i].start = start;
+    env->io_access_regions[i].end = end;
+}
+
+/* Undoes io_access_regions_add for the pages from the one of 'start' to the one of 'end' */
+void io_access_regions_remove(CPUState *env, target_ulong start, target_ulong end)
+{
+    IoAccessRegion kept[2];
+    uint32_t i, j, n_kept = 0;
+
+    start &= TARGET_PAGE_MASK;
+    end &= TARGET_PAGE_MASK;
+
+    i = io_access_regions_lower_bound(env, start);
+    j = i;
+    while (j < env->io_access_regions_count && env->io_access_regions[j].start <= end) {
+        j++;
+    }
+    if (i == j) {
+        return;
+    }
+    /* the first and the last of the overlapped regions may stick out of the range */
+    if (env->io_access_regions[i].start < start) {
+        kept[n_kept].start = env->io_access_regions[i].start;
+        kept[n_kept++].end = start - TARGET_PAGE_SIZE;
+    }
+    if (env->io_access_regions[j - 1].end > end) {
+        kept[n_kept].start = end + TARGET_PAGE_SIZE;
+        kept[n_kept++].end = env->io_access_regions[j - 1].end;
+    }
+    io_access_regions_splice(env, i, j - i, n_kept);
+    memcpy(&env->io_access_regions[i], kept, n_kept * sizeof(IoAccessRegion));
+}
+
+/* Drops all the regions, as on CPU reset; the caller flushes the TLB if needed */
+void io_access_regions_clear(CPUState *env)
+{
+    env->io_access_regions_count = 0;
+}
+
+void io_access_regions_free(CPUState *env)
+{
+    tlib_free(env->io_access_regions);
+    env->io_access_regions = NULL;
+    env->io_access_regions_count = 0;
+    env->io_access_regions_capacity = 0;
+}
+
+static inline bool tlb_entry_is_empty(CPUTLBEntry *te)
+{
+    return te->addr_read == (target_ulong)-1 && te->addr_write == (target_ulong)-1 && te->addr_code == (target_ulong)-1;
+}
+
+/* Tells if 'te' is a valid entry for a page other than 'page' that tlb_set_page
+   may move to the victim TLB. TLB_ONE_SHOT entries are never kept, as the
+   access checks must be redone for each access to such a page. */
+static inline bool tlb_entry_is_victim_candidate(CPUTLBEntry *te, target_ulong page)
+{
+    target_ulong addrs[3] = { te->addr_read, te->addr_write, te->addr_code };
+    bool valid = false;
+    int i;
+
+    for (i = 0; i < 3; i++) {
+        if (addrs[i] == (target_ulong)-1) {
+            continue;
+        }
+        if ((addrs[i] & TLB_ONE_SHOT) || (addrs[i] & TARGET_PAGE_MASK) == page) {
+            return false;
+        }
+        valid = true;
+    }
+    return valid;
+}
+
+/* Look the page up in the victim TLB after it missed in tlb_desc[mmu_idx].table[index].
+   On a hit the two entries are swapped, so that the caller can retry the access
+   without going through tlb_fill. 'access_type' is as in tlb_fill. */
+bool victim_tlb_hit(CPUState *env, int mmu_idx, int index, int access_type, target_ulong page)
+{
+    CPUTLBEntry *te, *vte, tmp_entry;
+    target_phys_addr_t tmp_iotlb;
+    CPUTLBSubpages tmp_subpages;
+    target_ulong cmp;
+    int vidx;
+
+    for (vidx = 0; vidx < CPU_VTLB_SIZE; vidx++) {
+        vte = &env->tlb_v_table[mmu_idx][vidx];
+        if (access_type == 1) {
+            cmp = vte->addr_write;
+        } else if (access_type == 2) {
+            cmp = vte->addr_code;
         } else {
-            m_min = m + 1;
+            cmp = vte->addr_read;
+        }
+        if ((cmp & (TARGET_PAGE_MASK | TLB_INVALID_MASK)) == page) {
+            te = &env->tlb_desc[mmu_idx].table[index];
+            if (tlb_entry_is_empty(te)) {
+                env->tlb_desc[mmu_idx].n_used_entries++;
+            }
+            tmp_entry = *te;
+            *te = *vte;
+            *vte = tmp_entry;
+
+            tmp_iotlb = env->tlb_desc[mmu_idx].iotlb[index];
+            env->tlb_desc[mmu_idx].iotlb[index] = env->iotlb_v[mmu_idx][vidx];
+            env->iotlb_v[mmu_idx][vidx] = tmp_iotlb;
+
+            tmp_subpages = env->tlb_desc[mmu_idx].subpages[index];
+            env->tlb_desc[mmu_idx].subpages[index] = env->subpages_v[mmu_idx][vidx];
+            env->subpages_v[mmu_idx][vidx] = tmp_subpages;
+            return true;
         }
     }
-    return 0;
+    return false;
 }
 
 /* Add a new TLB entry. At most one entry for a given virtual address
@@ -1455,7 +2401,7 @@ void tlb_set_page(CPUState *env, target_ulong vaddr, target_phys_addr_t paddr, i
 {
     PhysPageDesc *p;
     ram_addr_t pd;
-    unsigned int index;
+    unsigned int index, vidx;
     target_ulong address;
     target_ulong code_address;
     uintptr_t addend;
@@ -1473,7 +2419,7 @@ void tlb_set_page(CPUState *env, target_ulong vaddr, target_phys_addr_t paddr, i
 
     assert(size >= TARGET_PAGE_SIZE);
     if (size != TARGET_PAGE_SIZE) {
-        tlb_add_large_page(env, vaddr, size);
+        tlb_add_large_page(env, mmu_idx, vaddr, size);
     }
     p = phys_page_find(paddr >> TARGET_PAGE_BITS);
     if (!p) {
@@ -1519,9 +2465,27 @@ void tlb_set_page(CPUState *env, target_ulong vaddr, target_phys_addr_t paddr, i
         address |= TLB_MMIO;
     }
 
-    index = (vaddr >> TARGET_PAGE_BITS) & (CPU_TLB_SIZE - 1);
-    env->iotlb[mmu_idx][index] = iotlb - vaddr;
-    te = &env->tlb_table[mmu_idx][index];
+    index = tlb_index(env, mmu_idx, vaddr);
+    te = &env->tlb_desc[mmu_idx].table[index];
+    env->tlb_dirty_modes |= 1 << mmu_idx;
+
+    /* keep the entry being replaced if it is still valid, and drop the stale
+       copy of this page the victim TLB may hold */
+    for (vidx = 0; vidx < CPU_VTLB_SIZE; vidx++) {
+        tlb_flush_entry(&env->tlb_v_table[mmu_idx][vidx], vaddr & TARGET_PAGE_MASK);
+    }
+    if (tlb_entry_is_victim_candidate(te, vaddr & TARGET_PAGE_MASK)) {
+        vidx = env->vtlb_index++ % CPU_VTLB_SIZE;
+        env->tlb_v_table[mmu_idx][vidx] = *te;
+        env->iotlb_v[mmu_idx][vidx] = env->tlb_desc[mmu_idx].iotlb[index];
+    }
+    if (tlb_entry_is_empty(te)) {
+        env->tlb_desc[mmu_idx].n_used_entries++;
+    }
+
+    env->tlb_desc[mmu_idx].iotlb[index] = iotlb - vaddr;
+    env->tlb_desc[mmu_idx].subpages[index].count = 0;
+    env->tlb_desc[mmu_idx].subpages[index].next = 0;
     te->addend = addend - vaddr;
     if (prot & PAGE_READ) {
         te->addr_read = address;
@@ -1548,6 +2512,87 @@ void tlb_set_page(CPUState *env, target_ulong vaddr, target_phys_addr_t paddr, i
     }
 }
 
+/* Like tlb_set_page with a size below TARGET_PAGE_SIZE, for a page that is only
+   partly covered by the protection regions of the target. The access that caused
+   the fill lies in ['sub_vaddr', 'sub_vaddr' + 'sub_size'), over which the
+   protection 'sub_prot' holds. The later accesses to the entry that lie in such a
+   region skip tlb_fill; refilling the same mapping adds to the checked regions. */
+void tlb_set_subpage(CPUState *env, target_ulong vaddr, target_phys_addr_t paddr, int prot, int mmu_idx, target_ulong sub_vaddr,
+                     target_ulong sub_size, int sub_prot)
+{
+    unsigned int index = tlb_index(env, mmu_idx, vaddr);
+    CPUTLBEntry old_entry = env->tlb_desc[mmu_idx].table[index];
+    target_phys_addr_t old_iotlb = env->tlb_desc[mmu_idx].iotlb[index];
+    CPUTLBSubpages old_subpages = env->tlb_desc[mmu_idx].subpages[index];
+    CPUTLBEntry *te = &env->tlb_desc[mmu_idx].table[index];
+    CPUTLBSubpages *sp = &env->tlb_desc[mmu_idx].subpages[index];
+    target_ulong start, end;
+    int slot;
+
+    tlb_set_page(env, vaddr, paddr, prot, mmu_idx, 1);
+
+    if (old_entry.addr_read == te->addr_read && old_entry.addr_write == te->addr_write && old_entry.addr_code == te->addr_code &&
+        old_entry.addend == te->addend && old_iotlb == env->tlb_desc[mmu_idx].iotlb[index]) {
+        *sp = old_subpages;
+    }
+
+    vaddr &= TARGET_PAGE_MASK;
+    start = sub_vaddr < vaddr ? 0 : sub_vaddr - vaddr;
+    end = sub_vaddr + sub_size - 1 - vaddr;
+    if (start >= TARGET_PAGE_SIZE || sub_vaddr + sub_size - 1 < vaddr) {
+        return;
+    }
+    if (end >= TARGET_PAGE_SIZE) {
+        end = TARGET_PAGE_SIZE - 1;
+    }
+
+    if (sp->count < CPU_TLB_SUBPAGES) {
+        slot = sp->count++;
+    } else {
+        slot = sp->next;
+        sp->next = (sp->next + 1) % CPU_TLB_SUBPAGES;
+    }
+    sp->regions[slot].start = start;
+    sp->regions[slot].end = end;
+    sp->regions[slot].prot = sub_prot;
+}
+
+/* Tells if the TLB_ONE_SHOT entry 'index' of 'mmu_idx' maps the page of 'addr'
+   but the access of 'size' bytes at 'addr' lies outside of the regions checked
+   by tlb_set_subpage, so that it has to go through tlb_fill before using the
+   entry. 'access_type' is as in tlb_fill. */
+bool tlb_one_shot_needs_fill(CPUState *env, int mmu_idx, int index, target_ulong addr, int size, int access_type)
+{
+    CPUTLBEntry *te = &env->tlb_desc[mmu_idx].table[index];
+    CPUTLBSubpages *sp = &env->tlb_desc[mmu_idx].subpages[index];
+    target_ulong tlb_addr, start, end;
+    int prot, i;
+
+    if (access_type == 1) {
+        tlb_addr = te->addr_write;
+        prot = PAGE_WRITE;
+    } else if (access_type == 2) {
+        tlb_addr = te->addr_code;
+        prot = PAGE_EXEC;
+    } else {
+        tlb_addr = te->addr_read;
+        prot = PAGE_READ;
+    }
+    if ((addr & TARGET_PAGE_MASK) != (tlb_addr & (TARGET_PAGE_MASK | TLB_INVALID_MASK))) {
+        /* a plain TLB miss */
+        return false;
+    }
+
+    start = addr & ~TARGET_PAGE_MASK;
+    end = start + size - 1;
+    for (i = 0; i < sp->count; i++) {
+        if (start >= sp->regions[i].start && end <= sp->regions[i].end && (sp->regions[i].prot & prot)) {
+            return false;
+        }
+    }
+    return true;
+}
+
 /* register physical memory.
    For RAM, 'size' must be a multiple of the target page size.
    If (phys_offset & ~TARGET_PAGE_MASK) != 0, then it is an
@@ -2096,6 +3141,84 @@ void stq_phys(target_phys_addr_t addr, uint64_t val)
     cpu_physical_memory_write(addr, &val, 8);
 }
 
+/* Sets the number of entries of the memory access trace buffer, handing the
+   pending ones to the host first. A block records fewer accesses than it has
+   ops, so the last OPC_MEM_TRACE_BUF_SIZE entries are kept for the block being
+   executed when the buffer gets flushed, see gen_mem_trace_check. */
+void mem_trace_set_capacity(CPUState *env, uint32_t capacity)
+{
+    mem_trace_flush(env);
+    mem_trace_free(env);
+
+    if (capacity < 2 * OPC_MEM_TRACE_BUF_SIZE) {
+        capacity = 2 * OPC_MEM_TRACE_BUF_SIZE;
+    }
+    env->mem_trace_buffer = tlib_malloc(capacity * sizeof(MemoryAccessTraceEntry));
+    env->mem_trace_next = env->mem_trace_buffer;
+    env->mem_trace_limit = env->mem_trace_buffer + capacity - OPC_MEM_TRACE_BUF_SIZE;
+    env->mem_trace_capacity = capacity;
+}
+
+/* Makes sure the buffers the tracing code writes to exist. The flag enabling
+   the tracing is serialized, so a state import can set it without going
+   through tlib_on_memory_access_event_enabled. */
+void mem_trace_prepare(CPUState *env)
+{
+    if (env->mem_trace_buffer == NULL) {
+        mem_trace_set_capacity(env, MEM_TRACE_DEFAULT_CAPACITY);
+    }
+    tcg_use_mem_trace_buffers();
+}
+
+void mem_trace_free(CPUState *env)
+{
+    if (env->mem_trace_buffer != NULL) {
+        tlib_free(env->mem_trace_buffer);
+    }
+    env->mem_trace_buffer = NULL;
+    env->mem_trace_next = NULL;
+    env->mem_trace_limit = NULL;
+    env->mem_trace_capacity = 0;
+}
+
+/* Hands the traced memory accesses to the host */
+void mem_trace_flush(CPUState *env)
+{
+    uint32_t count = env->mem_trace_next - env->mem_trace_buffer;
+    if (count != 0) {
+        tlib_on_memory_access_batch(env->mem_trace_buffer, count);
+        env->mem_trace_next = env->mem_trace_buffer;
+    }
+}
+
+/* Records an access of the softmmu helpers. The accesses of the generated code
+   are recorded by the code itself before they are made, see tcg_gen_mem_trace,
+   only their operation is corrected here once they turn out to hit IO. */
+void mem_trace_record(CPUState *env, uint32_t operation, target_ulong addr, uint32_t size, bool from_generated_code)
+{
+    MemoryAccessTraceEntry *entry;
+
+    if (from_generated_code) {
+        if ((operation == MEMORY_IO_READ || operation == MEMORY_IO_WRITE) && env->mem_trace_next != env->mem_trace_buffer) {
+            env->mem_trace_next[-1].operation = operation;
+        }
+        return;
+    }
+    if (unlikely(env->mem_trace_buffer == NULL)) {
+        /* the tracing was enabled by a state import, see mem_trace_prepare */
+        mem_trace_set_capacity(env, MEM_TRACE_DEFAULT_CAPACITY);
+    }
+    /* the entries past the limit are kept for the block being executed */
+    if (env->mem_trace_next >= env->mem_trace_limit) {
+        mem_trace_flush(env);
+    }
+    entry = env->mem_trace_next++;
+    entry->pc = CPU_PC(env);
+    entry->address = addr;
+    entry->size = size;
+    entry->operation = operation;
+}
+
 #define MMUSUFFIX _cmmu
 #ifdef GETPC
 #undef GETPC
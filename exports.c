@@ -25,6 +25,7 @@
 #include "exec-all.h"
 #include "tb-helper.h"
 #include "unwind.h"
+#include "tb-cache.h"
 
 #include "exports.h"
 
@@ -39,22 +40,19 @@ void gen_helpers(void) {
 
 static void init_tcg()
 {
-    stcg.ldb = __ldb_mmu;
-    stcg.ldw = __ldw_mmu;
-    stcg.ldl = __ldl_mmu;
-    stcg.ldq = __ldq_mmu;
-    stcg.stb = __stb_mmu;
-    stcg.stw = __stw_mmu;
-    stcg.stl = __stl_mmu;
-    stcg.stq = __stq_mmu;
+    stcg.ldb = __ldb_tcg_mmu;
+    stcg.ldw = __ldw_tcg_mmu;
+    stcg.ldl = __ldl_tcg_mmu;
+    stcg.ldq = __ldq_tcg_mmu;
+    stcg.stb = __stb_tcg_mmu;
+    stcg.stw = __stw_tcg_mmu;
+    stcg.stl = __stl_tcg_mmu;
+    stcg.stq = __stq_tcg_mmu;
     tcg_attach(&stcg);
     set_temp_buf_offset(offsetof(CPUState, temp_buf));
     int i;
     for (i = 0; i < NB_MMU_MODES + 1; i++) {
-        set_tlb_table_n_0_rwa(i, offsetof(CPUState, tlb_table[i][0].addr_read), offsetof(CPUState,
-                                                                                         tlb_table[i][0].addr_write),
-                              offsetof(CPUState, tlb_table[i][0].addend));
-        set_tlb_table_n_0(i, offsetof(CPUState, tlb_table[i][0]));
+        set_tlb_desc_mask_table(i, offsetof(CPUState, tlb_desc[i].mask), offsetof(CPUState, tlb_desc[i].table));
     }
     set_tlb_entry_addr_rwu(offsetof(CPUTLBEntry, addr_read), offsetof(CPUTLBEntry, addr_write), offsetof(CPUTLBEntry, addend));
     set_sizeof_CPUTLBEntry(sizeof(CPUTLBEntry));
@@ -184,6 +182,24 @@ uint32_t tlib_get_maximum_block_size()
 
 EXC_INT_0(uint32_t, tlib_get_maximum_block_size)
 
+// The TLB of each MMU mode holds between 2^min_bits and 2^max_bits entries, depending on how much of it gets used
+void tlib_set_tlb_size_bounds(uint32_t min_bits, uint32_t max_bits)
+{
+    tlb_set_size_bounds(cpu, min_bits, max_bits);
+}
+
+EXC_VOID_2(tlib_set_tlb_size_bounds, uint32_t, min_bits, uint32_t, max_bits)
+
+uint32_t tlib_get_tlb_size(uint32_t mmu_idx)
+{
+    if (mmu_idx >= NB_MMU_MODES) {
+        tlib_abortf("Invalid MMU mode: %" PRIu32, mmu_idx);
+    }
+    return tlb_n_entries(cpu, mmu_idx);
+}
+
+EXC_INT_1(uint32_t, tlib_get_tlb_size, uint32_t, mmu_idx)
+
 void tlib_set_cycles_per_instruction(uint32_t count)
 {
     env->cycles_per_instruction = count;
@@ -211,6 +227,7 @@ int32_t tlib_init(char *cpu_name)
         return -1;
     }
     tlib_set_maximum_block_size(TCG_MAX_INSNS);
+    tb_cache_set_cpu_model(cpu_name);
     env->atomic_memory_state = NULL;
     return 0;
 }
@@ -226,11 +243,39 @@ void tlib_atomic_memory_state_init(int id, uintptr_t atomic_memory_state_ptr)
 
 EXC_VOID_2(tlib_atomic_memory_state_init, int, id, uintptr_t, atomic_memory_state_ptr)
 
+// the number of bytes the host has to allocate for the memory passed to tlib_atomic_memory_state_init
+uint32_t tlib_get_atomic_memory_state_size()
+{
+    return sizeof(atomic_memory_state_t);
+}
+
+EXC_INT_0(uint32_t, tlib_get_atomic_memory_state_size)
+
+// the size of the memory block in which the accesses of the other cores break a reservation, 1 means the exact address
+void tlib_set_reservation_granule(uint32_t size)
+{
+    if(cpu->atomic_memory_state == NULL)
+    {
+        tlib_abortf("The atomic memory state has to be initialized before setting the reservation granule");
+    }
+    if(size == 0 || (size & (size - 1)) != 0)
+    {
+        tlib_abortf("Invalid reservation granule: %" PRIu32 " bytes, the size has to be a power of 2", size);
+    }
+    set_reservation_granule(cpu, size);
+}
+
+EXC_VOID_1(tlib_set_reservation_granule, uint32_t, size)
+
 void tlib_dispose()
 {
     tlib_arch_dispose();
+    tb_cache_close();
     code_gen_free();
     free_all_page_descriptors();
+    tlb_free(cpu);
+    mem_trace_free(cpu);
+    io_access_regions_free(cpu);
     // `tlib_free` is an EXTERNAL_AS, as such we need to clear `cpu` before calling it
     // to avoid a use-after-free in its wrapper
     CPUState *cpu_copy = cpu;
@@ -245,6 +290,7 @@ EXC_VOID_0(tlib_dispose)
 // there is `cpu->instructions_count_total_value` that contains the cumulative value
 uint64_t tlib_get_executed_instructions()
 {
+    cpu_sync_instructions_count(cpu);
     uint64_t result = cpu->instructions_count_value;
     cpu->instructions_count_value = 0;
     cpu->instructions_count_limit -= result;
@@ -259,14 +305,17 @@ EXC_INT_0(uint64_t, tlib_get_executed_instructions)
 // includes it in the returned value.
 void tlib_reset_executed_instructions(uint32_t val)
 {
+    cpu_sync_instructions_count(cpu);
     cpu->instructions_count_value = val;
     cpu->instructions_count_limit += val;
+    cpu_sync_instructions_budget(cpu);
 }
 
 EXC_VOID_1(tlib_reset_executed_instructions, uint64_t, val)
 
 uint64_t tlib_get_total_executed_instructions()
 {
+    cpu_sync_instructions_count(cpu);
     return cpu->instructions_count_total_value;
 }
 
@@ -292,6 +341,7 @@ int32_t tlib_execute(uint32_t max_insns)
         tlib_abortf("Tried to execute cpu without reading executed instructions count first.");
     }
     cpu->instructions_count_limit = max_insns;
+    cpu_sync_instructions_budget(cpu);
 
     uint32_t local_counter = 0;
     int32_t result = EXCP_INTERRUPT;
@@ -313,6 +363,11 @@ int32_t tlib_execute(uint32_t max_insns)
     // as this is might be accessed after calling `tlib_execute`
     // to read the progress
     cpu->instructions_count_value = local_counter;
+    cpu_sync_instructions_budget(cpu);
+
+    if (cpu->tlib_is_on_memory_access_enabled) {
+        mem_trace_flush(cpu);
+    }
 
     return result;
 }
@@ -529,6 +584,123 @@ uint32_t tlib_get_tb_cache_enabled()
 
 EXC_INT_0(uint32_t, tlib_get_tb_cache_enabled)
 
+uint64_t tlib_get_tb_hash_lookup_count()
+{
+    return tb_phys_hash_statistics.lookups;
+}
+
+EXC_INT_0(uint64_t, tlib_get_tb_hash_lookup_count)
+
+uint64_t tlib_get_tb_hash_probe_count()
+{
+    return tb_phys_hash_statistics.probes;
+}
+
+EXC_INT_0(uint64_t, tlib_get_tb_hash_probe_count)
+
+uint32_t tlib_get_tb_hash_max_probe_length()
+{
+    return tb_phys_hash_statistics.max_probe_length;
+}
+
+EXC_INT_0(uint32_t, tlib_get_tb_hash_max_probe_length)
+
+uint32_t tlib_get_tb_hash_entries()
+{
+    return tb_phys_hash_statistics.entries;
+}
+
+EXC_INT_0(uint32_t, tlib_get_tb_hash_entries)
+
+uint32_t tlib_get_tb_hash_capacity()
+{
+    return tb_phys_hash_statistics.capacity;
+}
+
+EXC_INT_0(uint32_t, tlib_get_tb_hash_capacity)
+
+void tlib_reset_tb_hash_statistics()
+{
+    tb_phys_hash_statistics.lookups = 0;
+    tb_phys_hash_statistics.probes = 0;
+    tb_phys_hash_statistics.max_probe_length = 0;
+}
+
+EXC_VOID_0(tlib_reset_tb_hash_statistics)
+
+// 0 disables the execution counters and superblocks; the counters are part of the generated code, hence the flush
+void tlib_set_superblock_threshold(uint32_t threshold)
+{
+#ifndef SUPPORTS_SUPERBLOCKS
+    if (threshold != 0) {
+        tlib_printf(LOG_LEVEL_WARNING, "This architecture does not support superblocks");
+        return;
+    }
+#endif
+    if (superblock_threshold != threshold) {
+        superblock_threshold = threshold;
+        tlib_invalidate_translation_cache();
+    }
+}
+
+EXC_VOID_1(tlib_set_superblock_threshold, uint32_t, threshold)
+
+uint32_t tlib_get_superblock_threshold()
+{
+    return superblock_threshold;
+}
+
+EXC_INT_0(uint32_t, tlib_get_superblock_threshold)
+
+// the superblocks translated from now on go through the TCG optimizer
+void tlib_set_superblock_optimizer_enabled(uint32_t enabled)
+{
+    superblock_optimizer_enabled = enabled;
+}
+
+EXC_VOID_1(tlib_set_superblock_optimizer_enabled, uint32_t, enabled)
+
+static uint64_t pretranslated_byte_count;
+
+// 'flags' takes PRETRANSLATE_* options; returns the number of blocks translated, see tb_pretranslate_range
+uint64_t tlib_pretranslate_range(uint64_t start, uint64_t end, uint32_t flags)
+{
+    return tb_pretranslate_range(cpu, start, end, flags, &pretranslated_byte_count);
+}
+
+EXC_INT_3(uint64_t, tlib_pretranslate_range, uint64_t, start, uint64_t, end, uint32_t, flags)
+
+// the size of the guest code covered by the blocks of the last tlib_pretranslate_range call
+uint64_t tlib_get_pretranslated_byte_count()
+{
+    return pretranslated_byte_count;
+}
+
+EXC_INT_0(uint64_t, tlib_get_pretranslated_byte_count)
+
+// returns the number of blocks read from the file at 'path', -1 if the translation cache is not supported on this host;
+// the blocks translated from now on are written to the file by tlib_close_translation_cache or tlib_dispose
+int32_t tlib_open_translation_cache(char *path)
+{
+    return tb_cache_open(path);
+}
+
+EXC_INT_1(int32_t, tlib_open_translation_cache, char *, path)
+
+void tlib_close_translation_cache()
+{
+    tb_cache_close();
+}
+
+EXC_VOID_0(tlib_close_translation_cache)
+
+uint64_t tlib_get_translation_cache_hit_count()
+{
+    return tb_cache_get_hit_count();
+}
+
+EXC_INT_0(uint64_t, tlib_get_translation_cache_hit_count)
+
 void tlib_set_block_finished_hook_present(uint32_t val)
 {
     cpu->block_finished_hook_present = !!val;
@@ -595,15 +767,34 @@ void tlib_set_interrupt_end_hook_present(uint32_t val)
 
 EXC_VOID_1(tlib_set_interrupt_end_hook_present, uint32_t, val)
 
+// The accesses are recorded by the generated code, which keeps using the TLB, and handed to the host in batches,
+// see tlib_on_memory_access_batch; the blocks translated before do not record them, hence the flush
 void tlib_on_memory_access_event_enabled(int32_t value)
 {
-    cpu->tlib_is_on_memory_access_enabled = !!value;
-    // In order to get all of the memory accesses we need to prevent tcg from using the tlb
-    tcg_context_use_tlb(!value);
+    value = !!value;
+    // a state import can set the flag without the buffers
+    if (cpu->tlib_is_on_memory_access_enabled == value && (!value || cpu->mem_trace_buffer != NULL)) {
+        return;
+    }
+    if (value) {
+        mem_trace_prepare(cpu);
+    } else {
+        mem_trace_flush(cpu);
+    }
+    cpu->tlib_is_on_memory_access_enabled = value;
+    tlib_invalidate_translation_cache();
 }
 
 EXC_VOID_1(tlib_on_memory_access_event_enabled, int32_t, value)
 
+// The number of memory accesses buffered before they are handed to the host
+void tlib_set_memory_access_trace_capacity(uint32_t capacity)
+{
+    mem_trace_set_capacity(cpu, capacity);
+}
+
+EXC_VOID_1(tlib_set_memory_access_trace_capacity, uint32_t, capacity)
+
 void tlib_clean_wfi_proc_state(void)
 {
     // Invalidates "Wait for interrupt" state, and makes the core ready to resume execution
@@ -680,44 +871,51 @@ uint32_t tlib_get_current_tb_disas_flags()
         return 0xFFFFFFFF;
     }
 
-    return cpu->current_tb->disas_flags;
+    return tb_cold(cpu->current_tb)->disas_flags;
 }
 
 EXC_INT_0(uint32_t, tlib_get_current_tb_disas_flags)
 
-void tlib_set_page_io_accessed(uint64_t address)
+// The last address of an IO accessed range, which is clamped to the end of the address space
+static uint64_t io_accessed_range_last(uint64_t address, uint64_t size)
 {
-    if(env->io_access_regions_count == MAX_IO_ACCESS_REGIONS_COUNT)
-    {
-        tlib_abortf("Couldn't register an IO accessible page 0x%x", address);
+    uint64_t last = address + size - 1;
+
+    if (last < address) {
+        last = UINT64_MAX;
+    }
+#if TARGET_LONG_BITS == 32
+    if (address > TARGET_ULONG_MAX) {
+        tlib_abortf("Invalid IO accessed range: the address 0x%" PRIx64 " is outside of the address space", address);
     }
+    if (last > TARGET_ULONG_MAX) {
+        last = TARGET_ULONG_MAX;
+    }
+#endif
+    return last;
+}
 
-    target_ulong page_address = address & ~(TARGET_PAGE_SIZE - 1);
+// Flushes the TLB entries of the pages of an IO accessed range
+static void flush_io_accessed_range(uint64_t address, uint64_t last)
+{
+    uint64_t pages = (last >> TARGET_PAGE_BITS) - (address >> TARGET_PAGE_BITS) + 1;
+    uint64_t i;
 
-    int i, j;
-    for(i = 0; i < env->io_access_regions_count; i++)
+    // past the default size of a TLB it's cheaper to drop all the entries
+    if(pages > (1 << CPU_TLB_DYN_DEFAULT_BITS))
     {
-        if(env->io_access_regions[i] == page_address)
-        {
-            // it's already here, just break
-            return;
-        }
-
-        // since regions are sorted ascending, this is the right place to put the new entry
-        if(env->io_access_regions[i] > page_address)
-        {
-            break;
-        }
+        tlb_flush(env, 1, false);
+        return;
     }
-
-    for(j = env->io_access_regions_count; j > i; j--)
+    for(i = 0; i < pages; i++)
     {
-        env->io_access_regions[j] = env->io_access_regions[j - 1];
+        tlb_flush_page(env, address + (i << TARGET_PAGE_BITS), false);
     }
+}
 
-    env->io_access_regions[i] = page_address;
-    env->io_access_regions_count++;
-
+void tlib_set_page_io_accessed(uint64_t address)
+{
+    io_access_regions_add(env, address, address);
     tlb_flush_page(env, address, false);
 }
 
@@ -725,34 +923,79 @@ EXC_VOID_1(tlib_set_page_io_accessed, uint64_t, address)
 
 void tlib_clear_page_io_accessed(uint64_t address)
 {
-    target_ulong page_address = address & ~(TARGET_PAGE_SIZE - 1);
+    io_access_regions_remove(env, address, address);
+    tlb_flush_page(env, address, false);
+}
+
+EXC_VOID_1(tlib_clear_page_io_accessed, uint64_t, address)
 
-    int i, j;
-    for(i = 0; i < env->io_access_regions_count; i++)
+void tlib_set_range_io_accessed(uint64_t address, uint64_t size)
+{
+    if(size == 0)
     {
-        if(env->io_access_regions[i] == page_address)
-        {
-            break;
-        }
+        return;
     }
+    uint64_t last = io_accessed_range_last(address, size);
+    io_access_regions_add(env, address, last);
+    flush_io_accessed_range(address, last);
+}
 
-    if(i == env->io_access_regions_count)
+EXC_VOID_2(tlib_set_range_io_accessed, uint64_t, address, uint64_t, size)
+
+void tlib_clear_range_io_accessed(uint64_t address, uint64_t size)
+{
+    if(size == 0)
     {
-        // it was not marked as IO
         return;
     }
+    uint64_t last = io_accessed_range_last(address, size);
+    io_access_regions_remove(env, address, last);
+    flush_io_accessed_range(address, last);
+}
 
-    for(j = i; j < env->io_access_regions_count - 1; j++)
-    {
-        env->io_access_regions[j] = env->io_access_regions[j + 1];
+EXC_VOID_2(tlib_clear_range_io_accessed, uint64_t, address, uint64_t, size)
+
+void tlib_clear_io_accessed_regions()
+{
+    io_access_regions_clear(env);
+    tlb_flush(env, 1, false);
+}
+
+EXC_VOID_0(tlib_clear_io_accessed_regions)
+
+// The IO accessed pages are not a part of the state returned by tlib_export_state. They are saved as regions
+// of consecutive pages and restored with tlib_clear_io_accessed_regions followed by tlib_set_range_io_accessed
+// for each region, with the size of 'end' - 'start' + the page size.
+uint32_t tlib_get_io_accessed_regions_count()
+{
+    return env->io_access_regions_count;
+}
+
+EXC_INT_0(uint32_t, tlib_get_io_accessed_regions_count)
+
+static IoAccessRegion *get_io_accessed_region(uint32_t index)
+{
+    if (index >= env->io_access_regions_count) {
+        tlib_abortf("Invalid IO accessed region: %" PRIu32 ", there are %" PRIu32, index, env->io_access_regions_count);
     }
-    env->io_access_regions[j] = 0;
+    return &env->io_access_regions[index];
+}
 
-    env->io_access_regions_count--;
-    tlb_flush_page(env, address, false);
+// The address of the first page of the region
+uint64_t tlib_get_io_accessed_region_start(uint32_t index)
+{
+    return get_io_accessed_region(index)->start;
 }
 
-EXC_VOID_1(tlib_clear_page_io_accessed, uint64_t, address)
+EXC_INT_1(uint64_t, tlib_get_io_accessed_region_start, uint32_t, index)
+
+// The address of the last page of the region
+uint64_t tlib_get_io_accessed_region_end(uint32_t index)
+{
+    return get_io_accessed_region(index)->end;
+}
+
+EXC_INT_1(uint64_t, tlib_get_io_accessed_region_end, uint32_t, index)
 
 #define ASSERT_EXTERNAL_MMU_ENABLED                                                                                \
 if(!cpu->external_mmu_enabled)                                                                                     \
@@ -811,6 +1054,7 @@ void tlib_reset_mmu_window(uint32_t index)
     ASSERT_WINDOW_IN_RANGE(index)
     ExtMmuRange *mmu_array = cpu->external_mmu_window;
     memset((void *)(mmu_array + index), 0, sizeof(ExtMmuRange));
+    cpu->external_mmu_index_valid = false;
 }
 EXC_VOID_1(tlib_reset_mmu_window, uint32_t, index)
 
@@ -821,6 +1065,7 @@ int32_t tlib_acquire_mmu_window(uint32_t type)
         if (!cpu->external_mmu_window[window_index].active) {
             cpu->external_mmu_window[window_index].active = true;
             cpu->external_mmu_window[window_index].type = (uint8_t)type;
+            cpu->external_mmu_index_valid = false;
             return window_index;
         }
     }
@@ -838,6 +1083,7 @@ void tlib_set_mmu_window_start(uint32_t index, uint64_t addr_start)
     ASSERT_NO_OVERLAP(addr_start, cpu->external_mmu_window[index].type)
 #endif
     cpu->external_mmu_window[index].range_start = addr_start;
+    cpu->external_mmu_index_valid = false;
 }
 EXC_VOID_2(tlib_set_mmu_window_start, uint32_t, index, uint64_t, addr_start)
 
@@ -850,6 +1096,7 @@ void tlib_set_mmu_window_end(uint32_t index, uint64_t addr_end)
     ASSERT_NO_OVERLAP(addr_end, cpu->external_mmu_window[index].type)
 #endif
     cpu->external_mmu_window[index].range_end = addr_end;
+    cpu->external_mmu_index_valid = false;
 }
 EXC_VOID_2(tlib_set_mmu_window_end, uint32_t, index, uint64_t, addr_end)
 
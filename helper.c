@@ -51,12 +51,21 @@ void HELPER(invalidate_dirty_addresses_shared)(CPUState *env)
     }
 }
 
-// verify if there are instructions left to execute, update instructions count
-// and trim the block and exit to the main loop if necessary
+// slow path of the block header, taken when `exit_request` is set or the block does not fit in `instructions_budget`;
+// verify if there are instructions left to execute, trim the block and exit to the main loop if necessary
 uint32_t HELPER(prepare_block_for_execution)(void *tb)
 {
     cpu->current_tb = (TranslationBlock *)tb;
 
+    // the header has taken the block off the budget, give it back so that the counters derived from it are right
+    cpu->instructions_budget += cpu->current_tb->icount;
+    cpu_sync_instructions_count(cpu);
+
+    if (unlikely(cpu->current_tb->exec_count == 0 && superblock_threshold != 0 && !cpu->tb_cache_disabled)) {
+        // the block is retranslated as a superblock the next time it is entered from the main loop
+        tb_mark_hot(cpu->current_tb);
+    }
+
     if (cpu->exit_request != 0) {
         return cpu->exit_request;
     }
@@ -66,14 +75,43 @@ uint32_t HELPER(prepare_block_for_execution)(void *tb)
     if (instructions_left == 0) {
         // setting `tb_restart_request` to 1 will stop executing this block at the end of the header
         cpu->tb_restart_request = 1;
-    } else if (cpu->current_tb->icount > instructions_left || cpu->current_tb->dirty_flag) {
-        // invalidate this block and jump back to the main loop
-        tb_phys_invalidate(cpu->current_tb, -1);
+    } else if (cpu->current_tb->icount > instructions_left) {
+        // jump back to the main loop, `tb_find_fast` picks a variant of this block that fits
         cpu->tb_restart_request = 1;
+    } else {
+        // the budget was stale, the block can be executed
+        cpu->instructions_budget = instructions_left - cpu->current_tb->icount;
     }
     return cpu->tb_restart_request;
 }
 
+// look up the TB for the current CPU state in `tb_jmp_cache`; returns its code, or the epilogue of the prologue
+// if the main loop has to find or translate the block
+void *HELPER(lookup_tb_ptr)(CPUState *env)
+{
+    TranslationBlock *tb;
+    target_ulong cs_base, pc;
+    int flags;
+
+    // pending interrupts are handled by the main loop, the jump might have unmasked them
+    if (unlikely(env->chaining_disabled || env->tb_cache_disabled || env->interrupt_request)) {
+        return tcg->ctx->code_gen_epilogue;
+    }
+    // the helpers raising exceptions, suspending the cpu or reporting external MMU faults
+    // only set the state and rely on the block returning to the main loop
+    if (unlikely(env->exception_index != -1 || env->wfi || env->mmu_fault || env->exit_request || env->tb_restart_request)) {
+        return tcg->ctx->code_gen_epilogue;
+    }
+
+    cpu_get_tb_cpu_state(env, &pc, &cs_base, &flags);
+    tb = env->tb_jmp_cache[tb_jmp_cache_hash_func(pc)];
+    // a hot block is left for `tb_find_fast` to retranslate
+    if (unlikely(!tb || tb->pc != pc || tb->cs_base != cs_base || tb->flags != flags || tb->hot)) {
+        return tcg->ctx->code_gen_epilogue;
+    }
+    return tb->tc_ptr;
+}
+
 uint32_t HELPER(block_begin_event)()
 {
     uint32_t result = tlib_on_block_begin(cpu->current_tb->pc, cpu->current_tb->icount);
@@ -162,3 +200,8 @@ void HELPER(tlb_flush)(CPUState* env)
 {
      tlb_flush(env, 1, true);
 }
+
+void HELPER(mem_trace_flush)(CPUState *env)
+{
+    mem_trace_flush(env);
+}
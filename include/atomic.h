@@ -10,6 +10,10 @@
 #define NO_CPU_ID          0xFFFFFFFF
 #define NO_RESERVATION     -1
 
+// the reservations are indexed by a hash of their granule, see register_address_access
+#define RESERVATION_FILTER_BITS 6
+#define RESERVATION_FILTER_SIZE (1 << RESERVATION_FILTER_BITS)
+
 struct CPUState;
 
 typedef struct address_reservation_t
@@ -21,6 +25,7 @@ typedef struct address_reservation_t
     uint8_t manual_free;
 } address_reservation_t;
 
+// allocated by the host, shared by all the cpus; its size is given by tlib_get_atomic_memory_state_size
 typedef struct atomic_memory_state_t
 {
     uint8_t is_mutex_initialized;
@@ -35,6 +40,11 @@ typedef struct atomic_memory_state_t
     int reservations_by_cpu[MAX_NUMBER_OF_CPUS];
     address_reservation_t reservations[MAX_NUMBER_OF_CPUS];
 
+    // log2 of the size of the memory block a reservation covers for the accesses of the other cpus
+    uint8_t reservation_granule_bits;
+    // for each hash of a granule, the mask of the cpus that hold a reservation in it
+    uint32_t reservation_filter[RESERVATION_FILTER_SIZE];
+
     pthread_mutex_t global_mutex;
     pthread_cond_t global_cond;
 
@@ -50,6 +60,7 @@ void reserve_address(struct CPUState *env, target_phys_addr_t address);
 uint32_t check_address_reservation(struct CPUState *env, target_phys_addr_t address);
 void register_address_access(struct CPUState *env, target_phys_addr_t address);
 void cancel_reservation(struct CPUState *env);
+void set_reservation_granule(struct CPUState *env, uint32_t size);
 
 // Functions with the _always suffix, will run no matter the amount of registered CPU cores
 void reserve_address_always(struct CPUState *env, target_phys_addr_t address);
@@ -94,7 +94,25 @@ void tlib_on_interrupt_begin(uint64_t exception_index);
 void tlib_on_interrupt_end(uint64_t exception_index);
 void tlib_profiler_announce_stack_change(uint64_t current_address, uint64_t current_return_address, uint64_t current_instructions_count, int32_t is_frame_add);
 void tlib_profiler_announce_context_change(uint64_t context_id);
+/* the operations reported by tlib_on_memory_access */
+#define MEMORY_IO_READ  0
+#define MEMORY_IO_WRITE 1
+#define MEMORY_READ     2
+#define MEMORY_WRITE    3
+#define INSN_FETCH      4
+
+/* a memory access as recorded in the trace buffer, see tlib_on_memory_access_batch;
+   the accesses of the generated code are recorded before they are made, so an access
+   that faults and is retried after the exception is handled is reported twice */
+typedef struct MemoryAccessTraceEntry {
+    uint64_t pc;
+    uint64_t address;
+    uint32_t size;
+    uint32_t operation;
+} MemoryAccessTraceEntry;
+
 void tlib_on_memory_access(uint64_t pc, uint32_t operation, uint64_t addr);
+void tlib_on_memory_access_batch(void *entries, uint32_t count);
 void tlib_on_memory_access_event_enabled(int32_t value);
 void tlib_mass_broadcast_dirty(void* list_start, int size);
 void *tlib_get_dirty_addresses_list(void *size);
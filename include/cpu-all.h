@@ -673,6 +673,23 @@ extern uintptr_t translation_cache_size;
 /* Set if TLB entry is an IO callback.  */
 #define TLB_MMIO          (1 << 5)
 
+/* The number of entries of each MMU mode's TLB changes on full flushes, so
+   an index is only valid until the next tlb_flush or tlb_fill. */
+static inline uintptr_t tlb_n_entries(CPUState *env, int mmu_idx)
+{
+    return (env->tlb_desc[mmu_idx].mask >> CPU_TLB_ENTRY_BITS) + 1;
+}
+
+static inline uintptr_t tlb_index(CPUState *env, int mmu_idx, target_ulong addr)
+{
+    return (addr >> TARGET_PAGE_BITS) & (env->tlb_desc[mmu_idx].mask >> CPU_TLB_ENTRY_BITS);
+}
+
+static inline CPUTLBEntry *tlb_entry(CPUState *env, int mmu_idx, target_ulong addr)
+{
+    return &env->tlb_desc[mmu_idx].table[tlb_index(env, mmu_idx, addr)];
+}
+
 bool is_interrupt_pending(CPUState *env, int mask);
 void clear_interrupt_pending(CPUState *env, int mask);
 void set_interrupt_pending(CPUState *env, int mask);
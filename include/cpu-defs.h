@@ -39,6 +39,35 @@
 # define GETPC() ((void *)((uintptr_t)__builtin_return_address(0) - 1))
 #endif
 
+/* The TLB-miss paths of qemu_ld/st ops are emitted after the body of the TB,
+   far from the guest instruction that made the access. Right after the helper
+   call such a slow path embeds a jump that is never executed, but which
+   targets the end of the fast path of the access:
+
+     call helper
+     jmp 1f            <- return address
+     jmp fast_path_end
+   1:
+
+   GETPC_LDST decodes it to give the same host pc as GETPC would if the helper
+   were called inline. Only the helpers called from these slow paths may use it. */
+#if defined(__arm__)
+static inline uintptr_t tcg_ldst_fast_path_end(uintptr_t retaddr)
+{
+    uintptr_t branch = retaddr + 4;
+    int32_t offset = (int32_t)(*(uint32_t *)branch << 8) >> 6;
+
+    return branch + 8 + offset;
+}
+#else
+static inline uintptr_t tcg_ldst_fast_path_end(uintptr_t retaddr)
+{
+    /* a 2-byte short jmp, then the opcode of a jmp with a 32-bit displacement */
+    return retaddr + 7 + *(int32_t *)(retaddr + 3);
+}
+#endif
+#define GETPC_LDST() ((void *)(tcg_ldst_fast_path_end((uintptr_t)__builtin_return_address(0)) - 1))
+
 #ifndef TARGET_LONG_BITS
 #error TARGET_LONG_BITS must be defined before including this header
 #endif
@@ -100,8 +129,19 @@ typedef struct DisasContextBase {
 #define TB_JMP_ADDR_MASK   (TB_JMP_PAGE_SIZE - 1)
 #define TB_JMP_PAGE_MASK   (TB_JMP_CACHE_SIZE - TB_JMP_PAGE_SIZE)
 
-#define CPU_TLB_BITS       8
-#define CPU_TLB_SIZE       (1 << CPU_TLB_BITS)
+#if TB_JMP_CACHE_BITS - TB_JMP_PAGE_BITS > 6
+#error tb_jmp_cache_dirty_pages has a bit per TB_JMP_PAGE_SIZE entries of tb_jmp_cache
+#endif
+
+/* default bounds, in bits, of the number of entries of the TLB of each MMU mode,
+   see tlb_resize_and_flush */
+#define CPU_TLB_DYN_MIN_BITS     6
+#define CPU_TLB_DYN_DEFAULT_BITS 8
+#define CPU_TLB_DYN_MAX_BITS     16
+/* number of full flushes over which the use of a TLB is observed before it shrinks */
+#define CPU_TLB_DYN_WINDOW_FLUSHES 32
+/* size of the fully associative victim TLB of each MMU mode */
+#define CPU_VTLB_SIZE      8
 
 #if HOST_LONG_BITS == 32 && TARGET_LONG_BITS == 32
 #define CPU_TLB_ENTRY_BITS 4
@@ -129,12 +169,82 @@ typedef struct CPUTLBEntry {
 
 extern int CPUTLBEntry_wrong_size[sizeof(CPUTLBEntry) == (1 << CPU_TLB_ENTRY_BITS) ? 1 : -1];
 
+/* number of entries of the page-table walk cache, see ptw_cache_lookup */
+#define CPU_PTW_CACHE_BITS 6
+#define CPU_PTW_CACHE_SIZE (1 << CPU_PTW_CACHE_BITS)
+
+typedef struct PageTableWalkCacheEntry {
+    uint64_t root;
+    uint64_t prefix;
+    uint64_t table;
+    uint32_t walk;
+    uint8_t level;
+    bool valid;
+} PageTableWalkCacheEntry;
+
+/* number of areas mapped with large pages tracked in each MMU mode, see tlb_add_large_page */
+#define CPU_TLB_LARGE_PAGES 16
+
+typedef struct CPUTLBLargePage {
+    target_ulong addr;
+    target_ulong mask;
+} CPUTLBLargePage;
+
+/* number of checked regions kept for a TLB_ONE_SHOT entry, see tlb_set_subpage */
+#define CPU_TLB_SUBPAGES 4
+
+/* The parts of a TLB_ONE_SHOT page the target already checked the accesses to.
+   An access that lies in one of them, with its type allowed by the region's
+   PAGE_* bits, uses the entry without going through tlb_fill again. */
+typedef struct CPUTLBSubpages {
+    struct {
+        /* offsets of the first and the last byte of the region in the page */
+        uint16_t start;
+        uint16_t end;
+        uint8_t prot;
+    } regions[CPU_TLB_SUBPAGES];
+    uint8_t count;
+    /* the region replaced by the next one once all of them are used */
+    uint8_t next;
+} CPUTLBSubpages;
+
+/* The TLB of a single MMU mode. The tables are allocated by cpu_exec_init
+   and resized on full flushes, see tlb_resize_and_flush. */
+typedef struct CPUTLBDesc {
+    /* (number of entries - 1) << CPU_TLB_ENTRY_BITS; `mask` and `table` are
+       read by the TCG-generated fast path, see tcg_out_tlb_load */
+    uintptr_t mask;
+    CPUTLBEntry *table;
+    target_phys_addr_t *iotlb;
+    /* only meaningful for the TLB_ONE_SHOT entries of `table` */
+    CPUTLBSubpages *subpages;
+    /* valid entries of `table` */
+    uint32_t n_used_entries;
+    /* the most entries used between two full flushes of the current window */
+    uint32_t window_max_entries;
+    uint32_t window_flushes;
+    /* the areas the entries of `table` map with pages larger than TARGET_PAGE_SIZE */
+    CPUTLBLargePage large_pages[CPU_TLB_LARGE_PAGES];
+    uint32_t n_large_pages;
+} CPUTLBDesc;
+
 #define CPU_COMMON_TLB \
     /* The meaning of the MMU modes is defined in the target code. */   \
-    CPUTLBEntry tlb_table[NB_MMU_MODES][CPU_TLB_SIZE];                  \
-    target_phys_addr_t iotlb[NB_MMU_MODES][CPU_TLB_SIZE];               \
-    target_ulong tlb_flush_addr;                                        \
-    target_ulong tlb_flush_mask;
+    CPUTLBDesc tlb_desc[NB_MMU_MODES];                                  \
+    /* valid entries evicted from tlb_desc, see victim_tlb_hit */       \
+    CPUTLBEntry tlb_v_table[NB_MMU_MODES][CPU_VTLB_SIZE];               \
+    target_phys_addr_t iotlb_v[NB_MMU_MODES][CPU_VTLB_SIZE];            \
+    CPUTLBSubpages subpages_v[NB_MMU_MODES][CPU_VTLB_SIZE];             \
+    unsigned int vtlb_index;                                            \
+    /* bit N is set while the TLB of MMU mode N may hold entries */     \
+    uint32_t tlb_dirty_modes;                                           \
+    /* the ASID the TLB entries were filled under, see tlb_set_asid */  \
+    uint32_t tlb_asid;                                                  \
+    bool tlb_asid_mixed;                                                \
+    /* the tables guest page-table walks went through, dropped with    \
+       the TLB */                                                       \
+    PageTableWalkCacheEntry ptw_cache[CPU_PTW_CACHE_SIZE];              \
+    bool ptw_cache_used;
 
 typedef struct CPUBreakpoint {
     target_ulong pc;
@@ -160,7 +270,22 @@ typedef struct ExtMmuRange
     bool active;
 } ExtMmuRange;
 
-#define MAX_IO_ACCESS_REGIONS_COUNT 1024
+/* The windows of one access type as consecutive segments of the address space,
+   see get_external_mmu_phys_addr */
+typedef struct ExtMmuIndex {
+    /* segment N starts at starts[N] and ends where segment N + 1 starts */
+    target_ulong starts[MAX_EXTERNAL_MMU_RANGES * 2 + 1];
+    /* the window the accesses to segment N go through, -1 for none */
+    int16_t windows[MAX_EXTERNAL_MMU_RANGES * 2 + 1];
+    uint32_t count;
+} ExtMmuIndex;
+
+/* pages accessed through the IO callbacks, see io_access_regions_add */
+typedef struct IoAccessRegion {
+    /* the addresses of the first and the last page */
+    target_ulong start;
+    target_ulong end;
+} IoAccessRegion;
 
 #define CPU_TEMP_BUF_NLONGS 128
 #define cpu_common_first_field instructions_count_limit
@@ -170,8 +295,8 @@ typedef struct ExtMmuRange
     /* --------------------------------------- */                             \
     /* instruction counting is used to execute callback after given \
        number of instructions */                                              \
-    /* the types of instructions_count_* need to match the TCG-generated      \
-       accesses in `gen_update_instructions_count` in translate-all.c */      \
+    /* they fall behind the generated code while it runs, see                 \
+       cpu_sync_instructions_count */                                         \
     uint32_t instructions_count_limit;                                        \
     uint32_t instructions_count_value;                                        \
     uint64_t instructions_count_total_value;                                  \
@@ -185,13 +310,16 @@ typedef struct ExtMmuRange
                                      memory was accessed */                   \
     uint32_t wfi;              /* Nonzero if the CPU is in suspend state */   \
     uint32_t interrupt_request;                                               \
+    /* the types of exit_request and instructions_budget need to match the    \
+       TCG-generated accesses in `gen_block_header` in translate-all.c */     \
     volatile sig_atomic_t exit_request;                                       \
+    /* counts down from `instructions_count_limit -                           \
+       instructions_count_value` as blocks are entered, the counters are      \
+       derived from it */                                                     \
+    uint32_t instructions_budget;                                             \
     int tb_restart_request;                                                   \
     int tb_interrupt_request_from_callback;                                   \
                                                                               \
-    uint32_t io_access_regions_count;                                         \
-    uint32_t io_access_regions[MAX_IO_ACCESS_REGIONS_COUNT];                  \
-                                                                              \
     /* --------------------------------------- */                             \
     /* from this point: preserved by CPU reset */                             \
     /* --------------------------------------- */                             \
@@ -233,8 +361,33 @@ typedef struct ExtMmuRange
     atomic_memory_state_t* atomic_memory_state;                               \
     /* STARTING FROM HERE FIELDS ARE NOT SERIALIZED */                        \
     struct TranslationBlock *current_tb; /* currently executing TB  */        \
+    /* the block whose instructions past the restored state were taken off    \
+       the counters, until the main loop is reentered; see                    \
+       cpu_restore_state_and_restore_instructions_count */                    \
+    struct TranslationBlock *instructions_count_restored_tb;                  \
     CPU_COMMON_TLB                                                            \
+    /* external_mmu_window by access type, rebuilt by the first lookup after  \
+       the windows change; starts invalid, so a restored CPU rebuilds it */   \
+    ExtMmuIndex external_mmu_index[3];                                        \
+    bool external_mmu_index_valid;                                            \
     struct TranslationBlock *tb_jmp_cache[TB_JMP_CACHE_SIZE];                 \
+    /* bit N is set while the Nth TB_JMP_PAGE_SIZE entries of tb_jmp_cache    \
+       may hold blocks, see tb_jmp_cache_set */                               \
+    uint64_t tb_jmp_cache_dirty_pages;                                        \
+    /* the memory accesses traced since the last `mem_trace_flush`; the       \
+       generated code appends them at `mem_trace_next` with no bounds check,  \
+       the block header flushes it once it passes `mem_trace_limit` */        \
+    struct MemoryAccessTraceEntry *mem_trace_buffer;                          \
+    struct MemoryAccessTraceEntry *mem_trace_next;                            \
+    struct MemoryAccessTraceEntry *mem_trace_limit;                           \
+    uint32_t mem_trace_capacity;                                              \
+    /* sorted, disjoint and not adjacent */                                   \
+    IoAccessRegion *io_access_regions;                                        \
+    uint32_t io_access_regions_count;                                         \
+    uint32_t io_access_regions_capacity;                                      \
+    /* the allow_unaligned_accesses the cached code was generated for, the    \
+       serialized flag can change on a state import without a tb_flush */     \
+    int tb_allow_unaligned_accesses;                                          \
     /* buffer for temporaries in the code generator */                        \
     long temp_buf[CPU_TEMP_BUF_NLONGS];                                       \
     /* when set any exception will force `cpu_exec` to finish immediately */  \
@@ -21,7 +21,7 @@ void check_locked(struct TranslationBlock *tb);
 
 #if DEBUG
 #define LOCK_TB(tb)      mark_as_locked(tb, __FILE__, __LINE__);
-#define UNLOCK_TB(tb)    tb->lock_active = 0
+#define UNLOCK_TB(tb)    tb_cold(tb)->lock_active = 0
 #define CHECK_LOCKED(tb) check_locked(tb)
 #else
 #define LOCK_TB(tb)
@@ -59,7 +59,11 @@ int tlb_fill(CPUState *env1, target_ulong addr, int is_write, int mmu_idx, void
 
 // All the other functions declared in this header are common for all architectures.
 void gen_exit_tb(TranslationBlock *, int);
+void gen_chained_exit_tb(TranslationBlock *, int, target_ulong);
 void gen_exit_tb_no_chaining(TranslationBlock *);
+void gen_lookup_and_goto_ptr(TranslationBlock *);
+void gen_superblock_side_exit(TranslationBlock *);
+uint32_t tb_execution_count(TranslationBlock *, target_ulong);
 CPUBreakpoint *process_breakpoints(CPUState *env, target_ulong pc);
 
 void cpu_gen_code(CPUState *env, struct TranslationBlock *tb, int *gen_code_size_ptr, int *search_size_ptr);
@@ -67,6 +71,10 @@ int cpu_restore_state_from_tb(CPUState *env, struct TranslationBlock *tb, uintpt
 void cpu_restore_state(CPUState *env, void *retaddr);
 int cpu_restore_state_and_restore_instructions_count(CPUState *env, struct TranslationBlock *tb, uintptr_t searched_pc);
 TranslationBlock *tb_gen_code(CPUState *env, target_ulong pc, target_ulong cs_base, int flags, uint16_t cflags);
+
+/* also translate the blocks the direct jumps of the new blocks lead to */
+#define PRETRANSLATE_FOLLOW_JUMPS 0x1
+uint64_t tb_pretranslate_range(CPUState *env, target_ulong start, target_ulong end, uint32_t options, uint64_t *bytes);
 void cpu_exec_init(CPUState *env);
 void cpu_exec_init_all();
 void TLIB_NORETURN cpu_loop_exit_without_hook(CPUState *env1);
@@ -78,72 +86,129 @@ void tlb_flush_masked(CPUState *env, uint32_t mmu_indexes_mask);
 void tlb_flush_page(CPUState *env, target_ulong addr, bool from_generated_code);
 void tlb_flush_page_masked(CPUState *env, target_ulong addr, uint32_t mmu_indexes_mask, bool from_generated_code);
 void tlb_set_page(CPUState *env, target_ulong vaddr, target_phys_addr_t paddr, int prot, int mmu_idx, target_ulong size);
+void tlb_set_subpage(CPUState *env, target_ulong vaddr, target_phys_addr_t paddr, int prot, int mmu_idx, target_ulong sub_vaddr,
+                     target_ulong sub_size, int sub_prot);
+bool tlb_one_shot_needs_fill(CPUState *env, int mmu_idx, int index, target_ulong addr, int size, int access_type);
+bool ptw_cache_lookup(CPUState *env, uint64_t root, uint32_t walk, int level, uint64_t prefix, uint64_t *table);
+void ptw_cache_insert(CPUState *env, uint64_t root, uint32_t walk, int level, uint64_t prefix, uint64_t table);
+void io_access_regions_add(CPUState *env, target_ulong start, target_ulong end);
+void io_access_regions_remove(CPUState *env, target_ulong start, target_ulong end);
+void io_access_regions_clear(CPUState *env);
+void io_access_regions_free(CPUState *env);
+bool victim_tlb_hit(CPUState *env, int mmu_idx, int index, int access_type, target_ulong page);
+void tlb_init(CPUState *env);
+void tlb_free(CPUState *env);
+void tlb_set_size_bounds(CPUState *env, unsigned int min_bits, unsigned int max_bits);
+void tlb_set_asid(CPUState *env, uint32_t asid);
+void tlb_flush_asid(CPUState *env, uint32_t asid, bool from_generated_code);
+void tlb_flush_asid_masked(CPUState *env, uint32_t asid, uint32_t mmu_indexes_mask);
+/* the entries of the memory access trace buffer unless the host sets another capacity */
+#define MEM_TRACE_DEFAULT_CAPACITY (16 * 1024)
+
+void mem_trace_set_capacity(CPUState *env, uint32_t capacity);
+void mem_trace_prepare(CPUState *env);
+void mem_trace_free(CPUState *env);
+void mem_trace_flush(CPUState *env);
+void mem_trace_record(CPUState *env, uint32_t operation, target_ulong addr, uint32_t size, bool from_generated_code);
 void interrupt_current_translation_block(CPUState *env, int exception_type);
 int get_external_mmu_phys_addr(CPUState *env, uint32_t address, int access_type,
                                                               target_phys_addr_t *phys_ptr, int *prot, int no_page_fault);
 
 #define CODE_GEN_ALIGN           16 /* must be >= of the size of a icache line */
 
-#define CODE_GEN_PHYS_HASH_BITS  15
-#define CODE_GEN_PHYS_HASH_SIZE  (1 << CODE_GEN_PHYS_HASH_BITS)
+/* initial number of slots of the physical TB hash table, it grows with the number of TBs */
+#define CODE_GEN_PHYS_HASH_MIN_BITS 12
 
 #define MIN_CODE_GEN_BUFFER_SIZE (1024 * 1024)
 
+/* the translation cache is recycled one region at a time, every region
+   fits at least CODE_GEN_MIN_REGION_BLOCKS blocks of the maximum size */
+#define CODE_GEN_MAX_REGIONS       16
+#define CODE_GEN_MIN_REGION_BLOCKS 4
+
 /* estimated block size for TB allocation */
 /* XXX: use a per code average code fragment size and modulate it
    according to the host CPU */
 #define CODE_GEN_AVG_BLOCK_SIZE  128
 
+/* the lookup fields of a TB take a single host cache line */
+#define TB_ALIGN 64
+
 extern uint32_t maximum_block_size;
+extern uint32_t superblock_threshold;
+extern uint32_t superblock_optimizer_enabled;
 
+/* The fields needed to find a TB and to run its code, one cache line per TB. The
+   rest of the TB lives in the parallel `tbs_cold` array, see tb_cold. */
 struct TranslationBlock {
     target_ulong pc;      /* simulated PC corresponding to this block (EIP + CS base) */
     target_ulong cs_base; /* CS base for this block */
     uint64_t flags;       /* flags defining in which context the code was generated */
-    uint32_t disas_flags;
-    bool dirty_flag;      /* invalidation after write to an address from this block */
+    uint8_t *tc_ptr;      /* pointer to the translated code */
+    /* first and second physical page containing code */
+    tb_page_addr_t page_addr[2];
+    // the type of this field needs to match the TCG-generated access in `gen_block_header` in translate-all.c
+    uint32_t icount;
+    // counts the executions down from `superblock_threshold`, only if it is set; see `gen_block_header` in translate-all.c
+    uint32_t exec_count;
     uint16_t size;        /* size of target code for this block (1 <=
                              size <= TARGET_PAGE_SIZE) */
     uint16_t cflags;      /* compile flags */
 
-#define CF_COUNT_MASK 0x7fff
+#define CF_COUNT_MASK 0x7fff /* Instruction limit of a block cut to fit the quantum, 0 for full blocks */
+#define CF_SUPERBLOCK    0x8000 /* Second tier translation of a hot block */
 #define CF_USE_ICOUNT    0x00020000
 #define CF_PARALLEL      0x00080000 /* Generate code for a parallel context */
 
-    uint8_t *tc_ptr;      /* pointer to the translated code */
+    bool invalid;         /* set by tb_phys_invalidate, the TB is not reachable anymore */
+    // set when `exec_count` reaches zero, the main loop replaces the block with a superblock
+    bool hot;
+} __attribute__((aligned(TB_ALIGN)));
+
+typedef struct TranslationBlockCold {
+    uint32_t disas_flags;
+    bool was_cut;
+    // this field is used to keep track of the previous value of size, i.e., it shows the size of translation block without the last instruction; used by a blockend hook
+    uint16_t prev_size;
     uint8_t *tc_search;   /* pointer to search data */
-    /* next matching tb for physical address. */
-    struct TranslationBlock *phys_hash_next;
-    /* first and second physical page containing code. The lower bit
-       of the pointer tells the index in page_next[] */
+    /* TBs on the same physical page. The lower bit of the pointer
+       tells the index in page_next[] */
     struct TranslationBlock *page_next[2];
-    tb_page_addr_t page_addr[2];
 
     /* the following data are used to directly call another TB from
        the code of this one. */
     uint16_t tb_next_offset[2]; /* offset of original jump target */
     uint16_t tb_jmp_offset[2];  /* offset of jump instruction */
+    target_ulong jmp_target_pc[2]; /* guest pc the direct jumps lead to, -1 if not known */
     /* list of TBs jumping to this one. This is a circular list using
        the two least significant bits of the pointers to tell what is
        the next pointer: 0 = jmp_next[0], 1 = jmp_next[1], 2 =
        jmp_first */
     struct TranslationBlock *jmp_next[2];
     struct TranslationBlock *jmp_first;
-    // the type of this field needs to match the TCG-generated access in `gen_update_instructions_count` in translate-all.c
-    uint32_t icount;
-    bool was_cut;
-    // this field is used to keep track of the previous value of size, i.e., it shows the size of translation block without the last instruction; used by a blockend hook
-    uint16_t prev_size;
-    // signals that the `icount` of this tb has been added to global instructions counters
-    // in case of exiting this tb before the end (e.g., in case of an exception, watchpoint etc.) the value of counters must be rebuilt
-    // the type of this field needs to match the TCG-generated access in `gen_update_instructions_count` in translate-all.c
-    uint32_t instructions_count_dirty;
+    /* TBs spanning two pages that are the target of direct jumps are kept on
+       a list, so that these jumps can be reset when the second page is remapped */
+    bool cross_page_chained;
+    QLIST_ENTRY(TranslationBlockCold) cross_page_entry;
 #if DEBUG
     uint32_t lock_active;
     char *lock_file;
     int lock_line;
 #endif
-};
+} TranslationBlockCold;
+
+extern TranslationBlock *tbs;
+extern TranslationBlockCold *tbs_cold;
+
+static inline TranslationBlockCold *tb_cold(TranslationBlock *tb)
+{
+    return &tbs_cold[tb - tbs];
+}
+
+static inline TranslationBlock *tb_from_cold(TranslationBlockCold *cold)
+{
+    return &tbs[cold - tbs_cold];
+}
 
 static inline unsigned int tb_jmp_cache_hash_page(target_ulong pc)
 {
@@ -159,9 +224,29 @@ static inline unsigned int tb_jmp_cache_hash_func(target_ulong pc)
     return (((tmp >> (TARGET_PAGE_BITS - TB_JMP_PAGE_BITS)) & TB_JMP_PAGE_MASK) | (tmp & TB_JMP_ADDR_MASK));
 }
 
-static inline unsigned int tb_phys_hash_func(tb_page_addr_t pc)
+/* the bitmap lets flushes skip the parts of the cache that hold no blocks */
+static inline void tb_jmp_cache_set(CPUState *env, target_ulong pc, TranslationBlock *tb)
+{
+    unsigned int h = tb_jmp_cache_hash_func(pc);
+
+    env->tb_jmp_cache[h] = tb;
+    env->tb_jmp_cache_dirty_pages |= 1ull << (h >> TB_JMP_PAGE_BITS);
+}
+
+/* 'cflags' tells the full block from its variants cut at the end of a quantum */
+static inline uint32_t tb_phys_hash_func(tb_page_addr_t phys_pc, uint64_t flags, target_ulong cs_base, uint16_t cflags)
 {
-    return (pc >> 2) & (CODE_GEN_PHYS_HASH_SIZE - 1);
+    uint64_t h;
+
+    h = (uint64_t)phys_pc ^ (flags * 0x9e3779b97f4a7c15ULL) ^ ((uint64_t)cs_base * 0xc2b2ae3d27d4eb4fULL) ^
+        ((uint64_t)(cflags & CF_COUNT_MASK) << 48);
+    /* mix the bits so that the low ones can be used as the table index */
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return (uint32_t)h;
 }
 
 void tb_free(TranslationBlock *tb);
@@ -169,7 +254,19 @@ void tb_flush(CPUState *env);
 void tb_link_page(TranslationBlock *tb, tb_page_addr_t phys_pc, tb_page_addr_t phys_page2);
 void tb_phys_invalidate(TranslationBlock *tb, tb_page_addr_t page_addr);
 
-extern TranslationBlock *tb_phys_hash[CODE_GEN_PHYS_HASH_SIZE];
+TranslationBlock *tb_phys_hash_lookup(CPUState *env, target_ulong pc, tb_page_addr_t phys_pc, target_ulong cs_base, uint64_t flags,
+                                      uint16_t cflags);
+
+typedef struct TBPhysHashStatistics {
+    uint64_t lookups;
+    /* number of slots visited by all the lookups */
+    uint64_t probes;
+    uint32_t max_probe_length;
+    uint32_t entries;
+    uint32_t capacity;
+} TBPhysHashStatistics;
+
+extern TBPhysHashStatistics tb_phys_hash_statistics;
 
 #if defined(__i386__) || defined(__x86_64__)
 static inline void tb_set_jmp_target1(uintptr_t jmp_addr, uintptr_t addr)
@@ -209,29 +306,50 @@ static inline void tb_set_jmp_target(TranslationBlock *tb, int n, uintptr_t addr
 {
     uintptr_t offset;
 
-    offset = tb->tb_jmp_offset[n];
+    offset = tb_cold(tb)->tb_jmp_offset[n];
     tb_set_jmp_target1((uintptr_t)(tb->tc_ptr + offset), addr);
 }
 
 static inline void tb_add_jump(TranslationBlock *tb, int n, TranslationBlock *tb_next)
 {
+    TranslationBlockCold *cold, *next_cold;
+
     tlib_assert(tb != NULL);
 
+    cold = tb_cold(tb);
     /* NOTE: this test is only needed for thread safety */
-    if (!tb->jmp_next[n]) {
+    if (!cold->jmp_next[n]) {
         /* patch the native jump address */
         tb_set_jmp_target(tb, n, (uintptr_t)tb_next->tc_ptr);
 
         /* add in TB jmp circular list */
-        tb->jmp_next[n] = tb_next->jmp_first;
-        tb_next->jmp_first = (TranslationBlock *)((uintptr_t)(tb) | (n));
+        next_cold = tb_cold(tb_next);
+        cold->jmp_next[n] = next_cold->jmp_first;
+        next_cold->jmp_first = (TranslationBlock *)((uintptr_t)(tb) | (n));
     }
 }
 
 TranslationBlock *tb_find_pc(uintptr_t pc_ptr);
+void tb_mark_cross_page_chained(TranslationBlock *tb);
+void tb_mark_hot(TranslationBlock *tb);
 
 extern int tb_invalidated_flag;
 
+/* the budget checked by the generated block header must follow any change of the instruction counters */
+static inline void cpu_sync_instructions_budget(CPUState *env)
+{
+    env->instructions_budget = env->instructions_count_limit - env->instructions_count_value;
+}
+
+/* The generated block header only counts the instructions down in `instructions_budget`, the counters fall behind
+   while the code runs. They are brought up to date when the code returns to the main loop, in the slow path of the
+   header and before they are read or changed by the helpers and the exports. */
+static inline void cpu_sync_instructions_count(CPUState *env)
+{
+    uint32_t executed = env->instructions_count_limit - env->instructions_count_value - env->instructions_budget;
+    env->instructions_count_value += executed;
+    env->instructions_count_total_value += executed;
+}
 
 void mark_tbs_containing_pc_as_dirty(target_ulong addr, int access_width, int broadcast);
 void flush_dirty_addresses_list(void);
@@ -268,23 +386,25 @@ static inline tb_page_addr_t get_page_addr_code(CPUState *env1, target_ulong add
     ram_addr_t pd;
     void *p;
 
-    page_index = (addr >> TARGET_PAGE_BITS) & (CPU_TLB_SIZE - 1);
     mmu_idx = cpu_mmu_index(env1);
-    if (unlikely(env1->tlb_table[mmu_idx][page_index].addr_code != (addr & TARGET_PAGE_MASK))) {
+    page_index = tlb_index(env1, mmu_idx, addr);
+    if (unlikely(env1->tlb_desc[mmu_idx].table[page_index].addr_code != (addr & TARGET_PAGE_MASK))) {
         if(map_when_needed)
         {
             ldub_code(addr);
+            /* filling the TLB may have resized it */
+            page_index = tlb_index(env1, mmu_idx, addr);
         }
         else
         {
             return -1;
         }
     }
-    pd = env1->tlb_table[mmu_idx][page_index].addr_code & ~TARGET_PAGE_MASK;
+    pd = env1->tlb_desc[mmu_idx].table[page_index].addr_code & ~TARGET_PAGE_MASK;
     if (pd > IO_MEM_ROM && !(pd & IO_MEM_ROMD)) {
         cpu_abort(env1, "Trying to execute code outside RAM or ROM at 0x" TARGET_FMT_lx "\n", addr);
     }
-    p = (void *)((uintptr_t)addr + env1->tlb_table[mmu_idx][page_index].addend);
+    p = (void *)((uintptr_t)addr + env1->tlb_desc[mmu_idx].table[page_index].addend);
     return ram_addr_from_host(p);
 }
 
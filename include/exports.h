@@ -5,6 +5,9 @@
 
 uint32_t tlib_set_maximum_block_size(uint32_t size);
 uint32_t tlib_get_maximum_block_size(void);
+void tlib_set_tlb_size_bounds(uint32_t min_bits, uint32_t max_bits);
+uint32_t tlib_get_tlb_size(uint32_t mmu_idx);
+void tlib_set_memory_access_trace_capacity(uint32_t capacity);
 
 void tlib_set_cycles_per_instruction(uint32_t size);
 uint32_t tlib_get_cycles_per_instruction(void);
@@ -16,6 +19,8 @@ char *tlib_get_commit();
 
 int32_t tlib_init(char *cpu_name);
 void tlib_atomic_memory_state_init(int id, uintptr_t atomic_memory_state_ptr);
+uint32_t tlib_get_atomic_memory_state_size(void);
+void tlib_set_reservation_granule(uint32_t size);
 void tlib_dispose(void);
 uint64_t tlib_get_executed_instructions(void);
 void tlib_reset_executed_instrucions(uint64_t val);
@@ -53,6 +58,12 @@ void tlib_enable_guest_profiler(int value);
 
 void tlib_set_page_io_accessed(uint64_t address);
 void tlib_clear_page_io_accessed(uint64_t address);
+void tlib_set_range_io_accessed(uint64_t address, uint64_t size);
+void tlib_clear_range_io_accessed(uint64_t address, uint64_t size);
+void tlib_clear_io_accessed_regions(void);
+uint32_t tlib_get_io_accessed_regions_count(void);
+uint64_t tlib_get_io_accessed_region_start(uint32_t index);
+uint64_t tlib_get_io_accessed_region_end(uint32_t index);
 
 int tlib_restore_context(void);
 void *tlib_export_state(void);
@@ -64,6 +75,24 @@ uint32_t tlib_get_chaining_enabled(void);
 void tlib_set_tb_cache_enabled(uint32_t val);
 uint32_t tlib_get_tb_cache_enabled(void);
 
+uint64_t tlib_get_tb_hash_lookup_count(void);
+uint64_t tlib_get_tb_hash_probe_count(void);
+uint32_t tlib_get_tb_hash_max_probe_length(void);
+uint32_t tlib_get_tb_hash_entries(void);
+uint32_t tlib_get_tb_hash_capacity(void);
+void tlib_reset_tb_hash_statistics(void);
+
+void tlib_set_superblock_threshold(uint32_t threshold);
+uint32_t tlib_get_superblock_threshold(void);
+void tlib_set_superblock_optimizer_enabled(uint32_t enabled);
+
+uint64_t tlib_pretranslate_range(uint64_t start, uint64_t end, uint32_t flags);
+uint64_t tlib_get_pretranslated_byte_count(void);
+
+int32_t tlib_open_translation_cache(char *path);
+void tlib_close_translation_cache(void);
+uint64_t tlib_get_translation_cache_hit_count(void);
+
 void tlib_set_block_finished_hook_present(uint32_t val);
 
 int32_t tlib_set_return_on_exception(int32_t value);
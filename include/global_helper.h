@@ -1,6 +1,7 @@
 #include "def-helper.h"
 
 DEF_HELPER_1(prepare_block_for_execution, i32, ptr)
+DEF_HELPER_1(lookup_tb_ptr, ptr, env)
 DEF_HELPER_0(block_begin_event, i32)
 DEF_HELPER_2(block_finished_event, void, tl, i32)
 DEF_HELPER_2(log, void, i32, i32)
@@ -14,6 +15,7 @@ DEF_HELPER_4(mark_tbs_as_dirty, void, env, tl, i32, i32)
 
 DEF_HELPER_1(count_opcode_inner, void, i32)
 DEF_HELPER_1(tlb_flush, void, env)
+DEF_HELPER_1(mem_trace_flush, void, env)
 
 DEF_HELPER_1(acquire_global_memory_lock, void, env)
 DEF_HELPER_1(release_global_memory_lock, void, env)
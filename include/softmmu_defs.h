@@ -14,6 +14,16 @@ uint64_t REGPARM __ldq_mmu(target_ulong addr, int mmu_idx);
 uint64_t REGPARM __ldq_err_mmu(target_ulong addr, int mmu_idx, int *err);
 void REGPARM __stq_mmu(target_ulong addr, uint64_t val, int mmu_idx);
 
+/* the helpers of the TLB-miss slow paths, see GETPC_LDST */
+uint8_t REGPARM __ldb_tcg_mmu(target_ulong addr, int mmu_idx);
+void REGPARM __stb_tcg_mmu(target_ulong addr, uint8_t val, int mmu_idx);
+uint16_t REGPARM __ldw_tcg_mmu(target_ulong addr, int mmu_idx);
+void REGPARM __stw_tcg_mmu(target_ulong addr, uint16_t val, int mmu_idx);
+uint32_t REGPARM __ldl_tcg_mmu(target_ulong addr, int mmu_idx);
+void REGPARM __stl_tcg_mmu(target_ulong addr, uint32_t val, int mmu_idx);
+uint64_t REGPARM __ldq_tcg_mmu(target_ulong addr, int mmu_idx);
+void REGPARM __stq_tcg_mmu(target_ulong addr, uint64_t val, int mmu_idx);
+
 uint8_t REGPARM __ldb_cmmu(target_ulong addr, int mmu_idx);
 uint8_t REGPARM __ldb_err_cmmu(target_ulong addr, int mmu_idx, int *err);
 void REGPARM __stb_cmmu(target_ulong addr, uint8_t val, int mmu_idx);
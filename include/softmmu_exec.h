@@ -292,7 +292,7 @@
 #undef MEMSUFFIX
 #endif /* (NB_MMU_MODES >= 15) */
 
-// Adjust sizes of 'tlb_table_n_0' arrays in tcg/additional.{c,h} to
+// Adjust sizes of 'tlb_desc_*' arrays in tcg/additional.{c,h} to
 // NB_MMU_MODES+1 after expanding the number of supported NB_MMU_MODES.
 #if (NB_MMU_MODES > 15)
 #error "NB_MMU_MODES > 15 is not supported for now"
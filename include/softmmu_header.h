@@ -80,12 +80,12 @@ static inline RES_TYPE glue(glue(glue(ld, USUFFIX), _err), MEMSUFFIX)(target_ulo
     int mmu_idx;
 
     addr = ptr;
-    page_index = (addr >> TARGET_PAGE_BITS) & (CPU_TLB_SIZE - 1);
     mmu_idx = CPU_MMU_INDEX;
-    if (unlikely(env->tlb_table[mmu_idx][page_index].ADDR_READ != (addr & (TARGET_PAGE_MASK | (DATA_SIZE - 1))))) {
+    page_index = tlb_index(env, mmu_idx, addr);
+    if (unlikely(env->tlb_desc[mmu_idx].table[page_index].ADDR_READ != (addr & (TARGET_PAGE_MASK | (DATA_SIZE - 1))))) {
         res = glue(glue(glue(__ld, SUFFIX), _err), MMUSUFFIX)(addr, mmu_idx, err);
     } else {
-        physaddr = addr + env->tlb_table[mmu_idx][page_index].addend;
+        physaddr = addr + env->tlb_desc[mmu_idx].table[page_index].addend;
         res = glue(glue(ld, USUFFIX), _raw)(physaddr);
     }
     return res;
@@ -105,12 +105,12 @@ static inline int glue(glue(glue(lds, SUFFIX), _err), MEMSUFFIX)(target_ulong pt
     int mmu_idx;
 
     addr = ptr;
-    page_index = (addr >> TARGET_PAGE_BITS) & (CPU_TLB_SIZE - 1);
     mmu_idx = CPU_MMU_INDEX;
-    if (unlikely(env->tlb_table[mmu_idx][page_index].ADDR_READ != (addr & (TARGET_PAGE_MASK | (DATA_SIZE - 1))))) {
+    page_index = tlb_index(env, mmu_idx, addr);
+    if (unlikely(env->tlb_desc[mmu_idx].table[page_index].ADDR_READ != (addr & (TARGET_PAGE_MASK | (DATA_SIZE - 1))))) {
         res = (DATA_STYPE)glue(glue(glue(__ld, SUFFIX), _err), MMUSUFFIX)(addr, mmu_idx, err);
     } else {
-        physaddr = addr + env->tlb_table[mmu_idx][page_index].addend;
+        physaddr = addr + env->tlb_desc[mmu_idx].table[page_index].addend;
         res = glue(glue(lds, SUFFIX), _raw)(physaddr);
     }
     return res;
@@ -134,12 +134,12 @@ static inline void glue(glue(st, SUFFIX), MEMSUFFIX)(target_ulong ptr, RES_TYPE
     int mmu_idx;
 
     addr = ptr;
-    page_index = (addr >> TARGET_PAGE_BITS) & (CPU_TLB_SIZE - 1);
     mmu_idx = CPU_MMU_INDEX;
-    if (unlikely(env->tlb_table[mmu_idx][page_index].addr_write != (addr & (TARGET_PAGE_MASK | (DATA_SIZE - 1))))) {
+    page_index = tlb_index(env, mmu_idx, addr);
+    if (unlikely(env->tlb_desc[mmu_idx].table[page_index].addr_write != (addr & (TARGET_PAGE_MASK | (DATA_SIZE - 1))))) {
         glue(glue(__st, SUFFIX), MMUSUFFIX)(addr, v, mmu_idx);
     } else {
-        physaddr = addr + env->tlb_table[mmu_idx][page_index].addend;
+        physaddr = addr + env->tlb_desc[mmu_idx].table[page_index].addend;
         glue(glue(st, SUFFIX), _raw)(physaddr, v);
     }
 }
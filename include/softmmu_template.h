@@ -57,12 +57,6 @@ extern void *global_retaddr;
 #define ADDR_READ        addr_read
 #endif
 
-#define MEMORY_IO_READ 0
-#define MEMORY_IO_WRITE 1
-#define MEMORY_READ 2
-#define MEMORY_WRITE 3
-#define INSN_FETCH 4
-
 #ifdef ALIGNED_ONLY
 void do_unaligned_access(target_ulong addr, int is_write, int is_user, void *retaddr);
 #endif
@@ -94,56 +88,47 @@ static inline DATA_TYPE glue(io_read, SUFFIX)(target_phys_addr_t physaddr, targe
 }
 
 /* handle all cases except unaligned access which span two pages */
-__attribute__((always_inline)) inline DATA_TYPE REGPARM glue(glue(glue(__ld, SUFFIX), _err), MMUSUFFIX)(target_ulong addr, int mmu_idx, int *err)
+static __attribute__((always_inline)) inline DATA_TYPE glue(glue(glue(__ld, SUFFIX), _ret), MMUSUFFIX)(target_ulong addr, int mmu_idx, int *err, void *retaddr, bool from_generated_code)
 {
     DATA_TYPE res;
     int index;
     target_ulong tlb_addr;
     target_phys_addr_t ioaddr;
-    void *retaddr;
     uintptr_t addend;
+    bool refill;
     bool is_insn_fetch = (env->current_tb == NULL);
 
-    acquire_global_memory_lock(cpu);
-    register_address_access(cpu, addr);
-
     /* test if there is match for unaligned or IO access */
     /* XXX: could done more in memory macro in a non portable way */
-    index = (addr >> TARGET_PAGE_BITS) & (CPU_TLB_SIZE - 1);
-
-    tlb_addr = cpu->tlb_table[mmu_idx][index].ADDR_READ;
-    if(tlb_addr != -1 && (tlb_addr & TLB_ONE_SHOT) != 0) {
-        // TLB_ONE_SHOT pages should not be reused
-        // as there might be protected memory regions in them.
-        // A protected memory region does not have to fill the whole page;
-        // there might also be many memory regions defined for a single page.
-        // That's why we flush the page and force
-        // calling tlb_fill to check memory region
-        // restrictions on each access.
-        tlb_flush_page(cpu, addr, true);
-    }
+    index = tlb_index(cpu, mmu_idx, addr);
+
+    tlb_addr = cpu->tlb_desc[mmu_idx].table[index].ADDR_READ;
+    /* TLB_ONE_SHOT pages hold protected memory regions smaller than a page; the
+       accesses outside of the regions already checked go through tlb_fill again */
+    refill = (tlb_addr & TLB_ONE_SHOT) != 0 && tlb_addr != -1 &&
+             tlb_one_shot_needs_fill(cpu, mmu_idx, index, addr, DATA_SIZE, READ_ACCESS_TYPE);
 
 redo:
-    tlb_addr = cpu->tlb_table[mmu_idx][index].ADDR_READ & ~TLB_ONE_SHOT;
+    /* tlb_fill may have resized the TLB */
+    index = tlb_index(cpu, mmu_idx, addr);
+    tlb_addr = cpu->tlb_desc[mmu_idx].table[index].ADDR_READ & ~TLB_ONE_SHOT;
 
-    if ((addr & TARGET_PAGE_MASK) == (tlb_addr & (TARGET_PAGE_MASK | TLB_INVALID_MASK))) {
+    if (!refill && (addr & TARGET_PAGE_MASK) == (tlb_addr & (TARGET_PAGE_MASK | TLB_INVALID_MASK))) {
         if ((tlb_addr & TLB_MMIO) == TLB_MMIO) {
             /* IO access */
             if ((addr & (DATA_SIZE - 1)) != 0) {
                 goto do_unaligned_access;
             }
-            retaddr = GETPC();
             global_retaddr = retaddr;
-            ioaddr = cpu->iotlb[mmu_idx][index];
+            ioaddr = cpu->tlb_desc[mmu_idx].iotlb[index];
             res = glue(io_read, SUFFIX)(ioaddr, addr, retaddr);
             if(unlikely(cpu->tlib_is_on_memory_access_enabled != 0))
             {
-                tlib_on_memory_access(CPU_PC(cpu), MEMORY_IO_READ, addr);
+                mem_trace_record(cpu, MEMORY_IO_READ, addr, DATA_SIZE, from_generated_code);
             }
         } else if (((addr & ~TARGET_PAGE_MASK) + DATA_SIZE - 1) >= TARGET_PAGE_SIZE) {
             /* slow unaligned access (it spans two pages or IO) */
 do_unaligned_access:
-            retaddr = GETPC();
 #ifdef ALIGNED_ONLY
             if (!cpu->allow_unaligned_accesses) {
                 do_unaligned_access(addr, READ_ACCESS_TYPE, mmu_idx, retaddr);
@@ -152,31 +137,33 @@ do_unaligned_access:
             res = glue(glue(glue(slow_ld, SUFFIX), _err), MMUSUFFIX)(addr, mmu_idx, retaddr, err);
             if(unlikely(cpu->tlib_is_on_memory_access_enabled != 0))
             {
-                tlib_on_memory_access(CPU_PC(cpu), is_insn_fetch ? INSN_FETCH : MEMORY_READ, addr);
+                mem_trace_record(cpu, is_insn_fetch ? INSN_FETCH : MEMORY_READ, addr, DATA_SIZE, from_generated_code);
             }
         } else {
             /* unaligned/aligned access in the same page */
 #ifdef ALIGNED_ONLY
             if (((addr & (DATA_SIZE - 1)) != 0) && !cpu->allow_unaligned_accesses) {
-                retaddr = GETPC();
                 do_unaligned_access(addr, READ_ACCESS_TYPE, mmu_idx, retaddr);
             }
 #endif
-            addend = cpu->tlb_table[mmu_idx][index].addend;
+            addend = cpu->tlb_desc[mmu_idx].table[index].addend;
             res = glue(glue(ld, USUFFIX), _raw)((uint8_t *)(uintptr_t)(addr + addend));
             if(unlikely(cpu->tlib_is_on_memory_access_enabled != 0))
             {
-                tlib_on_memory_access(CPU_PC(cpu), is_insn_fetch ? INSN_FETCH : MEMORY_READ, addr);
+                mem_trace_record(cpu, is_insn_fetch ? INSN_FETCH : MEMORY_READ, addr, DATA_SIZE, from_generated_code);
             }
         }
     } else {
         /* the page is not in the TLB : fill it */
-        retaddr = GETPC();
 #ifdef ALIGNED_ONLY
         if (((addr & (DATA_SIZE - 1)) != 0) && !cpu->allow_unaligned_accesses) {
             do_unaligned_access(addr, READ_ACCESS_TYPE, mmu_idx, retaddr);
         }
 #endif
+        if (!refill && victim_tlb_hit(cpu, mmu_idx, index, READ_ACCESS_TYPE, addr & TARGET_PAGE_MASK)) {
+            goto redo;
+        }
+        refill = false;
         if (!tlb_fill(cpu, addr, READ_ACCESS_TYPE, mmu_idx, retaddr, !!err, DATA_SIZE)) {
             goto redo;
         } else {
@@ -187,15 +174,28 @@ do_unaligned_access:
         }
     }
 
-    release_global_memory_lock(cpu);
+    register_address_access(cpu, addr);
     return res;
 }
 
+__attribute__((always_inline)) inline DATA_TYPE REGPARM glue(glue(glue(__ld, SUFFIX), _err), MMUSUFFIX)(target_ulong addr, int mmu_idx, int *err)
+{
+    return glue(glue(glue(__ld, SUFFIX), _ret), MMUSUFFIX)(addr, mmu_idx, err, GETPC(), false);
+}
+
 DATA_TYPE REGPARM glue(glue(__ld, SUFFIX), MMUSUFFIX)(target_ulong addr, int mmu_idx)
 {
-    return glue(glue(glue(__ld, SUFFIX), _err), MMUSUFFIX)(addr, mmu_idx, NULL);
+    return glue(glue(glue(__ld, SUFFIX), _ret), MMUSUFFIX)(addr, mmu_idx, NULL, GETPC(), false);
 }
 
+#ifndef SOFTMMU_CODE_ACCESS
+/* called from the TLB-miss slow paths of the generated code only */
+DATA_TYPE REGPARM glue(glue(glue(__ld, SUFFIX), _tcg), MMUSUFFIX)(target_ulong addr, int mmu_idx)
+{
+    return glue(glue(glue(__ld, SUFFIX), _ret), MMUSUFFIX)(addr, mmu_idx, NULL, GETPC_LDST(), true);
+}
+#endif
+
 /* handle all unaligned cases */
 static DATA_TYPE glue(glue(glue(slow_ld, SUFFIX), _err), MMUSUFFIX)(target_ulong addr, int mmu_idx, void *retaddr, int *err)
 {
@@ -204,31 +204,27 @@ static DATA_TYPE glue(glue(glue(slow_ld, SUFFIX), _err), MMUSUFFIX)(target_ulong
     target_phys_addr_t ioaddr;
     target_ulong tlb_addr, addr1, addr2;
     uintptr_t addend;
+    bool refill;
 
-    index = (addr >> TARGET_PAGE_BITS) & (CPU_TLB_SIZE - 1);
-
-    tlb_addr = cpu->tlb_table[mmu_idx][index].ADDR_READ;
-    if(tlb_addr != -1 && (tlb_addr & TLB_ONE_SHOT) != 0) {
-        // TLB_ONE_SHOT pages should not be reused
-        // as there might be protected memory regions in them.
-        // A protected memory region does not have to fill the whole page;
-        // there might also be many memory regions defined for a single page.
-        // That's why we flush the page and force
-        // calling tlb_fill to check memory region
-        // restrictions on each access.
-        tlb_flush_page(cpu, addr, true);
-    }
+    index = tlb_index(cpu, mmu_idx, addr);
+
+    tlb_addr = cpu->tlb_desc[mmu_idx].table[index].ADDR_READ;
+    /* TLB_ONE_SHOT pages hold protected memory regions smaller than a page; the
+       accesses outside of the regions already checked go through tlb_fill again */
+    refill = (tlb_addr & TLB_ONE_SHOT) != 0 && tlb_addr != -1 &&
+             tlb_one_shot_needs_fill(cpu, mmu_idx, index, addr, DATA_SIZE, READ_ACCESS_TYPE);
 
 redo:
-    tlb_addr = cpu->tlb_table[mmu_idx][index].ADDR_READ & ~TLB_ONE_SHOT;
+    index = tlb_index(cpu, mmu_idx, addr);
+    tlb_addr = cpu->tlb_desc[mmu_idx].table[index].ADDR_READ & ~TLB_ONE_SHOT;
 
-    if ((addr & TARGET_PAGE_MASK) == (tlb_addr & (TARGET_PAGE_MASK | TLB_INVALID_MASK))) {
+    if (!refill && (addr & TARGET_PAGE_MASK) == (tlb_addr & (TARGET_PAGE_MASK | TLB_INVALID_MASK))) {
         if ((tlb_addr & TLB_MMIO) == TLB_MMIO) {
             /* IO access */
             if ((addr & (DATA_SIZE - 1)) != 0) {
                 goto do_unaligned_access;
             }
-            ioaddr = cpu->iotlb[mmu_idx][index];
+            ioaddr = cpu->tlb_desc[mmu_idx].iotlb[index];
             res = glue(io_read, SUFFIX)(ioaddr, addr, retaddr);
         } else if (((addr & ~TARGET_PAGE_MASK) + DATA_SIZE - 1) >= TARGET_PAGE_SIZE) {
 do_unaligned_access:
@@ -246,11 +242,15 @@ do_unaligned_access:
             res = (DATA_TYPE)res;
         } else {
             /* unaligned/aligned access in the same page */
-            addend = cpu->tlb_table[mmu_idx][index].addend;
+            addend = cpu->tlb_desc[mmu_idx].table[index].addend;
             res = glue(glue(ld, USUFFIX), _raw)((uint8_t *)(uintptr_t)(addr + addend));
         }
     } else {
         /* the page is not in the TLB : fill it */
+        if (!refill && victim_tlb_hit(cpu, mmu_idx, index, READ_ACCESS_TYPE, addr & TARGET_PAGE_MASK)) {
+            goto redo;
+        }
+        refill = false;
         if (!tlb_fill(cpu, addr, READ_ACCESS_TYPE, mmu_idx, retaddr, err == NULL ? 0 : 1, DATA_SIZE)) {
             goto redo;
         } else {
@@ -301,51 +301,41 @@ static inline void glue(io_write, SUFFIX)(target_phys_addr_t physaddr, DATA_TYPE
 #endif /* SHIFT > 2 */
 }
 
-__attribute__((always_inline)) inline void REGPARM glue(glue(__st, SUFFIX), MMUSUFFIX)(target_ulong addr, DATA_TYPE val, int mmu_idx)
+static __attribute__((always_inline)) inline void glue(glue(glue(__st, SUFFIX), _ret), MMUSUFFIX)(target_ulong addr, DATA_TYPE val, int mmu_idx, void *retaddr, bool from_generated_code)
 {
     target_phys_addr_t ioaddr;
     target_ulong tlb_addr;
-    void *retaddr;
     int index;
     uintptr_t addend;
+    bool refill;
 
-    acquire_global_memory_lock(cpu);
-    register_address_access(cpu, addr);
+    index = tlb_index(cpu, mmu_idx, addr);
 
-    index = (addr >> TARGET_PAGE_BITS) & (CPU_TLB_SIZE - 1);
-
-    tlb_addr = cpu->tlb_table[mmu_idx][index].addr_write;
-    if(tlb_addr != -1 && (tlb_addr & TLB_ONE_SHOT) != 0) {
-        // TLB_ONE_SHOT pages should not be reused
-        // as there might be protected memory regions in them.
-        // A protected memory region does not have to fill the whole page;
-        // there might also be many memory regions defined for a single page.
-        // That's why we flush the page and force
-        // calling tlb_fill to check memory region
-        // restrictions on each access.
-        tlb_flush_page(cpu, addr, true);
-    }
+    tlb_addr = cpu->tlb_desc[mmu_idx].table[index].addr_write;
+    /* TLB_ONE_SHOT pages hold protected memory regions smaller than a page; the
+       accesses outside of the regions already checked go through tlb_fill again */
+    refill = (tlb_addr & TLB_ONE_SHOT) != 0 && tlb_addr != -1 &&
+             tlb_one_shot_needs_fill(cpu, mmu_idx, index, addr, DATA_SIZE, 1);
 
 redo:
-    tlb_addr = cpu->tlb_table[mmu_idx][index].addr_write & ~TLB_ONE_SHOT;
+    index = tlb_index(cpu, mmu_idx, addr);
+    tlb_addr = cpu->tlb_desc[mmu_idx].table[index].addr_write & ~TLB_ONE_SHOT;
 
-    if ((addr & TARGET_PAGE_MASK) == (tlb_addr & (TARGET_PAGE_MASK | TLB_INVALID_MASK))) {
+    if (!refill && (addr & TARGET_PAGE_MASK) == (tlb_addr & (TARGET_PAGE_MASK | TLB_INVALID_MASK))) {
         if ((tlb_addr & TLB_MMIO) == TLB_MMIO) {
             /* IO access */
             if ((addr & (DATA_SIZE - 1)) != 0) {
                 goto do_unaligned_access;
             }
-            retaddr = GETPC();
             global_retaddr = retaddr;
-            ioaddr = cpu->iotlb[mmu_idx][index];
+            ioaddr = cpu->tlb_desc[mmu_idx].iotlb[index];
             glue(io_write, SUFFIX)(ioaddr, val, addr, retaddr);
             if(unlikely(cpu->tlib_is_on_memory_access_enabled != 0))
             {
-                tlib_on_memory_access(CPU_PC(cpu), MEMORY_IO_WRITE, addr);
+                mem_trace_record(cpu, MEMORY_IO_WRITE, addr, DATA_SIZE, from_generated_code);
             }
         } else if (((addr & ~TARGET_PAGE_MASK) + DATA_SIZE - 1) >= TARGET_PAGE_SIZE) {
 do_unaligned_access:
-            retaddr = GETPC();
 #ifdef ALIGNED_ONLY
             if (!cpu->allow_unaligned_accesses) {
                 do_unaligned_access(addr, 1, mmu_idx, retaddr);
@@ -354,38 +344,51 @@ do_unaligned_access:
             glue(glue(slow_st, SUFFIX), MMUSUFFIX)(addr, val, mmu_idx, retaddr);
             if(unlikely(cpu->tlib_is_on_memory_access_enabled != 0))
             {
-                tlib_on_memory_access(CPU_PC(cpu), MEMORY_WRITE, addr);
+                mem_trace_record(cpu, MEMORY_WRITE, addr, DATA_SIZE, from_generated_code);
             }
         } else {
             /* aligned/unaligned access in the same page */
 #ifdef ALIGNED_ONLY
             if (((addr & (DATA_SIZE - 1)) != 0) && !cpu->allow_unaligned_accesses) {
-                retaddr = GETPC();
                 do_unaligned_access(addr, 1, mmu_idx, retaddr);
             }
 #endif
 
-            addend = cpu->tlb_table[mmu_idx][index].addend;
+            addend = cpu->tlb_desc[mmu_idx].table[index].addend;
             glue(glue(st, SUFFIX), _raw)((uint8_t *)(uintptr_t)(addr + addend), val);
             if(unlikely(cpu->tlib_is_on_memory_access_enabled != 0))
             {
-                tlib_on_memory_access(CPU_PC(cpu), MEMORY_WRITE, addr);
+                mem_trace_record(cpu, MEMORY_WRITE, addr, DATA_SIZE, from_generated_code);
             }
         }
     } else {
         /* the page is not in the TLB : fill it */
-        retaddr = GETPC();
 #ifdef ALIGNED_ONLY
         if (((addr & (DATA_SIZE - 1)) != 0) && !cpu->allow_unaligned_accesses) {
             do_unaligned_access(addr, 1, mmu_idx, retaddr);
         }
 #endif
-        tlb_fill(cpu, addr, 1, mmu_idx, retaddr, 0, DATA_SIZE);
+        if (refill || !victim_tlb_hit(cpu, mmu_idx, index, 1, addr & TARGET_PAGE_MASK)) {
+            tlb_fill(cpu, addr, 1, mmu_idx, retaddr, 0, DATA_SIZE);
+        }
+        refill = false;
         goto redo;
     }
 
+    /* after the store, so that a reservation made meanwhile either sees the new value or is cancelled */
+    register_address_access(cpu, addr);
     mark_tbs_containing_pc_as_dirty(addr, DATA_SIZE, 1);
-    release_global_memory_lock(cpu);
+}
+
+__attribute__((always_inline)) inline void REGPARM glue(glue(__st, SUFFIX), MMUSUFFIX)(target_ulong addr, DATA_TYPE val, int mmu_idx)
+{
+    glue(glue(glue(__st, SUFFIX), _ret), MMUSUFFIX)(addr, val, mmu_idx, GETPC(), false);
+}
+
+/* called from the TLB-miss slow paths of the generated code only */
+void REGPARM glue(glue(glue(__st, SUFFIX), _tcg), MMUSUFFIX)(target_ulong addr, DATA_TYPE val, int mmu_idx)
+{
+    glue(glue(glue(__st, SUFFIX), _ret), MMUSUFFIX)(addr, val, mmu_idx, GETPC_LDST(), true);
 }
 
 /* handles all unaligned cases */
@@ -395,31 +398,27 @@ void glue(glue(slow_st, SUFFIX), MMUSUFFIX)(target_ulong addr, DATA_TYPE val, in
     target_ulong tlb_addr;
     int index, i;
     uintptr_t addend;
+    bool refill;
 
-    index = (addr >> TARGET_PAGE_BITS) & (CPU_TLB_SIZE - 1);
-
-    tlb_addr = cpu->tlb_table[mmu_idx][index].addr_write;
-    if(tlb_addr != -1 && (tlb_addr & TLB_ONE_SHOT) != 0) {
-        // TLB_ONE_SHOT pages should not be reused
-        // as there might be protected memory regions in them.
-        // A protected memory region does not have to fill the whole page;
-        // there might also be many memory regions defined for a single page.
-        // That's why we flush the page and force
-        // calling tlb_fill to check memory region
-        // restrictions on each access.
-        tlb_flush_page(cpu, addr, true);
-    }
+    index = tlb_index(cpu, mmu_idx, addr);
+
+    tlb_addr = cpu->tlb_desc[mmu_idx].table[index].addr_write;
+    /* TLB_ONE_SHOT pages hold protected memory regions smaller than a page; the
+       accesses outside of the regions already checked go through tlb_fill again */
+    refill = (tlb_addr & TLB_ONE_SHOT) != 0 && tlb_addr != -1 &&
+             tlb_one_shot_needs_fill(cpu, mmu_idx, index, addr, DATA_SIZE, 1);
 
 redo:
-    tlb_addr = cpu->tlb_table[mmu_idx][index].addr_write & ~TLB_ONE_SHOT;
+    index = tlb_index(cpu, mmu_idx, addr);
+    tlb_addr = cpu->tlb_desc[mmu_idx].table[index].addr_write & ~TLB_ONE_SHOT;
 
-    if ((addr & TARGET_PAGE_MASK) == (tlb_addr & (TARGET_PAGE_MASK | TLB_INVALID_MASK))) {
+    if (!refill && (addr & TARGET_PAGE_MASK) == (tlb_addr & (TARGET_PAGE_MASK | TLB_INVALID_MASK))) {
         if ((tlb_addr & TLB_MMIO) == TLB_MMIO) {
             /* IO access */
             if ((addr & (DATA_SIZE - 1)) != 0) {
                 goto do_unaligned_access;
             }
-            ioaddr = cpu->iotlb[mmu_idx][index];
+            ioaddr = cpu->tlb_desc[mmu_idx].iotlb[index];
             glue(io_write, SUFFIX)(ioaddr, val, addr, retaddr);
         } else if (((addr & ~TARGET_PAGE_MASK) + DATA_SIZE - 1) >= TARGET_PAGE_SIZE) {
 do_unaligned_access:
@@ -435,12 +434,15 @@ do_unaligned_access:
             }
         } else {
             /* aligned/unaligned access in the same page */
-            addend = cpu->tlb_table[mmu_idx][index].addend;
+            addend = cpu->tlb_desc[mmu_idx].table[index].addend;
             glue(glue(st, SUFFIX), _raw)((uint8_t *)(uintptr_t)(addr + addend), val);
         }
     } else {
         /* the page is not in the TLB : fill it */
-        tlb_fill(cpu, addr, 1, mmu_idx, retaddr, 0, DATA_SIZE);
+        if (refill || !victim_tlb_hit(cpu, mmu_idx, index, 1, addr & TARGET_PAGE_MASK)) {
+            tlb_fill(cpu, addr, 1, mmu_idx, retaddr, 0, DATA_SIZE);
+        }
+        refill = false;
         goto redo;
     }
 }
@@ -0,0 +1,30 @@
+#ifndef TB_CACHE_H_
+#define TB_CACHE_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "cpu.h"
+
+struct TranslationBlock;
+
+/* returns the number of blocks in the cache file, -1 if the cache is not supported on this host */
+int32_t tb_cache_open(const char *path);
+/* writes the blocks translated since the cache was opened back to the file */
+void tb_cache_close(void);
+bool tb_cache_is_open(void);
+void tb_cache_set_cpu_model(const char *cpu_model);
+
+/* fills 'tb' from the cache instead of translating it, the code is placed at tb->tc_ptr */
+bool tb_cache_load(CPUState *env, struct TranslationBlock *tb, int *code_size, int *search_size);
+/* called right after 'tb' has been translated */
+void tb_cache_store(CPUState *env, struct TranslationBlock *tb, int code_size, int search_size);
+
+uint64_t tb_cache_get_hit_count(void);
+
+#define TB_CACHE_HASH_INIT 0xcbf29ce484222325ULL
+
+uint64_t tb_cache_hash(uint64_t hash, const void *data, size_t size);
+/* mixes the state the translator of the target reads, other than the TB flags, into 'hash'; defined by each target */
+uint64_t tb_cache_target_settings(CPUState *env, uint64_t hash);
+
+#endif
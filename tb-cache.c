@@ -0,0 +1,627 @@
+/*
+ *  Translated blocks kept on disk between the runs.
+ *
+ *  Copyright (c) Antmicro
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdio.h>
+#include <string.h>
+#ifdef _WIN32
+#include <process.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+#include "cpu.h"
+#include "exec-all.h"
+#include "tcg.h"
+#include "callbacks.h"
+#include "exports.h"
+#include "infrastructure.h"
+#include "tb-cache.h"
+#include "tlib_source_hash.h"
+
+/* The code of a block translated in an earlier run is reused when the guest code it was translated from is the same
+   byte for byte. The addresses embedded in the host code are recorded by TCG (see TCGCodeReloc) and rewritten for
+   this process; they are relative either to the library or to the TranslationBlock. Whatever else the translation
+   depends on is either part of the key (the build, the CPU model, the TB flags, the settings of tb_cache_settings
+   and the target state of tb_cache_target_settings) or keeps the block out of the cache (breakpoints, hooks called
+   at translation time). */
+
+#define TB_CACHE_MAGIC        "TLIBTBC1"
+#define TB_CACHE_MIN_CAPACITY 1024
+
+typedef struct TBCacheHeader {
+    char magic[8];
+    uint64_t fingerprint;
+    uint64_t entry_count;
+    /* the size of the entries that follow the header */
+    uint64_t data_size;
+} TBCacheHeader;
+
+typedef struct TBCacheEntry {
+    uint64_t pc;
+    uint64_t cs_base;
+    uint64_t flags;
+    uint64_t jmp_target_pc[2];
+    uint32_t settings;
+    uint32_t disas_flags;
+    uint32_t icount;
+    uint32_t code_size;
+    uint32_t search_size;
+    uint32_t reloc_count;
+    /* including the relocations, the guest code, the host code and the search data following the entry */
+    uint32_t entry_size;
+    uint16_t size;
+    uint16_t prev_size;
+    uint16_t tb_next_offset[2];
+    uint16_t tb_jmp_offset[2];
+    uint8_t was_cut;
+    uint8_t padding[7];
+} TBCacheEntry;
+
+typedef struct TBCacheReloc {
+    uint32_t offset;
+    uint8_t type;
+    uint8_t tb_relative;
+    uint16_t padding;
+    int64_t addend;
+} TBCacheReloc;
+
+typedef struct TBCacheSlot {
+    uint64_t key;
+    TBCacheEntry *entry;
+    /* allocated in this run, not a part of the file */
+    bool is_new;
+    /* a later translation of the same block is in the cache, the entry is not written back */
+    bool replaced;
+} TBCacheSlot;
+
+static struct {
+    bool open;
+    char *path;
+    uint64_t fingerprint;
+    uint8_t *file_data;
+    size_t file_size;
+    TBCacheSlot *slots;
+    uint32_t capacity;
+    uint32_t count;
+    uint32_t new_count;
+    uint64_t hit_count;
+} cache;
+
+static char cache_cpu_model[64];
+
+uint64_t tb_cache_hash(uint64_t hash, const void *data, size_t size)
+{
+    const uint8_t *bytes = data;
+    for (size_t i = 0; i < size; i++) {
+        hash = (hash ^ bytes[i]) * 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+static inline uint64_t tb_cache_hash_string(uint64_t hash, const char *str)
+{
+    return tb_cache_hash(hash, str, strlen(str) + 1);
+}
+
+/* the addresses that are not relative to the TB are relative to this one */
+static inline uintptr_t tb_cache_anchor(void)
+{
+    return (uintptr_t)&tb_cache_open;
+}
+
+static uint64_t tb_cache_fingerprint(void)
+{
+    uintptr_t anchor = tb_cache_anchor();
+    uint64_t layout[] = {
+        sizeof(CPUState),
+        sizeof(TranslationBlock),
+        TARGET_PAGE_BITS,
+        offsetof(CPUState, tlb_desc),
+        /* the prologue and the softmmu helpers live outside of the library image */
+        (uintptr_t)tcg->code_gen_prologue - anchor,
+        (uintptr_t)tcg->ldb - anchor,
+        (uintptr_t)tcg->ldw - anchor,
+        (uintptr_t)tcg->ldl - anchor,
+        (uintptr_t)tcg->ldq - anchor,
+        (uintptr_t)tcg->stb - anchor,
+        (uintptr_t)tcg->stw - anchor,
+        (uintptr_t)tcg->stl - anchor,
+        (uintptr_t)tcg->stq - anchor,
+    };
+    uint64_t hash = TB_CACHE_HASH_INIT;
+
+    hash = tb_cache_hash_string(hash, tlib_get_arch());
+    hash = tb_cache_hash_string(hash, tlib_get_commit());
+    /* the commit does not change with the local modifications */
+    hash = tb_cache_hash_string(hash, TLIB_SOURCE_HASH);
+    hash = tb_cache_hash_string(hash, cache_cpu_model);
+    return tb_cache_hash(hash, layout, sizeof(layout));
+}
+
+/* the settings the translation depends on */
+static uint32_t tb_cache_settings(CPUState *env)
+{
+    uint32_t settings[] = {
+        maximum_block_size,
+        superblock_threshold != 0,
+        env->block_begin_hook_present,
+        env->block_finished_hook_present,
+        env->guest_profiler_enabled,
+        env->count_opcodes,
+        env->tlib_is_on_memory_access_enabled != 0,
+        env->allow_unaligned_accesses != 0,
+        env->interrupt_begin_callback_enabled,
+        env->interrupt_end_callback_enabled,
+    };
+    uint64_t hash = tb_cache_hash(TB_CACHE_HASH_INIT, settings, sizeof(settings));
+    return (uint32_t)tb_cache_target_settings(env, hash);
+}
+
+static inline uint64_t tb_cache_key(uint64_t pc, uint64_t cs_base, uint64_t flags)
+{
+    uint64_t key = pc ^ (cs_base * 0x9e3779b97f4a7c15ULL) ^ (flags << 32) ^ flags;
+    key ^= key >> 29;
+    key *= 0xbf58476d1ce4e5b9ULL;
+    return key ^ (key >> 32);
+}
+
+static inline TBCacheReloc *tb_cache_entry_relocs(TBCacheEntry *entry)
+{
+    return (TBCacheReloc *)(entry + 1);
+}
+
+static inline uint8_t *tb_cache_entry_guest_code(TBCacheEntry *entry)
+{
+    return (uint8_t *)(tb_cache_entry_relocs(entry) + entry->reloc_count);
+}
+
+/* the search data follows the host code */
+static inline uint8_t *tb_cache_entry_host_code(TBCacheEntry *entry)
+{
+    return tb_cache_entry_guest_code(entry) + entry->size;
+}
+
+static inline uint64_t tb_cache_entry_size(uint64_t reloc_count, uint64_t size, uint64_t code_size, uint64_t search_size)
+{
+    return (sizeof(TBCacheEntry) + reloc_count * sizeof(TBCacheReloc) + size + code_size + search_size + 7) & ~7ULL;
+}
+
+static inline bool tb_cache_is_usable(CPUState *env, TranslationBlock *tb)
+{
+    return cache.open && tb->cflags == 0 && !env->tb_cache_disabled && QTAILQ_EMPTY(&env->breakpoints) &&
+           !tlib_is_on_block_translation_enabled && env->opcode_counters_size == 0;
+}
+
+/* the guest code is accessed only if it is in the TLB; a fill could raise a guest exception */
+static bool tb_cache_access_guest_code(CPUState *env, target_ulong addr, uint8_t *bytes, int size, bool copy)
+{
+    int mmu_idx = cpu_mmu_index(env);
+
+    while (size > 0) {
+        CPUTLBEntry *te = tlb_entry(env, mmu_idx, addr);
+        int chunk = TARGET_PAGE_SIZE - (addr & ~TARGET_PAGE_MASK);
+        uint8_t *host;
+
+        if (te->addr_code != (addr & TARGET_PAGE_MASK)) {
+            return false;
+        }
+        host = (uint8_t *)(uintptr_t)(addr + te->addend);
+        if (chunk > size) {
+            chunk = size;
+        }
+        if (copy) {
+            memcpy(bytes, host, chunk);
+        } else if (memcmp(bytes, host, chunk) != 0) {
+            return false;
+        }
+        addr += chunk;
+        bytes += chunk;
+        size -= chunk;
+    }
+    return true;
+}
+
+static TBCacheSlot *tb_cache_insert(uint64_t key, TBCacheEntry *entry, bool is_new);
+
+static void tb_cache_resize(uint32_t capacity)
+{
+    TBCacheSlot *old_slots = cache.slots;
+    uint32_t old_capacity = cache.capacity;
+
+    cache.slots = tlib_mallocz(capacity * sizeof(TBCacheSlot));
+    cache.capacity = capacity;
+    cache.count = 0;
+    for (uint32_t i = 0; i < old_capacity; i++) {
+        if (old_slots[i].entry != NULL) {
+            tb_cache_insert(old_slots[i].key, old_slots[i].entry, old_slots[i].is_new)->replaced = old_slots[i].replaced;
+        }
+    }
+    if (old_slots != NULL) {
+        tlib_free(old_slots);
+    }
+}
+
+static TBCacheSlot *tb_cache_insert(uint64_t key, TBCacheEntry *entry, bool is_new)
+{
+    TBCacheSlot *slot;
+    uint32_t i;
+
+    /* kept at most half full */
+    if ((cache.count + 1) * 2 > cache.capacity) {
+        tb_cache_resize(cache.capacity != 0 ? cache.capacity * 2 : TB_CACHE_MIN_CAPACITY);
+    }
+    for (i = key & (cache.capacity - 1); cache.slots[i].entry != NULL; i = (i + 1) & (cache.capacity - 1)) {
+    }
+    slot = &cache.slots[i];
+    slot->key = key;
+    slot->entry = entry;
+    slot->is_new = is_new;
+    slot->replaced = false;
+    cache.count++;
+    return slot;
+}
+
+static inline bool tb_cache_entry_matches(TBCacheSlot *slot, uint64_t key, TranslationBlock *tb, uint32_t settings)
+{
+    TBCacheEntry *entry = slot->entry;
+    return slot->key == key && !slot->replaced && entry->pc == tb->pc && entry->cs_base == tb->cs_base &&
+           entry->flags == (uint64_t)tb->flags && entry->settings == settings;
+}
+
+static bool tb_cache_entry_is_valid(TBCacheEntry *entry, uint64_t available)
+{
+    TBCacheReloc *relocs;
+    uint64_t size;
+
+    if (available < sizeof(TBCacheEntry)) {
+        return false;
+    }
+    size = tb_cache_entry_size(entry->reloc_count, entry->size, entry->code_size, entry->search_size);
+    if (entry->entry_size != size || size > available || entry->size == 0 ||
+        entry->code_size + (uint64_t)entry->search_size > TCG_MAX_CODE_SIZE + TCG_MAX_SEARCH_SIZE) {
+        return false;
+    }
+    relocs = tb_cache_entry_relocs(entry);
+    for (uint32_t i = 0; i < entry->reloc_count; i++) {
+        uint32_t field_size = relocs[i].type == TCG_CODE_RELOC_ABS64 ? 8 : 4;
+        if (relocs[i].type > TCG_CODE_RELOC_REL32 || relocs[i].offset + (uint64_t)field_size > entry->code_size) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static void tb_cache_unmap_file(void)
+{
+    if (cache.file_data == NULL) {
+        return;
+    }
+#ifdef _WIN32
+    tlib_free(cache.file_data);
+#else
+    munmap(cache.file_data, cache.file_size);
+#endif
+    cache.file_data = NULL;
+    cache.file_size = 0;
+}
+
+static bool tb_cache_map_file(const char *path)
+{
+#ifdef _WIN32
+    FILE *file = fopen(path, "rb");
+    long size;
+
+    if (file == NULL) {
+        return false;
+    }
+    if (fseek(file, 0, SEEK_END) != 0 || (size = ftell(file)) <= 0 || fseek(file, 0, SEEK_SET) != 0) {
+        fclose(file);
+        return false;
+    }
+    cache.file_data = tlib_malloc(size);
+    cache.file_size = size;
+    if (fread(cache.file_data, 1, size, file) != (size_t)size) {
+        tb_cache_unmap_file();
+        fclose(file);
+        return false;
+    }
+    fclose(file);
+    return true;
+#else
+    struct stat st;
+    void *data;
+    int fd = open(path, O_RDONLY);
+
+    if (fd < 0) {
+        return false;
+    }
+    if (fstat(fd, &st) != 0 || st.st_size <= 0) {
+        close(fd);
+        return false;
+    }
+    /* the pages of the entries that are never looked up are never read */
+    data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        return false;
+    }
+    cache.file_data = data;
+    cache.file_size = st.st_size;
+    return true;
+#endif
+}
+
+/* a file that does not match this build or is damaged is ignored, it is overwritten on close */
+static void tb_cache_read_file(void)
+{
+    TBCacheHeader *header;
+    uint8_t *data;
+    uint64_t available;
+
+    if (!tb_cache_map_file(cache.path)) {
+        return;
+    }
+    header = (TBCacheHeader *)cache.file_data;
+    if (cache.file_size < sizeof(TBCacheHeader) || memcmp(header->magic, TB_CACHE_MAGIC, sizeof(header->magic)) != 0 ||
+        header->fingerprint != cache.fingerprint || header->data_size != cache.file_size - sizeof(TBCacheHeader)) {
+        tb_cache_unmap_file();
+        return;
+    }
+    data = cache.file_data + sizeof(TBCacheHeader);
+    available = header->data_size;
+    for (uint64_t i = 0; i < header->entry_count; i++) {
+        TBCacheEntry *entry = (TBCacheEntry *)data;
+        if (!tb_cache_entry_is_valid(entry, available)) {
+            tlib_printf(LOG_LEVEL_WARNING, "Translation cache file %s is damaged, it is ignored", cache.path);
+            tlib_free(cache.slots);
+            cache.slots = NULL;
+            cache.capacity = 0;
+            cache.count = 0;
+            tb_cache_unmap_file();
+            return;
+        }
+        tb_cache_insert(tb_cache_key(entry->pc, entry->cs_base, entry->flags), entry, false);
+        data += entry->entry_size;
+        available -= entry->entry_size;
+    }
+}
+
+static void tb_cache_write_file(void)
+{
+    TBCacheHeader header = { .magic = TB_CACHE_MAGIC, .fingerprint = cache.fingerprint };
+    char tmp_path[1024];
+    FILE *file;
+    bool failed;
+
+    for (uint32_t i = 0; i < cache.capacity; i++) {
+        if (cache.slots[i].entry != NULL && !cache.slots[i].replaced) {
+            header.entry_count++;
+            header.data_size += cache.slots[i].entry->entry_size;
+        }
+    }
+    /* the file might be in use by other processes, it is replaced as a whole */
+#ifdef _WIN32
+    snprintf(tmp_path, sizeof(tmp_path), "%s.%d.tmp", cache.path, (int)_getpid());
+#else
+    snprintf(tmp_path, sizeof(tmp_path), "%s.%d.tmp", cache.path, (int)getpid());
+#endif
+    file = fopen(tmp_path, "wb");
+    if (file == NULL) {
+        tlib_printf(LOG_LEVEL_WARNING, "Could not write the translation cache to %s", tmp_path);
+        return;
+    }
+    failed = fwrite(&header, sizeof(header), 1, file) != 1;
+    for (uint32_t i = 0; i < cache.capacity && !failed; i++) {
+        TBCacheEntry *entry = cache.slots[i].entry;
+        if (entry != NULL && !cache.slots[i].replaced) {
+            failed = fwrite(entry, entry->entry_size, 1, file) != 1;
+        }
+    }
+    failed |= fclose(file) != 0;
+    if (!failed) {
+#ifdef _WIN32
+        /* the file has to be closed before it can be replaced */
+        tb_cache_unmap_file();
+        remove(cache.path);
+#endif
+        failed = rename(tmp_path, cache.path) != 0;
+    }
+    if (failed) {
+        tlib_printf(LOG_LEVEL_WARNING, "Could not write the translation cache to %s", cache.path);
+        remove(tmp_path);
+    }
+}
+
+int32_t tb_cache_open(const char *path)
+{
+#if TCG_TARGET_HAS_code_relocs
+    tb_cache_close();
+    cache.path = tlib_strdup(path);
+    cache.fingerprint = tb_cache_fingerprint();
+    cache.open = true;
+    tb_cache_read_file();
+    return cache.count;
+#else
+    /* the host code backend does not record the addresses it embeds */
+    return -1;
+#endif
+}
+
+void tb_cache_close(void)
+{
+    if (!cache.open) {
+        return;
+    }
+    if (cache.new_count != 0) {
+        tb_cache_write_file();
+    }
+    for (uint32_t i = 0; i < cache.capacity; i++) {
+        if (cache.slots[i].is_new) {
+            tlib_free(cache.slots[i].entry);
+        }
+    }
+    if (cache.slots != NULL) {
+        tlib_free(cache.slots);
+    }
+    tb_cache_unmap_file();
+    tlib_free(cache.path);
+    memset(&cache, 0, sizeof(cache));
+}
+
+bool tb_cache_is_open(void)
+{
+    return cache.open;
+}
+
+void tb_cache_set_cpu_model(const char *cpu_model)
+{
+    snprintf(cache_cpu_model, sizeof(cache_cpu_model), "%s", cpu_model);
+}
+
+static bool tb_cache_install(TranslationBlock *tb, TBCacheEntry *entry)
+{
+    TBCacheReloc *relocs = tb_cache_entry_relocs(entry);
+    TranslationBlockCold *cold = tb_cold(tb);
+    uint8_t *code = tb->tc_ptr;
+    uintptr_t anchor = tb_cache_anchor();
+
+    memcpy(code, tb_cache_entry_host_code(entry), entry->code_size + entry->search_size);
+    for (uint32_t i = 0; i < entry->reloc_count; i++) {
+        uintptr_t value = (relocs[i].tb_relative ? (uintptr_t)tb : anchor) + relocs[i].addend;
+        uint8_t *field = code + relocs[i].offset;
+        if (relocs[i].type == TCG_CODE_RELOC_ABS64) {
+            uint64_t absolute = value;
+            memcpy(field, &absolute, sizeof(absolute));
+        } else {
+            intptr_t displacement = value - (uintptr_t)(field + 4);
+            int32_t relative = displacement;
+            /* the code buffer is too far from the library in this run */
+            if (relative != displacement) {
+                return false;
+            }
+            memcpy(field, &relative, sizeof(relative));
+        }
+    }
+    flush_icache_range((uintptr_t)code, (uintptr_t)code + entry->code_size);
+
+    tb->size = entry->size;
+    tb->icount = entry->icount;
+    cold->prev_size = entry->prev_size;
+    cold->was_cut = entry->was_cut;
+    cold->disas_flags = entry->disas_flags;
+    cold->tc_search = code + entry->code_size;
+    for (int n = 0; n < 2; n++) {
+        cold->jmp_target_pc[n] = entry->jmp_target_pc[n];
+        cold->tb_next_offset[n] = entry->tb_next_offset[n];
+        cold->tb_jmp_offset[n] = entry->tb_jmp_offset[n];
+    }
+    return true;
+}
+
+bool tb_cache_load(CPUState *env, TranslationBlock *tb, int *code_size, int *search_size)
+{
+    uint64_t key;
+    uint32_t settings;
+
+    if (!tb_cache_is_usable(env, tb) || cache.count == 0) {
+        return false;
+    }
+    key = tb_cache_key(tb->pc, tb->cs_base, tb->flags);
+    settings = tb_cache_settings(env);
+    for (uint32_t i = key & (cache.capacity - 1); cache.slots[i].entry != NULL; i = (i + 1) & (cache.capacity - 1)) {
+        TBCacheEntry *entry = cache.slots[i].entry;
+        if (!tb_cache_entry_matches(&cache.slots[i], key, tb, settings) ||
+            !tb_cache_access_guest_code(env, tb->pc, tb_cache_entry_guest_code(entry), entry->size, false)) {
+            continue;
+        }
+        if (!tb_cache_install(tb, entry)) {
+            return false;
+        }
+        *code_size = entry->code_size;
+        *search_size = entry->search_size;
+        cache.hit_count++;
+        return true;
+    }
+    return false;
+}
+
+void tb_cache_store(CPUState *env, TranslationBlock *tb, int code_size, int search_size)
+{
+    TCGContext *s = tcg->ctx;
+    TranslationBlockCold *cold = tb_cold(tb);
+    TBCacheEntry *entry;
+    TBCacheReloc *relocs;
+    uintptr_t anchor = tb_cache_anchor();
+    uint64_t key;
+
+    /* a block of size 0 ends at a breakpoint or at an undecodable instruction, it does not depend on the code */
+    if (!tb_cache_is_usable(env, tb) || tb->size == 0 || s->code_position_dependent) {
+        return;
+    }
+    entry = tlib_mallocz(tb_cache_entry_size(s->nb_code_relocs, tb->size, code_size, search_size));
+    entry->pc = tb->pc;
+    entry->cs_base = tb->cs_base;
+    entry->flags = tb->flags;
+    entry->settings = tb_cache_settings(env);
+    entry->disas_flags = cold->disas_flags;
+    entry->icount = tb->icount;
+    entry->code_size = code_size;
+    entry->search_size = search_size;
+    entry->reloc_count = s->nb_code_relocs;
+    entry->entry_size = tb_cache_entry_size(s->nb_code_relocs, tb->size, code_size, search_size);
+    entry->size = tb->size;
+    entry->prev_size = cold->prev_size;
+    entry->was_cut = cold->was_cut;
+    for (int n = 0; n < 2; n++) {
+        entry->jmp_target_pc[n] = cold->jmp_target_pc[n];
+        entry->tb_next_offset[n] = cold->tb_next_offset[n];
+        entry->tb_jmp_offset[n] = cold->tb_jmp_offset[n];
+    }
+    relocs = tb_cache_entry_relocs(entry);
+    for (int i = 0; i < s->nb_code_relocs; i++) {
+        TCGCodeReloc *reloc = &s->code_relocs[i];
+        relocs[i].offset = reloc->offset;
+        relocs[i].type = reloc->type;
+        relocs[i].tb_relative = reloc->tb_relative;
+        relocs[i].addend = reloc->target - (reloc->tb_relative ? (uintptr_t)tb : anchor);
+    }
+    if (!tb_cache_access_guest_code(env, tb->pc, tb_cache_entry_guest_code(entry), tb->size, true)) {
+        tlib_free(entry);
+        return;
+    }
+    memcpy(tb_cache_entry_host_code(entry), tb->tc_ptr, code_size + search_size);
+
+    key = tb_cache_key(entry->pc, entry->cs_base, entry->flags);
+    if (cache.capacity != 0) {
+        /* the guest code of the block changed since it was stored */
+        for (uint32_t i = key & (cache.capacity - 1); cache.slots[i].entry != NULL; i = (i + 1) & (cache.capacity - 1)) {
+            if (tb_cache_entry_matches(&cache.slots[i], key, tb, entry->settings)) {
+                cache.slots[i].replaced = true;
+            }
+        }
+    }
+    tb_cache_insert(key, entry, true);
+    cache.new_count++;
+}
+
+uint64_t tb_cache_get_hit_count(void)
+{
+    return cache.hit_count;
+}
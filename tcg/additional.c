@@ -93,10 +93,8 @@ char *TCG_pstrcat(char *buf, int buf_size, const char *s)
 }
 
 unsigned int temp_buf_offset;
-unsigned int tlb_table_n_0[MMU_MODES_MAX];
-unsigned int tlb_table_n_0_addr_read[MMU_MODES_MAX];
-unsigned int tlb_table_n_0_addr_write[MMU_MODES_MAX];
-unsigned int tlb_table_n_0_addend[MMU_MODES_MAX];
+unsigned int tlb_desc_mask[MMU_MODES_MAX];
+unsigned int tlb_desc_table[MMU_MODES_MAX];
 unsigned int tlb_entry_addr_read;
 unsigned int tlb_entry_addr_write;
 unsigned int tlb_entry_addend;
@@ -125,14 +123,8 @@ void set_tlb_entry_addr_rwu(unsigned int read, unsigned int write, unsigned int
     tlb_entry_addend = addend;
 }
 
-void set_tlb_table_n_0(int i, unsigned int offset)
+void set_tlb_desc_mask_table(int i, unsigned int mask, unsigned int table)
 {
-    tlb_table_n_0[i] = offset;
-}
-
-void set_tlb_table_n_0_rwa(int i, unsigned int read, unsigned int write, unsigned int addend)
-{
-    tlb_table_n_0_addr_read[i] = read;
-    tlb_table_n_0_addr_write[i] = write;
-    tlb_table_n_0_addend[i] = addend;
+    tlb_desc_mask[i] = mask;
+    tlb_desc_table[i] = table;
 }
@@ -15,10 +15,8 @@ char *TCG_pstrcat(char *buf, int buf_size, const char *s);
 #define MMU_MODES_MAX 16
 
 extern unsigned int temp_buf_offset;
-extern unsigned int tlb_table_n_0_addr_read[MMU_MODES_MAX];
-extern unsigned int tlb_table_n_0_addr_write[MMU_MODES_MAX];
-extern unsigned int tlb_table_n_0_addend[MMU_MODES_MAX];
-extern unsigned int tlb_table_n_0[MMU_MODES_MAX];
+extern unsigned int tlb_desc_mask[MMU_MODES_MAX];
+extern unsigned int tlb_desc_table[MMU_MODES_MAX];
 extern unsigned int tlb_entry_addr_read;
 extern unsigned int tlb_entry_addr_write;
 extern unsigned int tlb_entry_addend;
@@ -26,6 +24,9 @@ extern unsigned int sizeof_CPUTLBEntry;
 
 /* XXX: make safe guess about sizes */
 #define MAX_OP_PER_INSTR      208
+/* on top of that, the ops recording the memory accesses of an instruction when
+   they are traced, see tcg_gen_mem_trace; an ARM64 LD4 of bytes makes 64 */
+#define MAX_MEM_TRACE_OP_PER_INSTR 1024
 
 #if HOST_LONG_BITS == 32
 #define MAX_OPC_PARAM_PER_ARG 2
@@ -42,6 +43,8 @@ extern unsigned int sizeof_CPUTLBEntry;
 #define MAX_OPC_PARAM         (4 + (MAX_OPC_PARAM_PER_ARG * MAX_OPC_PARAM_ARGS))
 #define OPC_BUF_SIZE          640
 #define OPC_MAX_SIZE          (OPC_BUF_SIZE - MAX_OP_PER_INSTR)
+/* the size of the buffers used once the memory accesses are traced, see tcg_use_mem_trace_buffers */
+#define OPC_MEM_TRACE_BUF_SIZE (OPC_BUF_SIZE + MAX_MEM_TRACE_OP_PER_INSTR)
 
 /* Maximum size a TCG op can expand to.  This is complicated because a
    single op may require several host instructions and register reloads.
@@ -49,13 +52,15 @@ extern unsigned int sizeof_CPUTLBEntry;
    a couple of fixup instructions per argument.  */
 #define TCG_MAX_OP_SIZE       192
 
-/* The maximum size of generated code within a block. */
+/* The maximum size of generated code within a block. The ops tracing memory
+   accesses are plain loads and stores, well within the guess for the others. */
 #define TCG_MAX_CODE_SIZE     (TCG_MAX_OP_SIZE * OPC_BUF_SIZE)
 
 /* The maximum size of PC search data within a block. */
 #define TCG_MAX_SEARCH_SIZE   (TCG_MAX_CODE_SIZE * 0.3)
 
 #define OPPARAM_BUF_SIZE      (OPC_BUF_SIZE * MAX_OPC_PARAM)
+#define OPPARAM_MEM_TRACE_BUF_SIZE (OPC_MEM_TRACE_BUF_SIZE * MAX_OPC_PARAM)
 
 void tlib_abort(char *msg);
 
@@ -789,7 +789,34 @@ static inline void tcg_out_goto_label(TCGContext *s, int cond, int label_index)
     }
 }
 
-#define TLB_SHIFT (CPU_TLB_ENTRY_BITS + CPU_TLB_BITS)
+/* Leaves the address of the TLB entry of addr_reg in r0 and the page number
+ * of addr_reg in r8. The size of the TLB varies at run time, see
+ * tlb_resize_and_flush, so it is masked with the value stored in env:
+ *  ldr r0, [env, #(offsetof(CPUState, tlb_desc[mem_index].mask))]
+ *  ldr r1, [env, #(offsetof(CPUState, tlb_desc[mem_index].table))]
+ *  and r0, r0, addr_reg lsr #(TARGET_PAGE_BITS - CPU_TLB_ENTRY_BITS)
+ *  add r0, r1, r0
+ *  shr r8, addr_reg, #TARGET_PAGE_BITS
+ * The loads come first, as r8 is their scratch register for large offsets.
+ */
+static void tcg_out_tlb_read(TCGContext *s, int addr_reg, int mem_index)
+{
+    tcg_out_ld32u(s, COND_AL, TCG_REG_R0, TCG_AREG0, tlb_desc_mask[mem_index]);
+    tcg_out_ld32u(s, COND_AL, TCG_REG_R1, TCG_AREG0, tlb_desc_table[mem_index]);
+    tcg_out_dat_reg(s, COND_AL, ARITH_AND, TCG_REG_R0, TCG_REG_R0, addr_reg,
+                    SHIFT_IMM_LSR(TARGET_PAGE_BITS - CPU_TLB_ENTRY_BITS));
+    tcg_out_dat_reg(s, COND_AL, ARITH_ADD, TCG_REG_R0, TCG_REG_R1, TCG_REG_R0, SHIFT_IMM_LSL(0));
+    tcg_out_dat_reg(s, COND_AL, ARITH_MOV, TCG_REG_R8, 0, addr_reg, SHIFT_IMM_LSR(TARGET_PAGE_BITS));
+}
+
+/* Emitted right after the helper call of a slow path. The first branch skips
+   the second one, which is never executed and only tells the helper where the
+   fast path of the access ends, see GETPC_LDST. */
+static void tcg_out_ldst_retaddr(TCGContext *s, uint8_t *raddr)
+{
+    tcg_out_b(s, COND_AL, 8);
+    tcg_out_b(s, COND_AL, raddr - s->code_ptr);
+}
 
 static inline void tcg_out_qemu_ld(TCGContext *s, const TCGArg *args, int opc)
 {
@@ -798,7 +825,7 @@ static inline void tcg_out_qemu_ld(TCGContext *s, const TCGArg *args, int opc)
 # if TARGET_LONG_BITS == 64
     int addr_reg2;
 # endif
-    uint32_t *label_ptr;
+    TCGLdstLabel *label;
 
 #ifdef TARGET_WORDS_BIGENDIAN
     bswap = 1;
@@ -818,29 +845,8 @@ static inline void tcg_out_qemu_ld(TCGContext *s, const TCGArg *args, int opc)
     mem_index = *args;
     s_bits = opc & 3;
 
-    /* Should generate something like the following:
-     *  shr r8, addr_reg, #TARGET_PAGE_BITS
-     *  and r0, r8, #(CPU_TLB_SIZE - 1)   @ Assumption: CPU_TLB_BITS <= 8
-     *  add r0, env, r0 lsl #CPU_TLB_ENTRY_BITS
-     */
-#  if CPU_TLB_BITS > 8
-#   error
-#  endif
-    tcg_out_dat_reg(s, COND_AL, ARITH_MOV, TCG_REG_R8, 0, addr_reg, SHIFT_IMM_LSR(TARGET_PAGE_BITS));
-    tcg_out_dat_imm(s, COND_AL, ARITH_AND, TCG_REG_R0, TCG_REG_R8, CPU_TLB_SIZE - 1);
-    tcg_out_dat_reg(s, COND_AL, ARITH_ADD, TCG_REG_R0, TCG_AREG0, TCG_REG_R0, SHIFT_IMM_LSL(CPU_TLB_ENTRY_BITS));
-    /* In the
-     *  ldr r1 [r0, #(offsetof(CPUState, tlb_table[mem_index][0].addr_read))]
-     * below, the offset is likely to exceed 12 bits if mem_index != 0 and
-     * not exceed otherwise, so use an
-     *  add r0, r0, #(mem_index * sizeof *CPUState.tlb_table)
-     * before.
-     */
-    if (mem_index) {
-        tcg_out_dat_imm(s, COND_AL, ARITH_ADD, TCG_REG_R0, TCG_REG_R0,
-                        (mem_index << (TLB_SHIFT & 1)) | ((16 - (TLB_SHIFT >> 1)) << 8));
-    }
-    tcg_out_ld32_12(s, COND_AL, TCG_REG_R1, TCG_REG_R0, tlb_table_n_0_addr_read[0]);
+    tcg_out_tlb_read(s, addr_reg, mem_index);
+    tcg_out_ld32_12(s, COND_AL, TCG_REG_R1, TCG_REG_R0, tlb_entry_addr_read);
     tcg_out_dat_reg(s, COND_AL, ARITH_CMP, 0, TCG_REG_R1, TCG_REG_R8, SHIFT_IMM_LSL(TARGET_PAGE_BITS));
     /* Check alignment.  */
     if (s_bits) {
@@ -849,10 +855,10 @@ static inline void tcg_out_qemu_ld(TCGContext *s, const TCGArg *args, int opc)
 #  if TARGET_LONG_BITS == 64
     /* XXX: possibly we could use a block data load or writeback in
      * the first access.  */
-    tcg_out_ld32_12(s, COND_EQ, TCG_REG_R1, TCG_REG_R0, tlb_table_n_0_addr_read[0] + 4);
+    tcg_out_ld32_12(s, COND_EQ, TCG_REG_R1, TCG_REG_R0, tlb_entry_addr_read + 4);
     tcg_out_dat_reg(s, COND_EQ, ARITH_CMP, 0, TCG_REG_R1, addr_reg2, SHIFT_IMM_LSL(0));
 #  endif
-    tcg_out_ld32_12(s, COND_EQ, TCG_REG_R1, TCG_REG_R0, tlb_table_n_0_addend[0]); 
+    tcg_out_ld32_12(s, COND_EQ, TCG_REG_R1, TCG_REG_R0, tlb_entry_addend);
 
     switch (opc) {
     case 0:
@@ -895,10 +901,36 @@ static inline void tcg_out_qemu_ld(TCGContext *s, const TCGArg *args, int opc)
         break;
     }
 
-    label_ptr = (void *)s->code_ptr;
-    tcg_out_b_noaddr(s, COND_EQ);
+    label = tcg_new_ldst_label(s);
+    label->is_ld = 1;
+    label->opc = opc;
+    label->datalo_reg = data_reg;
+    label->datahi_reg = data_reg2;
+    label->addrlo_reg = addr_reg;
+# if TARGET_LONG_BITS == 64
+    label->addrhi_reg = addr_reg2;
+# else
+    label->addrhi_reg = 0;
+# endif
+    label->mem_index = mem_index;
+    label->label_ptr[0] = s->code_ptr;
+    label->label_ptr[1] = NULL;
+    tcg_out_b_noaddr(s, COND_NE);
+    label->raddr = s->code_ptr;
+}
+
+static void tcg_out_qemu_ld_slow_path(TCGContext *s, TCGLdstLabel *label)
+{
+    int opc = label->opc;
+    int s_bits = opc & 3;
+    int data_reg = label->datalo_reg;
+    int data_reg2 = label->datahi_reg;
+    int addr_reg = label->addrlo_reg;
+# if TARGET_LONG_BITS == 64
+    int addr_reg2 = label->addrhi_reg;
+# endif
+    int mem_index = label->mem_index;
 
-    /* TODO: move this code to where the constants pool will be */
     if (addr_reg != TCG_REG_R0) {
         tcg_out_dat_reg(s, COND_AL, ARITH_MOV, TCG_REG_R0, 0, addr_reg, SHIFT_IMM_LSL(0));
     }
@@ -924,6 +956,7 @@ static inline void tcg_out_qemu_ld(TCGContext *s, const TCGArg *args, int opc)
     default:
         tcg_abort();
     }
+    tcg_out_ldst_retaddr(s, label->raddr);
 
     switch (opc) {
     case 0 | 4:
@@ -950,7 +983,7 @@ static inline void tcg_out_qemu_ld(TCGContext *s, const TCGArg *args, int opc)
         break;
     }
 
-    reloc_pc24(label_ptr, (tcg_target_long)s->code_ptr);
+    tcg_out_b(s, COND_AL, label->raddr - s->code_ptr);
 }
 
 static inline void tcg_out_qemu_st(TCGContext *s, const TCGArg *args, int opc)
@@ -960,7 +993,7 @@ static inline void tcg_out_qemu_st(TCGContext *s, const TCGArg *args, int opc)
 # if TARGET_LONG_BITS == 64
     int addr_reg2;
 # endif
-    uint32_t *label_ptr;
+    TCGLdstLabel *label;
 
 #ifdef TARGET_WORDS_BIGENDIAN
     bswap = 1;
@@ -980,26 +1013,8 @@ static inline void tcg_out_qemu_st(TCGContext *s, const TCGArg *args, int opc)
     mem_index = *args;
     s_bits = opc & 3;
 
-    /* Should generate something like the following:
-     *  shr r8, addr_reg, #TARGET_PAGE_BITS
-     *  and r0, r8, #(CPU_TLB_SIZE - 1)   @ Assumption: CPU_TLB_BITS <= 8
-     *  add r0, env, r0 lsl #CPU_TLB_ENTRY_BITS
-     */
-    tcg_out_dat_reg(s, COND_AL, ARITH_MOV, TCG_REG_R8, 0, addr_reg, SHIFT_IMM_LSR(TARGET_PAGE_BITS));
-    tcg_out_dat_imm(s, COND_AL, ARITH_AND, TCG_REG_R0, TCG_REG_R8, CPU_TLB_SIZE - 1);
-    tcg_out_dat_reg(s, COND_AL, ARITH_ADD, TCG_REG_R0, TCG_AREG0, TCG_REG_R0, SHIFT_IMM_LSL(CPU_TLB_ENTRY_BITS));
-    /* In the
-     *  ldr r1 [r0, #(offsetof(CPUState, tlb_table[mem_index][0].addr_write))]
-     * below, the offset is likely to exceed 12 bits if mem_index != 0 and
-     * not exceed otherwise, so use an
-     *  add r0, r0, #(mem_index * sizeof *CPUState.tlb_table)
-     * before.
-     */
-    if (mem_index) {
-        tcg_out_dat_imm(s, COND_AL, ARITH_ADD, TCG_REG_R0, TCG_REG_R0,
-                        (mem_index << (TLB_SHIFT & 1)) | ((16 - (TLB_SHIFT >> 1)) << 8));
-    }
-    tcg_out_ld32_12(s, COND_AL, TCG_REG_R1, TCG_REG_R0, tlb_table_n_0_addr_write[0]);
+    tcg_out_tlb_read(s, addr_reg, mem_index);
+    tcg_out_ld32_12(s, COND_AL, TCG_REG_R1, TCG_REG_R0, tlb_entry_addr_write);
     tcg_out_dat_reg(s, COND_AL, ARITH_CMP, 0, TCG_REG_R1, TCG_REG_R8, SHIFT_IMM_LSL(TARGET_PAGE_BITS));
     /* Check alignment.  */
     if (s_bits) {
@@ -1008,10 +1023,10 @@ static inline void tcg_out_qemu_st(TCGContext *s, const TCGArg *args, int opc)
 #  if TARGET_LONG_BITS == 64
     /* XXX: possibly we could use a block data load or writeback in
      * the first access.  */
-    tcg_out_ld32_12(s, COND_EQ, TCG_REG_R1, TCG_REG_R0, tlb_table_n_0_addr_write[0] + 4);
+    tcg_out_ld32_12(s, COND_EQ, TCG_REG_R1, TCG_REG_R0, tlb_entry_addr_write + 4);
     tcg_out_dat_reg(s, COND_EQ, ARITH_CMP, 0, TCG_REG_R1, addr_reg2, SHIFT_IMM_LSL(0));
 #  endif
-    tcg_out_ld32_12(s, COND_EQ, TCG_REG_R1, TCG_REG_R0, tlb_table_n_0_addend[0]);
+    tcg_out_ld32_12(s, COND_EQ, TCG_REG_R1, TCG_REG_R0, tlb_entry_addend);
 
     switch (opc) {
     case 0:
@@ -1047,10 +1062,36 @@ static inline void tcg_out_qemu_st(TCGContext *s, const TCGArg *args, int opc)
         break;
     }
 
-    label_ptr = (void *)s->code_ptr;
-    tcg_out_b_noaddr(s, COND_EQ);
+    label = tcg_new_ldst_label(s);
+    label->is_ld = 0;
+    label->opc = opc;
+    label->datalo_reg = data_reg;
+    label->datahi_reg = data_reg2;
+    label->addrlo_reg = addr_reg;
+# if TARGET_LONG_BITS == 64
+    label->addrhi_reg = addr_reg2;
+# else
+    label->addrhi_reg = 0;
+# endif
+    label->mem_index = mem_index;
+    label->label_ptr[0] = s->code_ptr;
+    label->label_ptr[1] = NULL;
+    tcg_out_b_noaddr(s, COND_NE);
+    label->raddr = s->code_ptr;
+}
+
+static void tcg_out_qemu_st_slow_path(TCGContext *s, TCGLdstLabel *label)
+{
+    int opc = label->opc;
+    int s_bits = opc & 3;
+    int data_reg = label->datalo_reg;
+    int data_reg2 = label->datahi_reg;
+    int addr_reg = label->addrlo_reg;
+# if TARGET_LONG_BITS == 64
+    int addr_reg2 = label->addrhi_reg;
+# endif
+    int mem_index = label->mem_index;
 
-    /* TODO: move this code to where the constants pool will be */
     tcg_out_dat_reg(s, COND_AL, ARITH_MOV, TCG_REG_R0, 0, addr_reg, SHIFT_IMM_LSL(0));
 # if TARGET_LONG_BITS == 32
     switch (opc) {
@@ -1123,12 +1164,31 @@ static inline void tcg_out_qemu_st(TCGContext *s, const TCGArg *args, int opc)
     default:
         tcg_abort();
     }
+    tcg_out_ldst_retaddr(s, label->raddr);
 
     if (opc == 3) {
         tcg_out_dat_imm(s, COND_AL, ARITH_ADD, TCG_REG_R13, TCG_REG_R13, 0x10);
     }
 
-    reloc_pc24(label_ptr, (tcg_target_long)s->code_ptr);
+    tcg_out_b(s, COND_AL, label->raddr - s->code_ptr);
+}
+
+/* Emit the TLB-miss paths of the block after its body, so that the fast
+   paths stay straight-line code */
+static void tcg_out_ldst_finalize(TCGContext *s)
+{
+    TCGLdstLabel *label;
+    int i;
+
+    for (i = 0; i < s->nb_ldst_labels; i++) {
+        label = &s->ldst_labels[i];
+        reloc_pc24(label->label_ptr[0], (tcg_target_long)s->code_ptr);
+        if (label->is_ld) {
+            tcg_out_qemu_ld_slow_path(s, label);
+        } else {
+            tcg_out_qemu_st_slow_path(s, label);
+        }
+    }
 }
 
 static uint8_t *tb_ret_addr;
@@ -1176,6 +1236,12 @@ static inline void tcg_out_op(TCGContext *s, TCGOpcode opc, const TCGArg *args,
         }
         s->tb_next_offset[args[0]] = s->code_ptr - s->code_buf;
         break;
+    case INDEX_op_goto_ptr:
+        tcg_out_bx(s, COND_AL, args[0]);
+        break;
+    case INDEX_op_movi_tb_ptr:
+        tcg_out_movi32(s, COND_AL, args[0], args[1]);
+        break;
     case INDEX_op_call:
         if (const_args[0]) {
             tcg_out_call(s, args[0]);
@@ -1403,6 +1469,8 @@ gen_shift32:
 static const TCGTargetOpDef arm_op_defs[] = {
     { INDEX_op_exit_tb, { } },
     { INDEX_op_goto_tb, { } },
+    { INDEX_op_goto_ptr, { "r" } },
+    { INDEX_op_movi_tb_ptr, { "r" } },
     { INDEX_op_call, { "ri" } },
     { INDEX_op_jmp, { "ri" } },
     { INDEX_op_br, { } },
@@ -1538,6 +1606,11 @@ static void tcg_target_qemu_prologue(TCGContext *s)
     tcg_out_mov(s, TCG_TYPE_PTR, TCG_AREG0, tcg_target_call_iarg_regs[0]);
 
     tcg_out_bx(s, COND_AL, tcg_target_call_iarg_regs[1]);
+
+    /* return path for goto_ptr, set return value to 0 */
+    s->code_gen_epilogue = s->code_ptr;
+    tcg_out_movi(s, TCG_TYPE_PTR, TCG_REG_R0, 0);
+
     tb_ret_addr = s->code_ptr;
 
     /* ldmia sp!, { r4 - r12, pc } */
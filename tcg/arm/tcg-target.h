@@ -60,6 +60,7 @@ typedef enum {
 #define TCG_TARGET_CALL_STACK_OFFSET 0
 
 /* optional instructions */
+#define TCG_TARGET_HAS_code_relocs   0
 #define TCG_TARGET_HAS_andc_i32      1
 #define TCG_TARGET_HAS_bswap16_i32   1
 #define TCG_TARGET_HAS_bswap32_i32   1
@@ -80,6 +81,7 @@ typedef enum {
 #define TCG_TARGET_HAS_not_i32       1
 #define TCG_TARGET_HAS_orc_i32       0
 #define TCG_TARGET_HAS_rot_i32       1
+#define TCG_TARGET_HAS_MEMORY_BSWAP  0
 
 #define TCG_TARGET_HAS_GUEST_BASE
 
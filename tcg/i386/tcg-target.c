@@ -532,6 +532,20 @@ static void tcg_out_movi(TCGContext *s, TCGType type, TCGReg ret, tcg_target_lon
     }
 }
 
+/* Always the 64-bit immediate form, so that any address can be written over
+   it when the code is moved; the address is recorded, see TCGCodeReloc */
+static void tcg_out_movi_reloc(TCGContext *s, TCGReg ret, tcg_target_long arg, int tb_relative)
+{
+#if TCG_TARGET_REG_BITS == 64
+    tcg_out_opc(s, OPC_MOVL_Iv + P_REXW + LOWREGMASK(ret), 0, ret, 0);
+    tcg_out_code_reloc(s, s->code_ptr, TCG_CODE_RELOC_ABS64, tb_relative, arg);
+    tcg_out32(s, arg);
+    tcg_out32(s, arg >> 31 >> 1);
+#else
+    tcg_out_movi(s, TCG_TYPE_PTR, ret, arg);
+#endif
+}
+
 static inline void tcg_out_pushi(TCGContext *s, tcg_target_long val)
 {
     if (val == (int8_t)val) {
@@ -921,9 +935,10 @@ static void tcg_out_branch(TCGContext *s, int call, tcg_target_long dest)
 
     if (disp == (int32_t)disp) {
         tcg_out_opc(s, call ? OPC_CALL_Jz : OPC_JMP_long, 0, 0, 0);
+        tcg_out_code_reloc(s, s->code_ptr, TCG_CODE_RELOC_REL32, 0, dest);
         tcg_out32(s, disp);
     } else {
-        tcg_out_movi(s, TCG_TYPE_PTR, TCG_REG_R10, dest);
+        tcg_out_movi_reloc(s, TCG_REG_R10, dest, 0);
         tcg_out_modrm(s, OPC_GRP5, call ? EXT5_CALLN_Ev : EXT5_JMPN_Ev, TCG_REG_R10);
     }
 }
@@ -951,7 +966,8 @@ static void tcg_out_jmp(TCGContext *s, tcg_target_long dest)
 
    Outputs:
    LABEL_PTRS is filled with 1 (32-bit addresses) or 2 (64-bit addresses)
-   positions of the displacements of forward jumps to the TLB miss case.
+   positions of the 32-bit displacements of forward jumps to the TLB miss
+   case, which tcg_out_ldst_finalize emits at the end of the block.
 
    First argument register is loaded with the low part of the address.
    In the TLB hit case, it has been adjusted as indicated by the TLB
@@ -965,37 +981,46 @@ static inline void tcg_out_tlb_load(TCGContext *s, int addrlo_idx, int mem_index
 {
     const int addrlo = args[addrlo_idx];
 
-    tgen_arithi(s, ARITH_AND + rexw, r0, TARGET_PAGE_MASK | ((1 << s_bits) - 1), 0);
-    tgen_arithi(s, ARITH_AND + rexw, r1, (CPU_TLB_SIZE - 1) << CPU_TLB_ENTRY_BITS, 0);
+    if (s->allow_unaligned && s_bits) {
+        /* an access crossing the page boundary does not match the TLB entry of its first byte */
+        /* lea (1 << s_bits) - 1(r0), r0 */
+        tcg_out_modrm_offset(s, OPC_LEA + rexw, r0, r0, (1 << s_bits) - 1);
+        tgen_arithi(s, ARITH_AND + rexw, r0, TARGET_PAGE_MASK, 0);
+    } else {
+        tgen_arithi(s, ARITH_AND + rexw, r0, TARGET_PAGE_MASK | ((1 << s_bits) - 1), 0);
+    }
 
-    tcg_out_modrm_sib_offset(s, OPC_LEA + P_REXW, r1, TCG_AREG0, r1, 0,
-                             /* offsetof(CPUState, tlb_table[mem_index][0]) */ tlb_table_n_0[mem_index] + which);
+    /* the size of the TLB varies at run time, see tlb_resize_and_flush */
+    /* and offsetof(CPUState, tlb_desc[mem_index].mask)(env), r1 */
+    tcg_out_modrm_offset(s, OPC_ARITH_GvEv + (ARITH_AND << 3) + P_REXW, r1, TCG_AREG0, tlb_desc_mask[mem_index]);
+    /* add offsetof(CPUState, tlb_desc[mem_index].table)(env), r1 */
+    tcg_out_modrm_offset(s, OPC_ADD_GvEv + P_REXW, r1, TCG_AREG0, tlb_desc_table[mem_index]);
 
-    /* cmp 0(r1), r0 */
-    tcg_out_modrm_offset(s, OPC_CMP_GvEv + rexw, r0, r1, 0);
+    /* cmp which(r1), r0 */
+    tcg_out_modrm_offset(s, OPC_CMP_GvEv + rexw, r0, r1, which);
 
     tcg_out_mov(s, type, r0, addrlo);
 
-    /* jne label1 */
-    tcg_out8(s, OPC_JCC_short + JCC_JNE);
+    /* jne slow_path */
+    tcg_out_opc(s, OPC_JCC_long + JCC_JNE, 0, 0, 0);
     label_ptr[0] = s->code_ptr;
-    s->code_ptr++;
+    s->code_ptr += 4;
 
     if (TARGET_LONG_BITS > TCG_TARGET_REG_BITS) {
-        /* cmp 4(r1), addrhi */
-        tcg_out_modrm_offset(s, OPC_CMP_GvEv, args[addrlo_idx + 1], r1, 4);
+        /* cmp which+4(r1), addrhi */
+        tcg_out_modrm_offset(s, OPC_CMP_GvEv, args[addrlo_idx + 1], r1, which + 4);
 
-        /* jne label1 */
-        tcg_out8(s, OPC_JCC_short + JCC_JNE);
+        /* jne slow_path */
+        tcg_out_opc(s, OPC_JCC_long + JCC_JNE, 0, 0, 0);
         label_ptr[1] = s->code_ptr;
-        s->code_ptr++;
+        s->code_ptr += 4;
     }
 
     /* TLB Hit.  */
 
     /* add addend(r1), r0 */
     tcg_out_modrm_offset(s, OPC_ADD_GvEv + P_REXW, r0, r1,
-                         /*offsetof(CPUTLBEntry, addend)*/ tlb_entry_addend - which);
+                         /*offsetof(CPUTLBEntry, addend)*/ tlb_entry_addend);
 }
 
 static void tcg_out_qemu_ld_direct(TCGContext *s, int datalo, int datahi, int base, tcg_target_long ofs, int sizeop)
@@ -1089,8 +1114,8 @@ static void tcg_out_qemu_ld(TCGContext *s, const TCGArg *args, int opc)
 {
     int data_reg, data_reg2 = 0;
     int addrlo_idx;
-    int mem_index, s_bits, arg_idx;
-    uint8_t *label_ptr[3];
+    int mem_index, s_bits;
+    TCGLdstLabel *label;
 
     data_reg = args[0];
     addrlo_idx = 1;
@@ -1110,38 +1135,64 @@ static void tcg_out_qemu_ld(TCGContext *s, const TCGArg *args, int opc)
 
     tcg_prepare_st_ld_args(s, type, rexw, r0, r1, args[addrlo_idx]);
 
+    label = tcg_new_ldst_label(s);
+    label->is_ld = 1;
+    label->opc = opc;
+    label->datalo_reg = data_reg;
+    label->datahi_reg = data_reg2;
+    label->addrlo_reg = args[addrlo_idx];
+    label->addrhi_reg = TARGET_LONG_BITS > TCG_TARGET_REG_BITS ? args[addrlo_idx + 1] : 0;
+    label->mem_index = mem_index;
+    label->label_ptr[1] = NULL;
+
     if(likely(s->use_tlb))
     {
-        tcg_out_tlb_load(s, addrlo_idx, mem_index, s_bits, args, label_ptr,
+        tcg_out_tlb_load(s, addrlo_idx, mem_index, s_bits, args, label->label_ptr,
             /*offsetof(CPUTLBEntry, addr_read)*/ tlb_entry_addr_read, r0, r1, type, rexw);
 
         /* TLB Hit.  */
         tcg_out_qemu_ld_direct(s, data_reg, data_reg2, tcg_target_call_iarg_regs[0], 0, opc);
+    } else {
+        /* jmp slow_path */
+        tcg_out8(s, OPC_JMP_long);
+        label->label_ptr[0] = s->code_ptr;
+        s->code_ptr += 4;
+    }
+    label->raddr = s->code_ptr;
+}
 
-        /* jmp label2 */
-        tcg_out8(s, OPC_JMP_short);
-        label_ptr[2] = s->code_ptr;
-        s->code_ptr++;
-
-        /* TLB Miss.  */
+/* jmp to an address in the current block, no relocation needed */
+static void tcg_out_jmp_in_block(TCGContext *s, uint8_t *dest)
+{
+    tcg_out8(s, OPC_JMP_long);
+    tcg_out32(s, dest - s->code_ptr - 4);
+}
 
-        /* label1: */
-        *label_ptr[0] = s->code_ptr - label_ptr[0] - 1;
-        if (TARGET_LONG_BITS > TCG_TARGET_REG_BITS) {
-            *label_ptr[1] = s->code_ptr - label_ptr[1] - 1;
-        }
+/* Emitted right after the helper call of a slow path. The first jump skips
+   the second one, which is never executed and only tells the helper where the
+   fast path of the access ends, see GETPC_LDST. */
+static void tcg_out_ldst_retaddr(TCGContext *s, uint8_t *raddr)
+{
+    tcg_out8(s, OPC_JMP_short);
+    tcg_out8(s, 5);
+    tcg_out_jmp_in_block(s, raddr);
+}
 
-    }
+static void tcg_out_qemu_ld_slow_path(TCGContext *s, TCGLdstLabel *label)
+{
+    int opc = label->opc;
+    int data_reg = label->datalo_reg;
+    int data_reg2 = label->datahi_reg;
+    int arg_idx;
 
-    /* XXX: move that code at the end of the TB */
     /* The first argument is already loaded with addrlo.  */
     arg_idx = 1;
     if (TCG_TARGET_REG_BITS == 32 && TARGET_LONG_BITS == 64) {
-        tcg_out_mov(s, TCG_TYPE_I32, tcg_target_call_iarg_regs[arg_idx++], args[addrlo_idx + 1]);
+        tcg_out_mov(s, TCG_TYPE_I32, tcg_target_call_iarg_regs[arg_idx++], label->addrhi_reg);
     }
-    tcg_out_movi(s, TCG_TYPE_I32, tcg_target_call_iarg_regs[arg_idx], mem_index);
+    tcg_out_movi(s, TCG_TYPE_I32, tcg_target_call_iarg_regs[arg_idx], label->mem_index);
 
-    switch (s_bits) {
+    switch (opc & 3) {
     case 0:
         tcg_out_calli(s, (tcg_target_long)tcg->ldb);
         break;
@@ -1157,6 +1208,7 @@ static void tcg_out_qemu_ld(TCGContext *s, const TCGArg *args, int opc)
     default:
         tcg_abort();
     }
+    tcg_out_ldst_retaddr(s, label->raddr);
 
     switch (opc) {
     case 0 | 4:
@@ -1195,11 +1247,7 @@ static void tcg_out_qemu_ld(TCGContext *s, const TCGArg *args, int opc)
         tcg_abort();
     }
 
-    if(likely(s->use_tlb))
-    {
-        /* label2: */
-        *label_ptr[2] = s->code_ptr - label_ptr[2] - 1;
-    }
+    tcg_out_jmp_in_block(s, label->raddr);
 }
 
 static void tcg_out_qemu_st_direct(TCGContext *s, int datalo, int datahi, int base, tcg_target_long ofs, int sizeop)
@@ -1265,8 +1313,7 @@ static void tcg_out_qemu_st(TCGContext *s, const TCGArg *args, int opc)
     int data_reg, data_reg2 = 0;
     int addrlo_idx;
     int mem_index, s_bits;
-    int stack_adjust;
-    uint8_t *label_ptr[3];
+    TCGLdstLabel *label;
 
     data_reg = args[0];
     addrlo_idx = 1;
@@ -1286,29 +1333,40 @@ static void tcg_out_qemu_st(TCGContext *s, const TCGArg *args, int opc)
 
     tcg_prepare_st_ld_args(s, type, rexw, r0, r1, args[addrlo_idx]);
 
+    label = tcg_new_ldst_label(s);
+    label->is_ld = 0;
+    label->opc = opc;
+    label->datalo_reg = data_reg;
+    label->datahi_reg = data_reg2;
+    label->addrlo_reg = args[addrlo_idx];
+    label->addrhi_reg = TARGET_LONG_BITS > TCG_TARGET_REG_BITS ? args[addrlo_idx + 1] : 0;
+    label->mem_index = mem_index;
+    label->label_ptr[1] = NULL;
+
     if(likely(s->use_tlb))
     {
-        tcg_out_tlb_load(s, addrlo_idx, mem_index, s_bits, args, label_ptr,
+        tcg_out_tlb_load(s, addrlo_idx, mem_index, s_bits, args, label->label_ptr,
                          /* offsetof(CPUTLBEntry, addr_write) */ tlb_entry_addr_write, r0, r1, type, rexw);
 
         /* TLB Hit.  */
         tcg_out_qemu_st_direct(s, data_reg, data_reg2, tcg_target_call_iarg_regs[0], 0, opc);
-
-        /* jmp label2 */
-        tcg_out8(s, OPC_JMP_short);
-        label_ptr[2] = s->code_ptr;
-        s->code_ptr++;
-
-        /* TLB Miss.  */
-
-        /* label1: */
-        *label_ptr[0] = s->code_ptr - label_ptr[0] - 1;
-        if (TARGET_LONG_BITS > TCG_TARGET_REG_BITS) {
-            *label_ptr[1] = s->code_ptr - label_ptr[1] - 1;
-        }
+    } else {
+        /* jmp slow_path */
+        tcg_out8(s, OPC_JMP_long);
+        label->label_ptr[0] = s->code_ptr;
+        s->code_ptr += 4;
     }
+    label->raddr = s->code_ptr;
+}
+
+static void tcg_out_qemu_st_slow_path(TCGContext *s, TCGLdstLabel *label)
+{
+    int opc = label->opc;
+    int data_reg = label->datalo_reg;
+    int data_reg2 = label->datahi_reg;
+    int mem_index = label->mem_index;
+    int stack_adjust;
 
-    /* XXX: move that code at the end of the TB */
     if (TCG_TARGET_REG_BITS == 64) {
         tcg_out_mov(s, (opc == 3 ? TCG_TYPE_I64 : TCG_TYPE_I32), tcg_target_call_iarg_regs[1], data_reg);
         tcg_out_movi(s, TCG_TYPE_I32, tcg_target_call_iarg_regs[2], mem_index);
@@ -1325,13 +1383,13 @@ static void tcg_out_qemu_st(TCGContext *s, const TCGArg *args, int opc)
         }
     } else {
         if (opc == 3) {
-            tcg_out_mov(s, TCG_TYPE_I32, TCG_REG_EDX, args[addrlo_idx + 1]);
+            tcg_out_mov(s, TCG_TYPE_I32, TCG_REG_EDX, label->addrhi_reg);
             tcg_out_pushi(s, mem_index);
             tcg_out_push(s, data_reg2);
             tcg_out_push(s, data_reg);
             stack_adjust = 12;
         } else {
-            tcg_out_mov(s, TCG_TYPE_I32, TCG_REG_EDX, args[addrlo_idx + 1]);
+            tcg_out_mov(s, TCG_TYPE_I32, TCG_REG_EDX, label->addrhi_reg);
             switch (opc) {
             case 0:
                 tcg_out_ext8u(s, TCG_REG_ECX, data_reg);
@@ -1348,7 +1406,7 @@ static void tcg_out_qemu_st(TCGContext *s, const TCGArg *args, int opc)
         }
     }
 
-    switch (s_bits) {
+    switch (opc) {
     case 0:
         tcg_out_calli(s, (tcg_target_long)tcg->stb);
         break;
@@ -1364,6 +1422,7 @@ static void tcg_out_qemu_st(TCGContext *s, const TCGArg *args, int opc)
     default:
         tcg_abort();
     }
+    tcg_out_ldst_retaddr(s, label->raddr);
 
     if (stack_adjust == (TCG_TARGET_REG_BITS / 8)) {
         /* Pop and discard.  This is 2 bytes smaller than the add.  */
@@ -1372,10 +1431,26 @@ static void tcg_out_qemu_st(TCGContext *s, const TCGArg *args, int opc)
         tcg_out_addi(s, TCG_REG_CALL_STACK, stack_adjust);
     }
 
-    if(likely(s->use_tlb))
-    {
-        /* label2: */
-        *label_ptr[2] = s->code_ptr - label_ptr[2] - 1;
+    tcg_out_jmp_in_block(s, label->raddr);
+}
+
+/* Emit the TLB-miss paths of the block after its body, so that the fast
+   paths stay straight-line code */
+static void tcg_out_ldst_finalize(TCGContext *s)
+{
+    TCGLdstLabel *label;
+    int i, j;
+
+    for (i = 0; i < s->nb_ldst_labels; i++) {
+        label = &s->ldst_labels[i];
+        for (j = 0; j < 2 && label->label_ptr[j] != NULL; j++) {
+            *(int32_t *)label->label_ptr[j] = s->code_ptr - label->label_ptr[j] - 4;
+        }
+        if (label->is_ld) {
+            tcg_out_qemu_ld_slow_path(s, label);
+        } else {
+            tcg_out_qemu_st_slow_path(s, label);
+        }
     }
 }
 
@@ -1398,7 +1473,12 @@ static inline void tcg_out_op(TCGContext *s, TCGOpcode opc,
 
     switch(opc) {
     case INDEX_op_exit_tb:
-        tcg_out_movi(s, TCG_TYPE_PTR, TCG_REG_EAX, args[0]);
+        /* the value is either 0 or the address of the TB with the index of the jump in the low bits */
+        if (args[0] != 0) {
+            tcg_out_movi_reloc(s, TCG_REG_EAX, args[0], 1);
+        } else {
+            tcg_out_movi(s, TCG_TYPE_PTR, TCG_REG_EAX, 0);
+        }
         tcg_out_jmp(s, (tcg_target_long) tb_ret_addr);
         break;
     case INDEX_op_goto_tb:
@@ -1414,6 +1494,13 @@ static inline void tcg_out_op(TCGContext *s, TCGOpcode opc,
         }
         s->tb_next_offset[args[0]] = s->code_ptr - s->code_buf;
         break;
+    case INDEX_op_goto_ptr:
+        /* jmp *reg */
+        tcg_out_modrm(s, OPC_GRP5, EXT5_JMPN_Ev, args[0]);
+        break;
+    case INDEX_op_movi_tb_ptr:
+        tcg_out_movi_reloc(s, args[0], args[1], 1);
+        break;
     case INDEX_op_call:
         if (const_args[0]) {
             tcg_out_calli(s, args[0]);
@@ -1764,6 +1851,8 @@ static inline void tcg_out_op(TCGContext *s, TCGOpcode opc,
 static const TCGTargetOpDef x86_op_defs[] = {
     { INDEX_op_exit_tb, { } },
     { INDEX_op_goto_tb, { } },
+    { INDEX_op_goto_ptr, { "r" } },
+    { INDEX_op_movi_tb_ptr, { "r" } },
     { INDEX_op_call, { "ri" } },
     { INDEX_op_jmp, { "ri" } },
     { INDEX_op_br, { } },
@@ -1964,6 +2053,10 @@ static void tcg_target_qemu_prologue(TCGContext *s)
     /* jmp *tb.  */
     tcg_out_modrm(s, OPC_GRP5, EXT5_JMPN_Ev, tcg_target_call_iarg_regs[1]);
 
+    /* return path for goto_ptr, set return value to 0 */
+    s->code_gen_epilogue = s->code_ptr;
+    tcg_out_movi(s, TCG_TYPE_PTR, TCG_REG_EAX, 0);
+
     /* TB epilogue */
     tb_ret_addr = s->code_ptr;
 
@@ -121,9 +121,12 @@ typedef enum {
 #define TCG_TARGET_HAS_orc_i64       0
 #define TCG_TARGET_HAS_qemu_st8_i32  0
 #define TCG_TARGET_HAS_rot_i64       1
+/* the addresses emitted into the code are recorded, see tcg_out_code_reloc */
+#define TCG_TARGET_HAS_code_relocs   1
 
 #else
 #define TCG_TARGET_HAS_qemu_st8_i32  1
+#define TCG_TARGET_HAS_code_relocs   0
 #endif
 
 // MOVBE isn't very common in non-Atom CPUs and it isn't currently supported by TCG.
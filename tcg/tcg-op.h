@@ -2585,11 +2585,13 @@ static inline void tcg_gen_umax_i64(TCGv_i64 ret, TCGv_i64 a, TCGv_i64 b)
 #if TARGET_LONG_BITS <= TCG_TARGET_REG_BITS
 static inline void tcg_gen_insn_start(target_ulong pc)
 {
+    tcg->ctx->insn_start_pc = pc;
     tcg_gen_op1i(INDEX_op_insn_start, pc);
 }
 #else
 static inline void tcg_gen_insn_start(target_ulong pc)
 {
+    tcg->ctx->insn_start_pc = pc;
     tcg_gen_op2ii(INDEX_op_insn_start, (uint32_t)pc, (uint32_t)(pc >> 32));
 }
 #endif
@@ -2597,11 +2599,13 @@ static inline void tcg_gen_insn_start(target_ulong pc)
 #if TARGET_LONG_BITS <= TCG_TARGET_REG_BITS
 static inline void tcg_gen_insn_start(target_ulong pc, target_ulong a1)
 {
+    tcg->ctx->insn_start_pc = pc;
     tcg_gen_op2ii(INDEX_op_insn_start, pc, a1);
 }
 #else
 static inline void tcg_gen_insn_start(target_ulong pc, target_ulong a1)
 {
+    tcg->ctx->insn_start_pc = pc;
     tcg_gen_op4iiii(INDEX_op_insn_start,
                 (uint32_t)pc, (uint32_t)(pc >> 32),
                 (uint32_t)a1, (uint32_t)(a1 >> 32));
@@ -2612,12 +2616,14 @@ static inline void tcg_gen_insn_start(target_ulong pc, target_ulong a1)
 static inline void tcg_gen_insn_start(target_ulong pc, target_ulong a1,
                                       target_ulong a2)
 {
+    tcg->ctx->insn_start_pc = pc;
     tcg_gen_op3iii(INDEX_op_insn_start, pc, a1, a2);
 }
 #else
 static inline void tcg_gen_insn_start(target_ulong pc, target_ulong a1,
                                       target_ulong a2)
 {
+    tcg->ctx->insn_start_pc = pc;
     tcg_gen_op6iiiiii(INDEX_op_insn_start,
                 (uint32_t)pc, (uint32_t)(pc >> 32),
                 (uint32_t)a1, (uint32_t)(a1 >> 32),
@@ -2638,9 +2644,13 @@ static inline void tcg_gen_goto_tb(int idx)
     tcg_gen_op1i(INDEX_op_goto_tb, idx);
 }
 
+/* Emits the recording of a guest memory access when the memory accesses are traced, see translate-all.c */
+void tcg_gen_mem_trace(TCGv addr, TCGMemOp memop, bool is_store);
+
 #if TCG_TARGET_REG_BITS == 32
 static inline void tcg_gen_qemu_ld8u(TCGv ret, TCGv addr, int mem_index)
 {
+    tcg_gen_mem_trace(addr, MO_8, false);
 #if TARGET_LONG_BITS == 32
     tcg_gen_op3i_i32(INDEX_op_qemu_ld8u, ret, addr, mem_index);
 #else
@@ -2651,6 +2661,7 @@ static inline void tcg_gen_qemu_ld8u(TCGv ret, TCGv addr, int mem_index)
 
 static inline void tcg_gen_qemu_ld8s(TCGv ret, TCGv addr, int mem_index)
 {
+    tcg_gen_mem_trace(addr, MO_8, false);
 #if TARGET_LONG_BITS == 32
     tcg_gen_op3i_i32(INDEX_op_qemu_ld8s, ret, addr, mem_index);
 #else
@@ -2661,6 +2672,7 @@ static inline void tcg_gen_qemu_ld8s(TCGv ret, TCGv addr, int mem_index)
 
 static inline void tcg_gen_qemu_ld16u(TCGv ret, TCGv addr, int mem_index)
 {
+    tcg_gen_mem_trace(addr, MO_16, false);
 #if TARGET_LONG_BITS == 32
     tcg_gen_op3i_i32(INDEX_op_qemu_ld16u, ret, addr, mem_index);
 #else
@@ -2671,6 +2683,7 @@ static inline void tcg_gen_qemu_ld16u(TCGv ret, TCGv addr, int mem_index)
 
 static inline void tcg_gen_qemu_ld16s(TCGv ret, TCGv addr, int mem_index)
 {
+    tcg_gen_mem_trace(addr, MO_16, false);
 #if TARGET_LONG_BITS == 32
     tcg_gen_op3i_i32(INDEX_op_qemu_ld16s, ret, addr, mem_index);
 #else
@@ -2681,6 +2694,7 @@ static inline void tcg_gen_qemu_ld16s(TCGv ret, TCGv addr, int mem_index)
 
 static inline void tcg_gen_qemu_ld32u(TCGv ret, TCGv addr, int mem_index)
 {
+    tcg_gen_mem_trace(addr, MO_32, false);
 #if TARGET_LONG_BITS == 32
     tcg_gen_op3i_i32(INDEX_op_qemu_ld32, ret, addr, mem_index);
 #else
@@ -2691,6 +2705,7 @@ static inline void tcg_gen_qemu_ld32u(TCGv ret, TCGv addr, int mem_index)
 
 static inline void tcg_gen_qemu_ld32s(TCGv ret, TCGv addr, int mem_index)
 {
+    tcg_gen_mem_trace(addr, MO_32, false);
 #if TARGET_LONG_BITS == 32
     tcg_gen_op3i_i32(INDEX_op_qemu_ld32, ret, addr, mem_index);
 #else
@@ -2701,6 +2716,7 @@ static inline void tcg_gen_qemu_ld32s(TCGv ret, TCGv addr, int mem_index)
 
 static inline void tcg_gen_qemu_ld64(TCGv_i64 ret, TCGv addr, int mem_index)
 {
+    tcg_gen_mem_trace(addr, MO_64, false);
 #if TARGET_LONG_BITS == 32
     tcg_gen_op4i_i32(INDEX_op_qemu_ld64, TCGV_LOW(ret), TCGV_HIGH(ret), addr, mem_index);
 #else
@@ -2710,6 +2726,7 @@ static inline void tcg_gen_qemu_ld64(TCGv_i64 ret, TCGv addr, int mem_index)
 
 static inline void tcg_gen_qemu_st8(TCGv arg, TCGv addr, int mem_index)
 {
+    tcg_gen_mem_trace(addr, MO_8, true);
 #if TARGET_LONG_BITS == 32
     tcg_gen_op3i_i32(INDEX_op_qemu_st8, arg, addr, mem_index);
 #else
@@ -2719,6 +2736,7 @@ static inline void tcg_gen_qemu_st8(TCGv arg, TCGv addr, int mem_index)
 
 static inline void tcg_gen_qemu_st16(TCGv arg, TCGv addr, int mem_index)
 {
+    tcg_gen_mem_trace(addr, MO_16, true);
 #if TARGET_LONG_BITS == 32
     tcg_gen_op3i_i32(INDEX_op_qemu_st16, arg, addr, mem_index);
 #else
@@ -2728,6 +2746,7 @@ static inline void tcg_gen_qemu_st16(TCGv arg, TCGv addr, int mem_index)
 
 static inline void tcg_gen_qemu_st32(TCGv arg, TCGv addr, int mem_index)
 {
+    tcg_gen_mem_trace(addr, MO_32, true);
 #if TARGET_LONG_BITS == 32
     tcg_gen_op3i_i32(INDEX_op_qemu_st32, arg, addr, mem_index);
 #else
@@ -2737,6 +2756,7 @@ static inline void tcg_gen_qemu_st32(TCGv arg, TCGv addr, int mem_index)
 
 static inline void tcg_gen_qemu_st64(TCGv_i64 arg, TCGv addr, int mem_index)
 {
+    tcg_gen_mem_trace(addr, MO_64, true);
 #if TARGET_LONG_BITS == 32
     tcg_gen_op4i_i32(INDEX_op_qemu_st64, TCGV_LOW(arg), TCGV_HIGH(arg), addr, mem_index);
 #else
@@ -2745,32 +2765,40 @@ static inline void tcg_gen_qemu_st64(TCGv_i64 arg, TCGv addr, int mem_index)
 }
 
 #define tcg_gen_ld_ptr(R, A, O) tcg_gen_ld_i32(TCGV_PTR_TO_NAT(R), (A), (O))
+#define tcg_gen_st_ptr(R, A, O) tcg_gen_st_i32(TCGV_PTR_TO_NAT(R), (A), (O))
 #define tcg_gen_discard_ptr(A)  tcg_gen_discard_i32(TCGV_PTR_TO_NAT(A))
+#define tcg_gen_goto_ptr(A)     tcg_gen_op1_i32(INDEX_op_goto_ptr, TCGV_PTR_TO_NAT(A))
+#define tcg_gen_movi_tb_ptr(R, TB) tcg_gen_op2i_i32(INDEX_op_movi_tb_ptr, TCGV_PTR_TO_NAT(R), (tcg_target_long)(TB))
 
 #else /* TCG_TARGET_REG_BITS == 32 */
 
 static inline void tcg_gen_qemu_ld8u(TCGv ret, TCGv addr, int mem_index)
 {
+    tcg_gen_mem_trace(addr, MO_8, false);
     tcg_gen_qemu_ldst_op(INDEX_op_qemu_ld8u, ret, addr, mem_index);
 }
 
 static inline void tcg_gen_qemu_ld8s(TCGv ret, TCGv addr, int mem_index)
 {
+    tcg_gen_mem_trace(addr, MO_8, false);
     tcg_gen_qemu_ldst_op(INDEX_op_qemu_ld8s, ret, addr, mem_index);
 }
 
 static inline void tcg_gen_qemu_ld16u(TCGv ret, TCGv addr, int mem_index)
 {
+    tcg_gen_mem_trace(addr, MO_16, false);
     tcg_gen_qemu_ldst_op(INDEX_op_qemu_ld16u, ret, addr, mem_index);
 }
 
 static inline void tcg_gen_qemu_ld16s(TCGv ret, TCGv addr, int mem_index)
 {
+    tcg_gen_mem_trace(addr, MO_16, false);
     tcg_gen_qemu_ldst_op(INDEX_op_qemu_ld16s, ret, addr, mem_index);
 }
 
 static inline void tcg_gen_qemu_ld32u(TCGv ret, TCGv addr, int mem_index)
 {
+    tcg_gen_mem_trace(addr, MO_32, false);
 #if TARGET_LONG_BITS == 32
     tcg_gen_qemu_ldst_op(INDEX_op_qemu_ld32, ret, addr, mem_index);
 #else
@@ -2780,6 +2808,7 @@ static inline void tcg_gen_qemu_ld32u(TCGv ret, TCGv addr, int mem_index)
 
 static inline void tcg_gen_qemu_ld32s(TCGv ret, TCGv addr, int mem_index)
 {
+    tcg_gen_mem_trace(addr, MO_32, false);
 #if TARGET_LONG_BITS == 32
     tcg_gen_qemu_ldst_op(INDEX_op_qemu_ld32, ret, addr, mem_index);
 #else
@@ -2789,31 +2818,40 @@ static inline void tcg_gen_qemu_ld32s(TCGv ret, TCGv addr, int mem_index)
 
 static inline void tcg_gen_qemu_ld64(TCGv_i64 ret, TCGv addr, int mem_index)
 {
+    tcg_gen_mem_trace(addr, MO_64, false);
     tcg_gen_qemu_ldst_op_i64(INDEX_op_qemu_ld64, ret, addr, mem_index);
 }
 
 static inline void tcg_gen_qemu_st8(TCGv arg, TCGv addr, int mem_index)
 {
+    tcg_gen_mem_trace(addr, MO_8, true);
     tcg_gen_qemu_ldst_op(INDEX_op_qemu_st8, arg, addr, mem_index);
 }
 
 static inline void tcg_gen_qemu_st16(TCGv arg, TCGv addr, int mem_index)
 {
+    tcg_gen_mem_trace(addr, MO_16, true);
     tcg_gen_qemu_ldst_op(INDEX_op_qemu_st16, arg, addr, mem_index);
 }
 
 static inline void tcg_gen_qemu_st32(TCGv arg, TCGv addr, int mem_index)
 {
+    tcg_gen_mem_trace(addr, MO_32, true);
     tcg_gen_qemu_ldst_op(INDEX_op_qemu_st32, arg, addr, mem_index);
 }
 
 static inline void tcg_gen_qemu_st64(TCGv_i64 arg, TCGv addr, int mem_index)
 {
+    tcg_gen_mem_trace(addr, MO_64, true);
     tcg_gen_qemu_ldst_op_i64(INDEX_op_qemu_st64, arg, addr, mem_index);
 }
 
 #define tcg_gen_ld_ptr(R, A, O) tcg_gen_ld_i64(TCGV_PTR_TO_NAT(R), (A), (O))
+#define tcg_gen_st_ptr(R, A, O) tcg_gen_st_i64(TCGV_PTR_TO_NAT(R), (A), (O))
 #define tcg_gen_discard_ptr(A)  tcg_gen_discard_i64(TCGV_PTR_TO_NAT(A))
+#define tcg_gen_goto_ptr(A)     tcg_gen_op1_i64(INDEX_op_goto_ptr, TCGV_PTR_TO_NAT(A))
+/* unlike a constant, the backend knows this address has to be relocated when the code is moved to another process */
+#define tcg_gen_movi_tb_ptr(R, TB) tcg_gen_op2i_i64(INDEX_op_movi_tb_ptr, TCGV_PTR_TO_NAT(R), (tcg_target_long)(TB))
 
 #endif /* TCG_TARGET_REG_BITS != 32 */
 
@@ -2906,6 +2944,7 @@ static inline void tcg_gen_qemu_ld_i32(TCGv_i32 val, TCGv addr, TCGArg idx, TCGM
         }
     }
 
+    tcg_gen_mem_trace(addr, memop, false);
     tcg_gen_qemu_ldst_op(old_ld_opc[memop & MO_SSIZE], val, addr, idx);
 
     if ((orig_memop ^ memop) & MO_BSWAP) {
@@ -2947,6 +2986,7 @@ static inline void tcg_gen_qemu_st_i32(TCGv_i32 val, TCGv_i32 addr, TCGArg idx,
         val = swap;
         memop &= ~MO_BSWAP;
     }
+    tcg_gen_mem_trace(addr, memop, true);
     tcg_gen_qemu_ldst_op(old_st_opc[memop & MO_SIZE], val, addr, idx);
 
     if (swap != -1) {
@@ -2980,6 +3020,7 @@ static inline void tcg_gen_qemu_ld_i64(TCGv_i64 val, TCGv addr, TCGArg idx, TCGM
         }
     }
 
+    tcg_gen_mem_trace(addr, memop, false);
     tcg_gen_qemu_ldst_op_i64(old_ld_opc[memop & MO_SSIZE], val, addr, idx);
 
     if ((orig_memop ^ memop) & MO_BSWAP) {
@@ -3038,6 +3079,7 @@ static inline void tcg_gen_qemu_st_i64(TCGv_i64 val, TCGv addr, TCGArg idx, TCGM
         memop &= ~MO_BSWAP;
     }
 
+    tcg_gen_mem_trace(addr, memop, true);
     tcg_gen_qemu_ldst_op(old_st_opc[memop & MO_SIZE], val, addr, idx);
 
     if (swap != -1) {
@@ -3849,6 +3891,8 @@ void tcg_gen_stl_vec(TCGv_vec r, TCGv_ptr base, TCGArg offset, TCGType t);
 #define tcg_gen_addi_ptr(R, A, B) tcg_gen_addi_i32(TCGV_PTR_TO_NAT(R), \
                                                  TCGV_PTR_TO_NAT(A), (B))
 #define tcg_gen_ext_i32_ptr(R, A) tcg_gen_mov_i32(TCGV_PTR_TO_NAT(R), (A))
+#define tcg_gen_brcond_ptr(C, A, B, L) tcg_gen_brcond_i32((C), TCGV_PTR_TO_NAT(A), \
+                                                   TCGV_PTR_TO_NAT(B), (L))
 #else /* TCG_TARGET_REG_BITS == 32 */
 #define tcg_gen_add_ptr(R, A, B)  tcg_gen_add_i64(TCGV_PTR_TO_NAT(R),\
                                                TCGV_PTR_TO_NAT(A), \
@@ -3856,6 +3900,8 @@ void tcg_gen_stl_vec(TCGv_vec r, TCGv_ptr base, TCGArg offset, TCGType t);
 #define tcg_gen_addi_ptr(R, A, B) tcg_gen_addi_i64(TCGV_PTR_TO_NAT(R),   \
                                                  TCGV_PTR_TO_NAT(A), (B))
 #define tcg_gen_ext_i32_ptr(R, A) tcg_gen_ext_i32_i64(TCGV_PTR_TO_NAT(R), (A))
+#define tcg_gen_brcond_ptr(C, A, B, L) tcg_gen_brcond_i64((C), TCGV_PTR_TO_NAT(A), \
+                                                   TCGV_PTR_TO_NAT(B), (L))
 #endif /* TCG_TARGET_REG_BITS != 32 */
 
 #endif
@@ -26,6 +26,13 @@
 // #define USE_LIVENESS_ANALYSIS
 // #define USE_TCG_OPTIMIZATIONS
 
+/* without it only the blocks asking for it through TCGContext.optimize are optimized */
+#ifdef USE_TCG_OPTIMIZATIONS
+#define TCG_OPTIMIZE_ALL_BLOCKS 1
+#else
+#define TCG_OPTIMIZE_ALL_BLOCKS 0
+#endif
+
 #include "additional.h"
 #include <stdarg.h>
 #include <stdlib.h>
@@ -51,6 +58,7 @@
 static void tcg_target_init(TCGContext *s);
 static void tcg_target_qemu_prologue(TCGContext *s);
 static void patch_reloc(uint8_t *code_ptr, int type, tcg_target_long value, tcg_target_long addend);
+static void tcg_out_ldst_finalize(TCGContext *s);
 
 /* Forward declarations for functions declared and used in tcg-target.c. */
 static int target_parse_constraint(TCGArgConstraint *ct, const char **pct_str);
@@ -151,6 +159,31 @@ int gen_new_label(void)
     return idx;
 }
 
+/* Record an address the backend has just emitted at 'field', see TCGCodeReloc */
+static inline void tcg_out_code_reloc(TCGContext *s, uint8_t *field, int type, int tb_relative, tcg_target_long target)
+{
+    TCGCodeReloc *reloc;
+
+    if (s->nb_code_relocs == TCG_MAX_CODE_RELOCS) {
+        s->code_position_dependent = 1;
+        return;
+    }
+    reloc = &s->code_relocs[s->nb_code_relocs++];
+    reloc->offset = field - s->code_buf;
+    reloc->type = type;
+    reloc->tb_relative = tb_relative;
+    reloc->target = target;
+}
+
+/* Record a qemu_ld/st op whose TLB-miss path goes to the end of the block */
+static inline TCGLdstLabel *tcg_new_ldst_label(TCGContext *s)
+{
+    if (s->nb_ldst_labels >= TCG_MAX_LDST_LABELS) {
+        tcg_abort();
+    }
+    return &s->ldst_labels[s->nb_ldst_labels++];
+}
+
 #include "tcg-target.c"
 
 /* pool based memory allocation */
@@ -224,6 +257,9 @@ static uint8_t code_gen_prologue[1024] code_gen_section;
 static TCGContext ctx;
 static TCGArg gen_opparam_buf[OPPARAM_BUF_SIZE];
 static uint16_t gen_opc_buf[OPC_BUF_SIZE];
+/* allocated only once the memory accesses get traced, see tcg_use_mem_trace_buffers */
+static TCGArg *gen_opparam_mem_trace_buf;
+static uint16_t *gen_opc_mem_trace_buf;
 
 static uint16_t gen_insn_end_off[TCG_MAX_INSNS];
 static target_ulong gen_insn_data[TCG_MAX_INSNS][TARGET_INSN_START_WORDS];
@@ -280,12 +316,35 @@ void tcg_context_use_tlb(int value)
     tcg->ctx->use_tlb = !!value;
 }
 
+void tcg_context_allow_unaligned(int value)
+{
+    tcg->ctx->allow_unaligned = !!value;
+}
+
 void tcg_dispose()
 {
     TCG_free(tcg_op_defs[0].args_ct);
     TCG_free(tcg_op_defs[0].sorted_args);
     tcg_pool_free(tcg->ctx);
     TCG_free(tcg->ctx->helpers);
+    if (gen_opc_mem_trace_buf != NULL) {
+        TCG_free(gen_opc_mem_trace_buf);
+        TCG_free(gen_opparam_mem_trace_buf);
+        gen_opc_mem_trace_buf = NULL;
+        gen_opparam_mem_trace_buf = NULL;
+    }
+}
+
+/* The ops recording the memory accesses do not fit in the static buffers,
+   switch to the larger ones; they are kept until the context is disposed */
+void tcg_use_mem_trace_buffers()
+{
+    if (gen_opc_mem_trace_buf == NULL) {
+        gen_opc_mem_trace_buf = TCG_malloc(OPC_MEM_TRACE_BUF_SIZE * sizeof(uint16_t));
+        gen_opparam_mem_trace_buf = TCG_malloc(OPPARAM_MEM_TRACE_BUF_SIZE * sizeof(TCGArg));
+    }
+    tcg->gen_opc_buf = gen_opc_mem_trace_buf;
+    tcg->gen_opparam_buf = gen_opparam_mem_trace_buf;
 }
 
 void tcg_prologue_init()
@@ -315,6 +374,7 @@ void tcg_func_start(TCGContext *s)
     s->labels = tcg_malloc(sizeof(TCGLabel) * TCG_MAX_LABELS);
     s->nb_labels = 0;
     s->current_frame_offset = s->frame_start;
+    s->code_position_dependent = !TCG_TARGET_HAS_code_relocs;
 
     gen_opc_ptr = tcg->gen_opc_buf;
     gen_opparam_ptr = tcg->gen_opparam_buf;
@@ -1664,6 +1724,10 @@ static int tcg_reg_alloc_call(TCGContext *s, const TCGOpDef *def, TCGOpcode opc,
     ts = &s->temps[func_arg];
     func_addr = ts->val;
     const_func_arg = 0;
+    if (ts->val_type != TEMP_VAL_CONST) {
+        /* the address of the function is loaded without a relocation */
+        s->code_position_dependent = 1;
+    }
     if (ts->val_type == TEMP_VAL_MEM) {
         reg = tcg_reg_alloc(s, arg_ct->u.regs, allocated_regs);
         tcg_out_ld(s, ts->type, reg, ts->mem_reg, ts->mem_offset);
@@ -1684,6 +1748,7 @@ static int tcg_reg_alloc_call(TCGContext *s, const TCGOpDef *def, TCGOpcode opc,
         } else {
             reg = tcg_reg_alloc(s, arg_ct->u.regs, allocated_regs);
             tcg_out_movi(s, ts->type, reg, func_addr);
+            s->code_position_dependent = 1;
             func_arg = reg;
             tcg_regset_set_reg(allocated_regs, reg);
         }
@@ -1756,16 +1821,18 @@ static inline int tcg_gen_code_common(TCGContext *s, uint8_t *gen_code_buf)
     unsigned int dead_args;
     const TCGArg *args;
 
-#ifdef USE_TCG_OPTIMIZATIONS
-    gen_opparam_ptr =
-        tcg_optimize(s, gen_opc_ptr, tcg->gen_opparam_buf, tcg_op_defs);
-#endif
+    if (TCG_OPTIMIZE_ALL_BLOCKS || s->optimize) {
+        gen_opparam_ptr =
+            tcg_optimize(s, gen_opc_ptr, tcg->gen_opparam_buf, tcg_op_defs);
+    }
 
     tcg_liveness_analysis(s);
 
     tcg_reg_alloc_start(s);
     s->code_buf = gen_code_buf;
     s->code_ptr = gen_code_buf;
+    s->nb_code_relocs = 0;
+    s->nb_ldst_labels = 0;
 
     args = tcg->gen_opparam_buf;
     op_index = 0;
@@ -1854,6 +1921,8 @@ the_end:
     if (num_insns >= 0) {
         tcg->gen_insn_end_off[num_insns] = tcg_current_code_size(s);
     }
+    /* the slow paths belong to no instruction, their helpers find the access through GETPC_LDST */
+    tcg_out_ldst_finalize(s);
     return -1;
 }
 
@@ -64,9 +64,6 @@ typedef uint64_t target_ulong __attribute__((aligned(TARGET_LONG_ALIGNMENT)));
 #define CPU_TEMP_BUF_NLONGS 128
 #define TCG_TARGET_REG_BITS HOST_LONG_BITS
 
-#define CPU_TLB_BITS        8
-#define CPU_TLB_SIZE        (1 << CPU_TLB_BITS)
-
 //// END
 
 #include <stdbool.h>
@@ -475,6 +472,37 @@ typedef struct TCGHelperInfo {
 
 typedef struct TCGContext TCGContext;
 
+/* An address embedded in the generated code of a block, recorded so that the
+   code can be moved to another process */
+typedef struct TCGCodeReloc {
+    uint32_t offset;     /* of the address field from the start of the code */
+    uint8_t type;        /* TCG_CODE_RELOC_* */
+    uint8_t tb_relative; /* the address points into the TranslationBlock, not into the library */
+    tcg_target_long target;
+} TCGCodeReloc;
+
+#define TCG_CODE_RELOC_ABS64 0
+#define TCG_CODE_RELOC_REL32 1 /* relative to the end of the field */
+
+#define TCG_MAX_CODE_RELOCS 1024
+
+/* A qemu_ld/st op whose TLB-miss path is emitted after the body of the
+   block by tcg_out_ldst_finalize, out of the way of the fast path */
+typedef struct TCGLdstLabel {
+    uint8_t is_ld;
+    uint8_t opc;
+    int addrlo_reg;
+    int addrhi_reg;
+    int datalo_reg;
+    int datahi_reg;
+    int mem_index;
+    uint8_t *raddr;        /* end of the fast path, the slow path returns here */
+    uint8_t *label_ptr[2]; /* branches to the slow path, patched when it is emitted */
+} TCGLdstLabel;
+
+/* there can't be more qemu_ld/st ops in a block than ops in total */
+#define TCG_MAX_LDST_LABELS OPC_BUF_SIZE
+
 struct TCGContext {
     uint8_t *pool_cur, *pool_end;
     TCGPool *pool_first, *pool_current;
@@ -491,6 +519,19 @@ struct TCGContext {
     uintptr_t *tb_next;
     uint16_t *tb_next_offset;
     uint16_t *tb_jmp_offset;
+    /* goto_ptr jumps here to exit to the main loop with 0 */
+    uint8_t *code_gen_epilogue;
+    /* run tcg_optimize on the current block, see USE_TCG_OPTIMIZATIONS */
+    int optimize;
+    /* the addresses embedded in the code of the current block, if the backend
+       records them (TCG_TARGET_HAS_code_relocs) */
+    TCGCodeReloc code_relocs[TCG_MAX_CODE_RELOCS];
+    int nb_code_relocs;
+    /* the code embeds an address with no relocation, see tcg_const_host_ptr */
+    int code_position_dependent;
+    /* the TLB-miss paths still to be emitted at the end of the block */
+    TCGLdstLabel ldst_labels[TCG_MAX_LDST_LABELS];
+    int nb_ldst_labels;
 
     /* liveness analysis */
     uint16_t *op_dead_args; /* for each operation, each bit tells if the
@@ -514,6 +555,10 @@ struct TCGContext {
     int helpers_sorted;
     /* sets whether we should use the tlb in accesses */
     uint8_t use_tlb;
+    /* sets whether the unaligned accesses within a page may take the TLB hit path */
+    uint8_t allow_unaligned;
+    /* the guest pc of the instruction being translated, see tcg_gen_insn_start */
+    uint64_t insn_start_pc;
 };
 
 extern uint16_t *gen_opc_ptr;
@@ -580,7 +625,9 @@ static inline void *tcg_malloc(int size)
 
 void tcg_context_init();
 void tcg_context_use_tlb(int value);
+void tcg_context_allow_unaligned(int value);
 void tcg_dispose();
+void tcg_use_mem_trace_buffers();
 void tcg_prologue_init();
 void tcg_func_start(TCGContext *s);
 
@@ -726,6 +773,14 @@ TCGv_i64 tcg_const_i64(int64_t val);
 TCGv_i32 tcg_const_local_i32(int32_t val);
 TCGv_i64 tcg_const_local_i64(int64_t val);
 
+/* A constant holding the address of an object of this process that is not a
+   helper; the code using it cannot be moved to another process */
+static inline TCGv_ptr tcg_const_host_ptr(const void *ptr)
+{
+    tcg->ctx->code_position_dependent = 1;
+    return tcg_const_ptr((tcg_target_long)ptr);
+}
+
 /* Test for whether to terminate the TB for using too many opcodes.  */
 static inline bool tcg_op_buf_full(void)
 {
@@ -0,0 +1,20 @@
+# Writes the hash of the tlib sources and build settings listed by CMakeLists.txt
+# to the OUTPUT header. It is run at build time, by the tlib_source_hash target.
+# The header is only rewritten when the hash changes.
+
+file (STRINGS ${SOURCES_LIST} SOURCES)
+file (READ ${SETTINGS} HASHES)
+foreach (SOURCE ${SOURCES})
+    file (SHA1 ${SOURCE} SOURCE_HASH)
+    set (HASHES "${HASHES}${SOURCE_HASH}")
+endforeach ()
+string (SHA1 HASH "${HASHES}")
+
+set (CONTENT "#define TLIB_SOURCE_HASH \"${HASH}\"\n")
+set (OLD_CONTENT "")
+if (EXISTS ${OUTPUT})
+    file (READ ${OUTPUT} OLD_CONTENT)
+endif ()
+if (NOT "${OLD_CONTENT}" STREQUAL "${CONTENT}")
+    file (WRITE ${OUTPUT} "${CONTENT}")
+endif ()